@@ -53,15 +53,24 @@ enum
 {
 	ARG_0,
 	ARG_BITRATE,
-	ARG_INPUT_MODE
+	ARG_INPUT_MODE,
+	ARG_BUFFER_LIST,
+	ARG_GAP_EVENTS
 };
 
 static guint gst_dreamaudiosource_signals[LAST_SIGNAL] = { 0 };
 
 #define DEFAULT_BITRATE     128
 #define DEFAULT_SAMPLERATE  48000
+#define DEFAULT_CHANNELS    2
 #define DEFAULT_INPUT_MODE  GST_DREAMAUDIOSOURCE_INPUT_MODE_LIVE
 #define DEFAULT_BUFFER_SIZE 26
+#define DEFAULT_BUFFER_LIST FALSE
+#define DEFAULT_GAP_EVENTS  FALSE
+
+#define GAP_MARKER(buf)     (gst_buffer_get_size (buf) == 0 && GST_BUFFER_FLAG_IS_SET ((buf), GST_BUFFER_FLAG_GAP))
+
+static const gint adts_sample_rates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
 
 static GstStaticPadTemplate srctemplate =
     GST_STATIC_PAD_TEMPLATE ("src",
@@ -69,7 +78,8 @@ static GstStaticPadTemplate srctemplate =
 	GST_PAD_ALWAYS,
 	GST_STATIC_CAPS	("audio/mpeg, "
 	"mpegversion = 4,"
-	"stream-format = (string) adts,"
+	"stream-format = (string) { adts, raw },"
+	"framed = (boolean) true,"
 	"rate = 48000")
     );
 
@@ -77,6 +87,8 @@ static GstStaticPadTemplate srctemplate =
 G_DEFINE_TYPE (GstDreamAudioSource, gst_dreamaudiosource, GST_TYPE_PUSH_SRC);
 
 static GstCaps *gst_dreamaudiosource_getcaps (GstBaseSrc * bsrc, GstCaps * filter);
+static gboolean gst_dreamaudiosource_set_caps (GstBaseSrc * bsrc, GstCaps * caps);
+static gboolean gst_dreamaudiosource_negotiate (GstBaseSrc * bsrc);
 static gboolean gst_dreamaudiosource_unlock (GstBaseSrc * bsrc);
 static gboolean gst_dreamaudiosource_unlock_stop (GstBaseSrc * bsrc);
 static gboolean gst_dreamaudiosource_query (GstBaseSrc * bsrc, GstQuery * query);
@@ -93,7 +105,9 @@ static gint64 gst_dreamaudiosource_get_dts_offset (GstDreamAudioSource *self);
 static gboolean gst_dreamaudiosource_encoder_init (GstDreamAudioSource * self);
 static void gst_dreamaudiosource_encoder_release (GstDreamAudioSource * self);
 
-static void gst_dreamaudiosource_read_thread_func (GstDreamAudioSource * self);
+static void gst_dreamaudiosource_encoder_cb (GstDreamAudioSource * self, guint32 events);
+static void gst_dreamaudiosource_control_cb (GstDreamAudioSource * self, guint32 events);
+static void gst_dreamaudiosource_gap_cb (GstDreamAudioSource * self, guint32 events);
 
 #ifdef PROVIDE_CLOCK
 static GstClock *gst_dreamaudiosource_provide_clock (GstElement * elem);
@@ -130,6 +144,8 @@ gst_dreamaudiosource_class_init (GstDreamAudioSourceClass * klass)
 	gstelement_class->change_state = gst_dreamaudiosource_change_state;
 
 	gstbasesrc_class->get_caps = gst_dreamaudiosource_getcaps;
+	gstbasesrc_class->set_caps = gst_dreamaudiosource_set_caps;
+	gstbasesrc_class->negotiate = gst_dreamaudiosource_negotiate;
 	gstbasesrc_class->unlock = gst_dreamaudiosource_unlock;
 	gstbasesrc_class->unlock_stop = gst_dreamaudiosource_unlock_stop;
 	gstbasesrc_class->query = gst_dreamaudiosource_query;
@@ -152,6 +168,16 @@ gst_dreamaudiosource_class_init (GstDreamAudioSourceClass * klass)
 	    GST_TYPE_DREAMAUDIOSOURCE_INPUT_MODE, DEFAULT_INPUT_MODE,
 	    G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+	g_object_class_install_property (gobject_class, ARG_BUFFER_LIST,
+	  g_param_spec_boolean ("buffer-list", "Buffer List",
+	    "Push all queued frames downstream at once as a buffer list", DEFAULT_BUFFER_LIST,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_GAP_EVENTS,
+	  g_param_spec_boolean ("gap-events", "Gap Events",
+	    "Send GAP events instead of silence frames while the encoder delivers no audio", DEFAULT_GAP_EVENTS,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 	gst_dreamaudiosource_signals[SIGNAL_GET_DTS_OFFSET] =
 		g_signal_new ("get-dts-offset",
 		G_TYPE_FROM_CLASS (klass),
@@ -171,8 +197,12 @@ gst_dreamaudiosource_class_init (GstDreamAudioSourceClass * klass)
 static gint64
 gst_dreamaudiosource_get_dts_offset (GstDreamAudioSource *self)
 {
-	GST_DEBUG_OBJECT (self, "gst_dreamaudiosource_get_dts_offset %" GST_TIME_FORMAT"", GST_TIME_ARGS (self->dts_offset) );
-	return self->dts_offset;
+	gint64 dts_offset;
+	GST_OBJECT_LOCK (self);
+	dts_offset = self->dts_offset;
+	GST_OBJECT_UNLOCK (self);
+	GST_DEBUG_OBJECT (self, "gst_dreamaudiosource_get_dts_offset %" GST_TIME_FORMAT"", GST_TIME_ARGS (dts_offset) );
+	return dts_offset;
 }
 
 static void _gst_dreamaudiosource_emit_signal_lost (GstDreamAudioSource *self)
@@ -260,15 +290,29 @@ gst_dreamaudiosource_init (GstDreamAudioSource * self)
 	self->encoder = NULL;
 	self->descriptors_available = 0;
 	self->input_mode = DEFAULT_INPUT_MODE;
+	gst_dreamsource_unwrapper_init (&self->pts_unwrapper, MPEGTIME_BITS);
 
 	self->buffer_size = DEFAULT_BUFFER_SIZE;
-	g_queue_init (&self->current_frames);
-	self->readthread = NULL;
+	self->buffer_list = DEFAULT_BUFFER_LIST;
+	self->current_frames = NULL;
+	self->encoder_watch = NULL;
+	self->control_watch = NULL;
+	self->gap_watch = NULL;
+	self->gap_timer = -1;
+	self->gap_events = DEFAULT_GAP_EVENTS;
+	self->gap_active = FALSE;
+	self->silence = NULL;
+	self->gap_silence = NULL;
+	self->raw_output = FALSE;
+	self->codec_data = NULL;
+	self->caps_pending = FALSE;
+	self->pending_gap = NULL;
 
 	g_mutex_init (&self->mutex);
-	g_cond_init (&self->cond);
-	READ_SOCKET (self) = -1;
-	WRITE_SOCKET (self) = -1;
+	g_cond_init (&self->release_cond);
+	self->release_pending = FALSE;
+	self->control.word = READTHREADSTATE_NONE;
+	self->control.fd = -1;
 
 	gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
 	gst_base_src_set_live (GST_BASE_SRC (self), TRUE);
@@ -276,6 +320,7 @@ gst_dreamaudiosource_init (GstDreamAudioSource * self)
 	self->encoder = NULL;
 	self->encoder_clock = NULL;
 	self->last_ts = GST_CLOCK_TIME_NONE;
+	self->ts_anchor = GST_CLOCK_TIME_NONE;
 
 #ifdef dump
 	self->dumpfd = open("/media/hdd/movie/dreamaudiosource.dump", O_WRONLY | O_CREAT | O_TRUNC);
@@ -293,6 +338,8 @@ static gboolean gst_dreamaudiosource_encoder_init (GstDreamAudioSource * self)
 		return FALSE;
 	}
 
+	self->encoder->memtracker = NULL;
+
 	char fn_buf[32];
 	sprintf(fn_buf, "/dev/aenc%d", 0);
 	self->encoder->fd = open(fn_buf, O_RDWR | O_SYNC);
@@ -317,22 +364,23 @@ static gboolean gst_dreamaudiosource_encoder_init (GstDreamAudioSource * self)
 		return FALSE;
 	}
 
-	int control_sock[2];
-	if (socketpair (PF_UNIX, SOCK_STREAM, 0, control_sock) < 0)
+	if (!gst_dreamsource_control_init (&self->control))
+	{
+		GST_ERROR_OBJECT(self, "cannot create control channel");
+		return FALSE;
+	}
+
+	self->gap_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (self->gap_timer < 0)
 	{
-		GST_ERROR_OBJECT(self, "cannot create control sockets: %s (%i)", strerror(errno), errno);
+		GST_ERROR_OBJECT(self, "cannot create gap timer: %s (%i)", strerror(errno), errno);
 		return FALSE;
 	}
-	READ_SOCKET (self) = control_sock[0];
-	WRITE_SOCKET (self) = control_sock[1];
-	fcntl (READ_SOCKET (self), F_SETFL, O_NONBLOCK);
-	fcntl (WRITE_SOCKET (self), F_SETFL, O_NONBLOCK);
 
-	self->memtrack_list = NULL;
-	self->encoder->used_range_min = UINT32_MAX;
-	self->encoder->used_range_max = 0;
+	self->encoder->memtracker = gst_dreamsource_memtracker_new (AMEMTRACKSIZE);
 
 	self->audio_info.samplerate = DEFAULT_SAMPLERATE;
+	self->audio_info.channels = DEFAULT_CHANNELS;
 	gst_dreamaudiosource_set_bitrate (self, self->audio_info.bitrate);
 	gst_dreamaudiosource_set_input_mode (self, self->input_mode);
 
@@ -356,13 +404,17 @@ static void gst_dreamaudiosource_encoder_release (GstDreamAudioSource * self)
 			munmap(self->encoder->cdb, AMMAPSIZE);
 		if (self->encoder->fd)
 			close(self->encoder->fd);
+		if (self->encoder->memtracker)
+			gst_dreamsource_memtracker_unref (self->encoder->memtracker);
 		free(self->encoder);
 	}
 	self->encoder = NULL;
-	close (READ_SOCKET (self));
-	close (WRITE_SOCKET (self));
-	READ_SOCKET (self) = -1;
-	WRITE_SOCKET (self) = -1;
+	gst_dreamsource_control_clear (&self->control);
+	if (self->gap_timer >= 0)
+		close (self->gap_timer);
+	self->gap_timer = -1;
+	gst_buffer_replace (&self->silence, NULL);
+	gst_buffer_replace (&self->codec_data, NULL);
 	if (self->encoder_clock) {
 		gst_object_unref (self->encoder_clock);
 		self->encoder_clock = NULL;
@@ -381,6 +433,16 @@ gst_dreamaudiosource_set_property (GObject * object, guint prop_id, const GValue
 		case ARG_INPUT_MODE:
 			     gst_dreamaudiosource_set_input_mode (self, g_value_get_enum (value));
 			break;
+		case ARG_BUFFER_LIST:
+			g_mutex_lock (&self->mutex);
+			self->buffer_list = g_value_get_boolean (value);
+			g_mutex_unlock (&self->mutex);
+			break;
+		case ARG_GAP_EVENTS:
+			GST_OBJECT_LOCK (self);
+			self->gap_events = g_value_get_boolean (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -399,6 +461,14 @@ gst_dreamaudiosource_get_property (GObject * object, guint prop_id, GValue * val
 		case ARG_INPUT_MODE:
 			g_value_set_enum (value, gst_dreamaudiosource_get_input_mode (self));
 			break;
+		case ARG_BUFFER_LIST:
+			g_value_set_boolean (value, self->buffer_list);
+			break;
+		case ARG_GAP_EVENTS:
+			GST_OBJECT_LOCK (self);
+			g_value_set_boolean (value, self->gap_events);
+			GST_OBJECT_UNLOCK (self);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -428,6 +498,121 @@ gst_dreamaudiosource_getcaps (GstBaseSrc * bsrc, GstCaps * filter)
 	return caps;
 }
 
+/* builds one ADTS frame of AAC LC silence, the header bits are those of the negotiated format */
+static GstBuffer *gst_dreamaudiosource_silence_new (GstDreamAudioSource * self, gint samplerate, gint channels)
+{
+	static const guint8 silence_mono[] = { 0x00, 0xc8, 0x00, 0x80, 0x23, 0x80 };
+	static const guint8 silence_stereo[] = { 0x21, 0x10, 0x04, 0x60, 0x8c, 0x1c };
+	const guint8 *payload = silence_stereo;
+	gsize payload_len = sizeof (silence_stereo);
+	gint index;
+	guint8 *frame;
+	gsize len;
+
+	for (index = 0; index < G_N_ELEMENTS (adts_sample_rates); index++)
+		if (adts_sample_rates[index] == samplerate)
+			break;
+	if (index == G_N_ELEMENTS (adts_sample_rates))
+	{
+		GST_ERROR_OBJECT (self, "sample rate %i can't be signalled in ADTS", samplerate);
+		return NULL;
+	}
+
+	if (channels == 1)
+	{
+		payload = silence_mono;
+		payload_len = sizeof (silence_mono);
+	}
+	else if (channels != 2)
+	{
+		GST_WARNING_OBJECT (self, "no silence frame for %i channels, using stereo", channels);
+		channels = 2;
+	}
+
+	len = ADTS_HEADER_LEN + payload_len;
+	frame = g_malloc (len);
+	frame[0] = 0xff;
+	frame[1] = 0xf1;                                  /* MPEG-4, no CRC */
+	frame[2] = (1 << 6) | (index << 2) | (channels >> 2);   /* AAC LC */
+	frame[3] = ((channels & 3) << 6) | (len >> 11);
+	frame[4] = (len >> 3) & 0xff;
+	frame[5] = ((len & 7) << 5) | 0x1f;               /* buffer fullness 0x7ff, VBR */
+	frame[6] = 0xfc;
+	memcpy (frame + ADTS_HEADER_LEN, payload, payload_len);
+	return gst_buffer_new_wrapped (frame, len);
+}
+
+static gboolean gst_dreamaudiosource_set_caps (GstBaseSrc * bsrc, GstCaps * caps)
+{
+	GstDreamAudioSource *self = GST_DREAMAUDIOSOURCE (bsrc);
+	GstStructure *structure = gst_caps_get_structure (caps, 0);
+	gint samplerate = DEFAULT_SAMPLERATE, channels = DEFAULT_CHANNELS;
+	GstBuffer *silence;
+
+	gst_structure_get_int (structure, "rate", &samplerate);
+	gst_structure_get_int (structure, "channels", &channels);
+
+	silence = gst_dreamaudiosource_silence_new (self, samplerate, channels);
+	if (!silence)
+		return FALSE;
+
+	GST_OBJECT_LOCK (self);
+	self->audio_info.samplerate = samplerate;
+	self->audio_info.channels = channels;
+	gst_buffer_replace (&self->silence, silence);
+	GST_OBJECT_UNLOCK (self);
+	gst_buffer_unref (silence);
+
+	GST_DEBUG_OBJECT (self, "negotiated %" GST_PTR_FORMAT ", silence frame %" GST_PTR_FORMAT, caps, self->silence);
+	return TRUE;
+}
+
+/* raw output needs the codec_data of the first ADTS header, until that arrived no caps are set */
+static gboolean gst_dreamaudiosource_negotiate (GstBaseSrc * bsrc)
+{
+	GstDreamAudioSource *self = GST_DREAMAUDIOSOURCE (bsrc);
+	GstCaps *thiscaps, *caps;
+	GstBuffer *codec_data;
+	gboolean raw, ret;
+
+	thiscaps = gst_pad_query_caps (GST_BASE_SRC_PAD (bsrc), NULL);
+	caps = gst_pad_peer_query_caps (GST_BASE_SRC_PAD (bsrc), thiscaps);
+	gst_caps_unref (thiscaps);
+	if (gst_caps_is_empty (caps))
+	{
+		GST_WARNING_OBJECT (self, "no common caps with downstream");
+		gst_caps_unref (caps);
+		return FALSE;
+	}
+	caps = gst_caps_fixate (caps);
+	raw = !g_strcmp0 (gst_structure_get_string (gst_caps_get_structure (caps, 0), "stream-format"), "raw");
+
+	g_atomic_int_set (&self->raw_output, raw);
+	GST_OBJECT_LOCK (self);
+	codec_data = self->codec_data ? gst_buffer_ref (self->codec_data) : NULL;
+	GST_OBJECT_UNLOCK (self);
+
+	if (raw && !codec_data)
+	{
+		GST_DEBUG_OBJECT (self, "raw output, waiting for the first ADTS header");
+		g_atomic_int_set (&self->caps_pending, TRUE);
+		gst_caps_unref (caps);
+		return TRUE;
+	}
+	g_atomic_int_set (&self->caps_pending, FALSE);
+	if (raw)
+	{
+		gst_caps_set_simple (caps, "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+		gst_buffer_unref (codec_data);
+	}
+	else if (codec_data)
+		gst_buffer_unref (codec_data);
+
+	ret = gst_base_src_set_caps (bsrc, caps);
+	gst_caps_unref (caps);
+	return ret;
+}
+
 static gboolean gst_dreamaudiosource_query (GstBaseSrc * bsrc, GstQuery * query)
 {
 	GstDreamAudioSource *self = GST_DREAMAUDIOSOURCE (bsrc);
@@ -437,9 +622,9 @@ static gboolean gst_dreamaudiosource_query (GstBaseSrc * bsrc, GstQuery * query)
 			if (self->audio_info.samplerate) {
 				GstClockTime min, max;
 
-				g_mutex_lock (&self->mutex);
-				min = gst_util_uint64_scale_ceil (GST_SECOND, 1000, self->audio_info.samplerate);
-				g_mutex_unlock (&self->mutex);
+				GST_OBJECT_LOCK (self);
+				min = gst_util_uint64_scale_ceil (GST_SECOND, AAC_FRAME_SAMPLES, self->audio_info.samplerate);
+				GST_OBJECT_UNLOCK (self);
 
 				max = self->buffer_size * min;
 
@@ -462,11 +647,10 @@ static gboolean gst_dreamaudiosource_unlock (GstBaseSrc * bsrc)
 {
 	GstDreamAudioSource *self = GST_DREAMAUDIOSOURCE (bsrc);
 	GST_DEBUG_OBJECT (self, "stop creating buffers");
-	g_mutex_lock (&self->mutex);
-	self->flushing = TRUE;
+	gst_dreamsource_control_set_flags (&self->control, CONTROL_FLUSHING);
 	GST_DEBUG_OBJECT (self, "set flushing TRUE");
-	g_cond_signal (&self->cond);
-	g_mutex_unlock (&self->mutex);
+	if (self->current_frames)
+		gst_dreamsource_frame_ring_wakeup (self->current_frames);
 	return TRUE;
 }
 
@@ -474,431 +658,588 @@ static gboolean gst_dreamaudiosource_unlock_stop (GstBaseSrc * bsrc)
 {
 	GstDreamAudioSource *self = GST_DREAMAUDIOSOURCE (bsrc);
 	GST_DEBUG_OBJECT (self, "stop flushing...");
-	g_mutex_lock (&self->mutex);
-	self->flushing = FALSE;
-	g_queue_foreach (&self->current_frames, (GFunc) gst_buffer_unref, NULL);
-	g_queue_clear (&self->current_frames);
-	g_mutex_unlock (&self->mutex);
+	gst_dreamsource_control_clear_flags (&self->control, CONTROL_FLUSHING);
+	if (self->current_frames)
+		gst_dreamsource_frame_ring_clear (self->current_frames, (GDestroyNotify) gst_buffer_unref);
+	gst_buffer_replace (&self->pending_gap, NULL);
 	return TRUE;
 }
 
-static void gst_dreamaudiosource_free_buffer (struct _buffer_memorytracker * memtrack)
+/* Audio descriptors go back to the driver as soon as they are consumed, so the
+ * tracker doesn't keep the encoder off memory that is still in use downstream.
+ * It only bounds the number of buffers wrapping the cdb, beyond that frames are copied. */
+static GstBuffer *gst_dreamaudiosource_wrap_descriptor (GstDreamAudioSource * self, AudioBufferDescriptor * desc)
 {
-	GstDreamAudioSource * self = memtrack->self;
-	GST_OBJECT_LOCK(self);
-	GST_TRACE_OBJECT (self, "freeing %" GST_PTR_FORMAT " uiOffset=%i uiLength=%i ", memtrack->buffer, memtrack->uiOffset, memtrack->uiLength);
-	GList *list = g_list_first (self->memtrack_list);
-	guint abs_minimum = UINT32_MAX;
-	guint abs_maximum = 0;
-	struct _buffer_memorytracker * mt;
-	int count = 0;
-	self->memtrack_list = g_list_remove(list, memtrack);
-	free(memtrack);
-	if (self->encoder)
+	EncoderInfo *enc = self->encoder;
+	MemoryTrackerEntry *memtrack = gst_dreamsource_memtracker_push (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+
+	if (G_UNLIKELY (!memtrack))
 	{
-		list = g_list_first (self->memtrack_list);
-		while (list) {
-			mt = list->data;
-			if (abs_minimum > 0 && mt->uiOffset < abs_minimum)
-				abs_minimum = mt->uiOffset;
-			if (mt->uiOffset+mt->uiLength > abs_maximum)
-				abs_maximum = mt->uiOffset+mt->uiLength;
-			count++;
-			list = g_list_next (list);
-		}
-		GST_TRACE_OBJECT (self, "previous used_range_min=%i new abs_minimum=%i, abs_maximum=%i", self->encoder->used_range_min, abs_minimum, abs_maximum);
-		self->encoder->used_range_min = abs_minimum;
-		self->encoder->used_range_max = abs_maximum;
+		GST_WARNING_OBJECT (self, "all %i tracked buffers are still in use downstream, copying", AMEMTRACKSIZE);
+		return gst_buffer_new_wrapped (g_memdup (enc->cdb + desc->stCommon.uiOffset, desc->stCommon.uiLength), desc->stCommon.uiLength);
 	}
-	GST_OBJECT_UNLOCK(self);
+	return gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, enc->cdb, AMMAPSIZE, desc->stCommon.uiOffset, desc->stCommon.uiLength, memtrack, (GDestroyNotify) gst_dreamsource_memtracker_release);
 }
 
-static void gst_dreamaudiosource_read_thread_func (GstDreamAudioSource * self)
+static void gst_dreamaudiosource_gap_stop (GstDreamAudioSource * self)
 {
-	EncoderInfo *enc = self->encoder;
-	GstDreamSourceReadthreadState state = READTHREADSTATE_NONE;
-	GstBuffer *readbuf = NULL;
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (!self->gap_active)
+		return;
+	timerfd_settime (self->gap_timer, 0, &its, NULL);
+	self->gap_active = FALSE;
+	self->discont = TRUE;
+	/* the encoder's time line continues elsewhere, take it from its next PTS */
+	self->ts_anchor = GST_CLOCK_TIME_NONE;
+	gst_buffer_replace (&self->gap_silence, NULL);
+	GST_DEBUG_OBJECT (self, "gap ended after %" G_GUINT64_FORMAT " samples", self->gap_samples);
+}
+
+/* called on the reactor thread, arms the encoder watch for whatever the read side waits for next */
+static void gst_dreamaudiosource_rearm (GstDreamAudioSource * self)
+{
+	if (CONTROL_STATE (gst_dreamsource_control_get (&self->control)) != READTRREADSTATE_RUNNING)
+	{
+		gst_dreamaudiosource_gap_stop (self);
+		gst_dreamsource_reactor_modify (self->encoder_watch, 0);
+		gst_dreamsource_reactor_set_timeout (self->encoder_watch, -1);
+		return;
+	}
+	if (self->descriptors_available == 0)
+		self->descriptors_count = 0;
+	gst_dreamsource_reactor_modify (self->encoder_watch, EPOLLIN);
+	/* while the gap timer runs there is nothing left to time out on */
+	gst_dreamsource_reactor_set_timeout (self->encoder_watch, self->gap_active ? -1 : ENCODER_TIMEOUT);
+}
+
+static void gst_dreamaudiosource_read_error (GstDreamAudioSource * self)
+{
+	GST_DEBUG_OBJECT (self, "stop reading");
+	gst_dreamsource_control_set_state (&self->control, READTHREADSTATE_STOP);
+	gst_dreamaudiosource_rearm (self);
+	gst_dreamsource_frame_ring_wakeup (self->current_frames);
+}
 
-	if (!enc) {
-		GST_WARNING_OBJECT (self, "encoder device not opened!");
+/* hands one frame over to create(), which owns the head, so on overflow the newest frame is dropped */
+static void gst_dreamaudiosource_queue (GstDreamAudioSource * self, GstBuffer * readbuf)
+{
+	GstClockTime pts = GST_BUFFER_PTS (readbuf);
+
+	if (pts != GST_CLOCK_TIME_NONE)
+	{
+		self->last_ts = pts;
+		if (GST_BUFFER_DURATION_IS_VALID (readbuf))
+			self->next_ts = pts + GST_BUFFER_DURATION (readbuf);
+		else
+			self->next_ts = pts + gst_util_uint64_scale (AAC_FRAME_SAMPLES, GST_SECOND, self->audio_info.samplerate);
+	}
+	if (self->discont)
+		GST_BUFFER_FLAG_SET (readbuf, GST_BUFFER_FLAG_DISCONT);
+	if (gst_dreamsource_frame_ring_length (self->current_frames) >= self->buffer_size || !gst_dreamsource_frame_ring_push (self->current_frames, readbuf, gst_buffer_get_size (readbuf), pts))
+	{
+		GST_WARNING_OBJECT (self, "dropping %" GST_PTR_FORMAT " because of queue overflow! buffers count=%i", readbuf, gst_dreamsource_frame_ring_length (self->current_frames));
+		gst_buffer_unref (readbuf);
+		self->discont = TRUE;
 		return;
 	}
+	self->discont = FALSE;
+	GST_INFO_OBJECT (self, "read %" GST_PTR_FORMAT " to queue... buffers count=%i", readbuf, gst_dreamsource_frame_ring_length (self->current_frames));
+}
+
+/* queues the next frames of the gap, timestamps follow a sample counter so they never drift */
+static void gst_dreamaudiosource_fill_gap (GstDreamAudioSource * self, guint64 frames)
+{
+	while (frames--)
+	{
+		GstClockTime pts = self->gap_start + gst_util_uint64_scale (self->gap_samples, GST_SECOND, self->gap_rate);
+		GstBuffer *buf;
+
+		self->gap_samples += AAC_FRAME_SAMPLES;
+		/* an empty marker becomes a GAP event in create(), silence shares the precomputed frame */
+		if (self->gap_send_events)
+			buf = gst_buffer_new ();
+		else if (self->gap_raw)
+			buf = gst_buffer_copy_region (self->gap_silence, GST_BUFFER_COPY_MEMORY, ADTS_HEADER_LEN, -1);
+		else
+			buf = gst_buffer_copy (self->gap_silence);
+		GST_BUFFER_PTS (buf) = pts;
+		GST_BUFFER_DTS (buf) = pts;
+		GST_BUFFER_DURATION (buf) = self->gap_start + gst_util_uint64_scale (self->gap_samples, GST_SECOND, self->gap_rate) - pts;
+		GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_GAP);
+		gst_dreamaudiosource_queue (self, buf);
+	}
+}
 
-	GST_DEBUG_OBJECT (self, "enter read thread");
+/* the encoder went quiet, keep the stream going on an exact frame cadence until it delivers again */
+static void gst_dreamaudiosource_gap_start (GstDreamAudioSource * self)
+{
+	struct itimerspec its;
+	GstClockTime interval;
 
-	GstMessage *message;
-	GValue val = { 0 };
+	if (self->gap_active || self->next_ts == GST_CLOCK_TIME_NONE)
+		return;
 
-	message = gst_message_new_stream_status (GST_OBJECT_CAST (self), GST_STREAM_STATUS_TYPE_ENTER, GST_ELEMENT_CAST (GST_OBJECT_PARENT(self)));
-	g_value_init (&val, GST_TYPE_G_THREAD);
-	g_value_set_boxed (&val, self->readthread);
-	gst_message_set_stream_status_object (message, &val);
-	g_value_unset (&val);
-	GST_DEBUG_OBJECT (self, "posting ENTER stream status");
-	gst_element_post_message (GST_ELEMENT_CAST (self), message);
-	GstClockTime clock_time, base_time;
-	gboolean discont = TRUE;
-	int timeout;
+	GST_OBJECT_LOCK (self);
+	self->gap_rate = self->audio_info.samplerate;
+	self->gap_send_events = self->gap_events;
+	self->gap_raw = g_atomic_int_get (&self->raw_output);
+	gst_buffer_replace (&self->gap_silence, self->silence);
+	GST_OBJECT_UNLOCK (self);
+	if (!self->gap_silence)
+	{
+		GST_DEBUG_OBJECT (self, "caps not negotiated yet, no gap");
+		return;
+	}
+
+	interval = gst_util_uint64_scale (AAC_FRAME_SAMPLES, GST_SECOND, self->gap_rate);
+	its.it_interval.tv_sec = interval / GST_SECOND;
+	its.it_interval.tv_nsec = interval % GST_SECOND;
+	its.it_value = its.it_interval;
+	if (timerfd_settime (self->gap_timer, 0, &its, NULL) < 0)
+	{
+		GST_WARNING_OBJECT (self, "can't arm gap timer: %s (%i)", strerror(errno), errno);
+		gst_buffer_replace (&self->gap_silence, NULL);
+		return;
+	}
+
+	self->gap_active = TRUE;
+	self->gap_start = self->next_ts;
+	self->gap_samples = 0;
+	GST_DEBUG_OBJECT (self, "gap from %" GST_TIME_FORMAT ", one %s every %" GST_TIME_FORMAT, GST_TIME_ARGS (self->gap_start), self->gap_send_events ? "GAP event" : "silence frame", GST_TIME_ARGS (interval));
+
+	/* the encoder has been quiet for ENCODER_TIMEOUT already, catch up on that */
+	if (!(gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING))
+		gst_dreamaudiosource_fill_gap (self, gst_util_uint64_scale (ENCODER_TIMEOUT, self->gap_rate, 1000 * AAC_FRAME_SAMPLES));
+}
+
+static void gst_dreamaudiosource_gap_cb (GstDreamAudioSource * self, guint32 events)
+{
+	guint64 expirations;
+
+	if (read (self->gap_timer, &expirations, sizeof (expirations)) != sizeof (expirations) || !self->gap_active)
+		return;
+
+	if (gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING)
+	{
+		/* nothing to queue into, but the time line moves on */
+		self->gap_samples += expirations * AAC_FRAME_SAMPLES;
+		return;
+	}
+	gst_dreamaudiosource_fill_gap (self, expirations);
+}
 
-	while (TRUE) {
+/* sample accurate timestamps, counted from the last encoder PTS that was anchored on */
+static void gst_dreamaudiosource_timestamp (GstDreamAudioSource * self, GstBuffer * frame, GstClockTime pts, gint rate, guint samples)
+{
+	GstClockTime start;
+
+	if (pts != GST_CLOCK_TIME_NONE)
+	{
+		GstClockTimeDiff drift = 0;
+
+		if (self->ts_anchor != GST_CLOCK_TIME_NONE && rate == self->anchor_rate)
+			drift = GST_CLOCK_DIFF (self->ts_anchor + gst_util_uint64_scale (self->anchor_samples, GST_SECOND, rate), pts);
+		if (self->ts_anchor == GST_CLOCK_TIME_NONE || rate != self->anchor_rate || ABS (drift) > ALIGNMENT_THRESHOLD)
 		{
-			if (state == READTHREADSTATE_STOP)
-				goto stop_running;
-
-			struct pollfd rfd[2];
-			int nfds;
-
-			rfd[0].fd = READ_SOCKET (self);
-			rfd[0].events = POLLIN | POLLERR | POLLHUP | POLLPRI;
-			rfd[1].revents = 0;
-			rfd[1].events = POLLIN;
-			nfds = 1;
-			timeout = 0;
-
-			if (state <= READTRREADSTATE_PAUSED)
-				timeout = 200;
-			else if (state == READTRREADSTATE_RUNNING && self->descriptors_available == 0)
-			{
-				rfd[1].fd = enc->fd;
-				self->descriptors_count = 0;
-				timeout = 200;
-				nfds = 2;
-			}
+			GST_DEBUG_OBJECT (self, "anchor sample counter on encoder pts %" GST_TIME_FORMAT " (drift %" G_GINT64_FORMAT " ns, rate %i)", GST_TIME_ARGS (pts), drift, rate);
+			self->ts_anchor = pts;
+			self->anchor_rate = rate;
+			self->anchor_samples = 0;
+		}
+	}
+	if (self->ts_anchor == GST_CLOCK_TIME_NONE)
+		return;
+	if (rate != self->anchor_rate)
+	{
+		self->ts_anchor += gst_util_uint64_scale (self->anchor_samples, GST_SECOND, self->anchor_rate);
+		self->anchor_rate = rate;
+		self->anchor_samples = 0;
+	}
 
-			int ret = poll(rfd, nfds, timeout);
+	start = self->ts_anchor + gst_util_uint64_scale (self->anchor_samples, GST_SECOND, rate);
+	self->anchor_samples += samples;
+	GST_BUFFER_PTS (frame) = start;
+	GST_BUFFER_DTS (frame) = start;
+	GST_BUFFER_DURATION (frame) = self->ts_anchor + gst_util_uint64_scale (self->anchor_samples, GST_SECOND, rate) - start;
+}
 
-			if (G_UNLIKELY (ret == -1))
-			{
-				GST_ERROR_OBJECT (self, "SELECT ERROR!");
-				goto stop_running;
-			}
-			else if ( ret == 0 && self->descriptors_available == 0 )
-			{
-				g_mutex_lock (&self->mutex);
-				gst_clock_get_internal_time(self->encoder_clock);
-				if (self->flushing)
-				{
-					GST_DEBUG_OBJECT (self, "FLUSHING!");
-					g_cond_signal (&self->cond);
-					g_mutex_unlock (&self->mutex);
-					continue;
-				}
-				g_mutex_unlock (&self->mutex);
-				GST_DEBUG_OBJECT (self, "SELECT TIMEOUT");
-				//!!! TODO generate valid dummy payload
-				discont = TRUE;
-				if (self->dts_offset != GST_CLOCK_TIME_NONE)
-					readbuf = gst_buffer_new();
-			}
-			else if ( rfd[0].revents )
-			{
-				char command;
-				READ_COMMAND (self, command, ret);
-				switch (command) {
-					case CONTROL_STOP:
-						GST_DEBUG_OBJECT (self, "CONTROL_STOP!");
-						state = READTHREADSTATE_STOP;
-						break;
-					case CONTROL_PAUSE:
-						GST_DEBUG_OBJECT (self, "CONTROL_PAUSE!");
-						state = READTRREADSTATE_PAUSED;
-						break;
-					case CONTROL_RUN:
-						GST_DEBUG_OBJECT (self, "CONTROL_RUN");
-						state = READTRREADSTATE_RUNNING;
-						break;
-					default:
-						GST_ERROR_OBJECT (self, "illegal control socket command %c received!", command);
-				}
-				continue;
-			}
-			else if ( G_LIKELY(rfd[1].revents & POLLIN) )
+/* AudioSpecificConfig for raw caps: object type, frequency index and channel configuration */
+static void gst_dreamaudiosource_make_codec_data (GstDreamAudioSource * self, const guint8 * header)
+{
+	guint profile = (header[2] >> 6) + 1;
+	guint index = (header[2] >> 2) & 0x0f;
+	guint channels = ((header[2] & 0x01) << 2) | (header[3] >> 6);
+	guint8 *config = g_malloc (2);
+
+	config[0] = (profile << 3) | (index >> 1);
+	config[1] = ((index & 0x01) << 7) | (channels << 3);
+
+	GST_OBJECT_LOCK (self);
+	self->codec_data = gst_buffer_new_wrapped (config, 2);
+	GST_OBJECT_UNLOCK (self);
+	GST_DEBUG_OBJECT (self, "codec_data %02x %02x (object type %u, rate %i, channels %u)", config[0], config[1], profile, adts_sample_rates[index], channels);
+}
+
+/*
+ * An ADTS frame with several raw data blocks has to go out raw as one AU per
+ * block. Where they start is only known from the raw_data_block_position table
+ * of CRC protected frames, each block is followed by its own CRC then.
+ */
+static gboolean gst_dreamaudiosource_split_raw_blocks (GstDreamAudioSource * self, GstBuffer * readbuf, const guint8 * header, gsize offset, guint frame_len, gint rate, GstClockTime pts, GQueue * batch)
+{
+	guint blocks = (header[6] & 0x03) + 1;
+	guint start[4], end[4], i;
+
+	if (header[1] & 0x01)
+		return FALSE;
+	start[0] = ADTS_HEADER_LEN + 2 * blocks;
+	for (i = 1; i < blocks; i++)
+		start[i] = GST_READ_UINT16_BE (header + ADTS_HEADER_LEN + 2 * (i - 1));
+	for (i = 0; i < blocks; i++)
+	{
+		end[i] = (i + 1 < blocks ? start[i + 1] : frame_len) - 2;
+		if (start[i] >= end[i] || end[i] > frame_len)
+			return FALSE;
+	}
+
+	for (i = 0; i < blocks; i++)
+	{
+		GstBuffer *frame = gst_buffer_copy_region (readbuf, GST_BUFFER_COPY_MEMORY, offset + start[i], end[i] - start[i]);
+		gst_dreamaudiosource_timestamp (self, frame, pts, rate, AAC_FRAME_SAMPLES);
+		pts = GST_CLOCK_TIME_NONE;
+		g_queue_push_tail (batch, frame);
+	}
+	return TRUE;
+}
+
+/* one descriptor may hold several ADTS frames, each becomes a sub-buffer sharing the descriptor's memory,
+ * for raw output that sub-buffer starts behind the header */
+static void gst_dreamaudiosource_split_frames (GstDreamAudioSource * self, GstBuffer * readbuf, GstClockTime pts, gboolean raw, GQueue * batch)
+{
+	GstMapInfo map;
+	gsize offset = 0;
+
+	if (!gst_buffer_map (readbuf, &map, GST_MAP_READ))
+	{
+		GST_WARNING_OBJECT (self, "can't map %" GST_PTR_FORMAT ", dropping it", readbuf);
+		gst_buffer_unref (readbuf);
+		return;
+	}
+
+	while (offset + ADTS_HEADER_LEN <= map.size)
+	{
+		const guint8 *header = map.data + offset;
+		guint frame_len, header_len, index, samples;
+		GstBuffer *frame;
+
+		if (header[0] != 0xff || (header[1] & 0xf6) != 0xf0)
+			break;
+		frame_len = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+		header_len = (header[1] & 0x01) ? ADTS_HEADER_LEN : ADTS_HEADER_LEN + 2;  /* CRC follows unless absent */
+		index = (header[2] >> 2) & 0x0f;
+		if (frame_len <= header_len || offset + frame_len > map.size || index >= G_N_ELEMENTS (adts_sample_rates))
+			break;
+		samples = ((header[6] & 0x03) + 1) * AAC_FRAME_SAMPLES;
+
+		if (G_UNLIKELY (!self->codec_data))
+			gst_dreamaudiosource_make_codec_data (self, header);
+
+		if (raw && (header[6] & 0x03))
+		{
+			if (!gst_dreamaudiosource_split_raw_blocks (self, readbuf, header, offset, frame_len, adts_sample_rates[index], pts, batch))
 			{
-				clock_time = gst_clock_get_internal_time (self->encoder_clock);
-				base_time = gst_element_get_base_time(GST_ELEMENT(self));
-				int rlen = read(enc->fd, enc->buffer, ABUFSIZE);
-				if (rlen <= 0 || rlen % ABDSIZE ) {
-					if ( errno == 512 )
-						goto stop_running;
-					GST_WARNING_OBJECT (self, "read error %s (%i)", strerror(errno), errno);
-					goto stop_running;
-				}
-				self->descriptors_available = rlen / ABDSIZE;
-				GST_LOG_OBJECT (self, "encoder buffer was empty, %d descriptors available", self->descriptors_available);
+				GST_WARNING_OBJECT (self, "ADTS frame with %u raw data blocks and no usable block positions, can't output it raw", (header[6] & 0x03) + 1);
+				/* take the time line from the next encoder PTS */
+				self->ts_anchor = GST_CLOCK_TIME_NONE;
+				self->discont = TRUE;
 			}
+			pts = GST_CLOCK_TIME_NONE;
+			offset += frame_len;
+			continue;
 		}
+		if (raw)
+			frame = gst_buffer_copy_region (readbuf, GST_BUFFER_COPY_MEMORY, offset + header_len, frame_len - header_len);
+		else
+			frame = gst_buffer_copy_region (readbuf, GST_BUFFER_COPY_MEMORY, offset, frame_len);
+		gst_dreamaudiosource_timestamp (self, frame, pts, adts_sample_rates[index], samples);
+		/* the encoder PTS belongs to the first frame, the others follow from the sample count */
+		pts = GST_CLOCK_TIME_NONE;
+		g_queue_push_tail (batch, frame);
+		offset += frame_len;
+	}
+
+	if (offset < map.size && raw)
+		GST_WARNING_OBJECT (self, "no ADTS frame at offset %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes, can't output it raw", offset, map.size);
+	else if (offset < map.size)
+	{
+		GstBuffer *rest;
 
-		while (self->descriptors_count < self->descriptors_available)
+		GST_WARNING_OBJECT (self, "no ADTS frame at offset %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes, passing the rest on unsplit", offset, map.size);
+		rest = offset ? gst_buffer_copy_region (readbuf, GST_BUFFER_COPY_MEMORY, offset, map.size - offset) : gst_buffer_ref (readbuf);
+		if (pts != GST_CLOCK_TIME_NONE)
 		{
-			GstClockTime encoder_pts = GST_CLOCK_TIME_NONE;
-			GstClockTime result_pts = GST_CLOCK_TIME_NONE;
+			GST_BUFFER_PTS (rest) = pts;
+			GST_BUFFER_DTS (rest) = pts;
+		}
+		g_queue_push_tail (batch, rest);
+	}
 
-			off_t offset = self->descriptors_count * ABDSIZE;
-			AudioBufferDescriptor *desc = (AudioBufferDescriptor*)(&enc->buffer[offset]);
+	gst_buffer_unmap (readbuf, &map);
+	gst_buffer_unref (readbuf);
+}
 
-			uint32_t f = desc->stCommon.uiFlags;
+/* turns the pending descriptors into queued frames */
+static void gst_dreamaudiosource_consume (GstDreamAudioSource * self)
+{
+	EncoderInfo *enc = self->encoder;
+	GstClockTime clock_time = self->clock_time, base_time = self->base_time;
+	GQueue batch = G_QUEUE_INIT;
+	GstBuffer *readbuf = NULL;
+	gboolean raw;
 
-			if (G_UNLIKELY (f & CDB_FLAG_METADATA))
-			{
-				GST_LOG_OBJECT (self, "CDB_FLAG_METADATA... skip outdated packet");
-				self->descriptors_count = self->descriptors_available;
-				continue;
-			}
+	raw = g_atomic_int_get (&self->raw_output);
 
-			GST_LOG_OBJECT (self, "descriptors_count=%d, descriptors_available=%d\tuiOffset=%d, uiLength=%d", self->descriptors_count, self->descriptors_available, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+	while (self->descriptors_count < self->descriptors_available)
+	{
+		GstClockTime encoder_pts = GST_CLOCK_TIME_NONE;
+		GstClockTime result_pts = GST_CLOCK_TIME_NONE;
 
-			if (self->encoder->used_range_min == UINT32_MAX)
-				self->encoder->used_range_min = desc->stCommon.uiOffset;
+		off_t offset = self->descriptors_count * ABDSIZE;
+		AudioBufferDescriptor *desc = (AudioBufferDescriptor*)(&enc->buffer[offset]);
 
-			if (self->encoder->used_range_max == 0)
-				self->encoder->used_range_max = desc->stCommon.uiOffset+desc->stCommon.uiLength;
+		uint32_t f = desc->stCommon.uiFlags;
 
-// 			if (desc->stCommon.uiOffset < self->encoder->used_range_max && desc->stCommon.uiOffset+desc->stCommon.uiLength > self->encoder->used_range_min)
-// 			{
-// 				GST_WARNING_OBJECT (self, "encoder overwrites buffer memory that is still in use! uiOffset=%i uiLength=%i used_range_min=%i used_range_max=%i", desc->stCommon.uiOffset, desc->stCommon.uiLength, self->encoder->used_range_min, self->encoder->used_range_max);
-// 				self->descriptors_count++;
-// 				readbuf = gst_buffer_new();
-// 				continue;
-// 			}
+		if (G_UNLIKELY (f & CDB_FLAG_METADATA))
+		{
+			GST_LOG_OBJECT (self, "CDB_FLAG_METADATA... skip outdated packet");
+			self->descriptors_count = self->descriptors_available;
+			continue;
+		}
 
-			// uiDTS since kernel driver booted
-			if (f & CDB_FLAG_PTS_VALID)
-			{
-				encoder_pts = MPEGTIME_TO_GSTTIME(desc->stCommon.uiPTS);
-				GST_LOG_OBJECT (self, "f & CDB_FLAG_PTS_VALID && encoder's uiPTS=%" GST_TIME_FORMAT"", GST_TIME_ARGS(encoder_pts));
+		GST_LOG_OBJECT (self, "descriptors_count=%d, descriptors_available=%d\tuiOffset=%d, uiLength=%d", self->descriptors_count, self->descriptors_available, desc->stCommon.uiOffset, desc->stCommon.uiLength);
 
-				g_mutex_lock (&self->mutex);
-				if (G_UNLIKELY (self->dts_offset == GST_CLOCK_TIME_NONE))
-				{
+		// uiDTS since kernel driver booted
+		if (f & CDB_FLAG_PTS_VALID)
+		{
+			encoder_pts = MPEGTIME_TO_GSTTIME(gst_dreamsource_unwrapper_unwrap (&self->pts_unwrapper, desc->stCommon.uiPTS));
+			GST_LOG_OBJECT (self, "f & CDB_FLAG_PTS_VALID && encoder's uiPTS=%" GST_TIME_FORMAT"", GST_TIME_ARGS(encoder_pts));
+
+			/* dts_offset is only written here, the lock just guards readers in other threads */
+			if (G_UNLIKELY (self->dts_offset == GST_CLOCK_TIME_NONE))
+			{
+				gint64 dts_offset = GST_CLOCK_TIME_NONE;
 #if 0 // set to 0 to always wait for audio to become valid, don't rely on video pts
-					if (self->dreamvideosrc)
+				if (self->dreamvideosrc)
+				{
+					guint64 videosource_dts_offset;
+					g_signal_emit_by_name(self->dreamvideosrc, "get-dts-offset", &videosource_dts_offset);
+					if (videosource_dts_offset != GST_CLOCK_TIME_NONE)
 					{
-						guint64 videosource_dts_offset;
-						g_signal_emit_by_name(self->dreamvideosrc, "get-dts-offset", &videosource_dts_offset);
-						if (videosource_dts_offset != GST_CLOCK_TIME_NONE)
-						{
-							GST_DEBUG_OBJECT (self, "use DREAMVIDEOSOURCE's dts_offset=%" GST_TIME_FORMAT "", GST_TIME_ARGS (videosource_dts_offset) );
-							self->dts_offset = videosource_dts_offset;
-						}
+						GST_DEBUG_OBJECT (self, "use DREAMVIDEOSOURCE's dts_offset=%" GST_TIME_FORMAT "", GST_TIME_ARGS (videosource_dts_offset) );
+						dts_offset = videosource_dts_offset;
 					}
+				}
 #endif
-					if (self->dts_offset == GST_CLOCK_TIME_NONE)
-					{
-						self->dts_offset = encoder_pts;
-						GST_DEBUG_OBJECT (self, "use mpeg stream pts as dts_offset=%" GST_TIME_FORMAT" (%lld)", GST_TIME_ARGS (self->dts_offset), desc->stCommon.uiPTS);
-					}
+				if (dts_offset == GST_CLOCK_TIME_NONE)
+				{
+					dts_offset = encoder_pts;
+					GST_DEBUG_OBJECT (self, "use mpeg stream pts as dts_offset=%" GST_TIME_FORMAT" (%lld)", GST_TIME_ARGS (dts_offset), desc->stCommon.uiPTS);
 				}
-				g_mutex_unlock (&self->mutex);
+				GST_OBJECT_LOCK (self);
+				self->dts_offset = dts_offset;
+				GST_OBJECT_UNLOCK (self);
 			}
+		}
 
-			if (G_UNLIKELY (self->dts_offset == GST_CLOCK_TIME_NONE))
-			{
-				GST_DEBUG_OBJECT (self, "dts_offset is still unknown, skipping frame...");
-				self->descriptors_count++;
-				break;
-			}
+		if (G_UNLIKELY (self->dts_offset == GST_CLOCK_TIME_NONE))
+		{
+			GST_DEBUG_OBJECT (self, "dts_offset is still unknown, skipping frame...");
+			self->descriptors_count++;
+			continue;
+		}
 
-			if (encoder_pts != GST_CLOCK_TIME_NONE)
-			{
-				GstClockTime pts_clock_time = encoder_pts - self->dts_offset;
-				GstClockTime internal, external;
-				GstClockTime rate_n, rate_d;
-				GstClockTimeDiff diff;
-
-				gst_clock_get_calibration (self->encoder_clock, &internal, &external, &rate_n, &rate_d);
-
-				if (internal > pts_clock_time) {
-					diff = internal - pts_clock_time;
-					diff = gst_util_uint64_scale (diff, rate_n, rate_d);
-					pts_clock_time = external - diff;
-				} else {
-					diff = pts_clock_time - internal;
-					diff = gst_util_uint64_scale (diff, rate_n, rate_d);
-					pts_clock_time = external + diff;
-				}
+		if (encoder_pts != GST_CLOCK_TIME_NONE)
+		{
+			GstClockTime pts_clock_time = encoder_pts - self->dts_offset;
+			GstClockTime internal, external;
+			GstClockTime rate_n, rate_d;
+			GstClockTimeDiff diff;
+
+			gst_dreamsource_calibration_update (&self->calibration, self->encoder_clock);
+			internal = self->calibration.internal;
+			external = self->calibration.external;
+			rate_n = self->calibration.rate_num;
+			rate_d = self->calibration.rate_denom;
+
+			if (internal > pts_clock_time) {
+				diff = internal - pts_clock_time;
+				diff = gst_dreamsource_calibration_scale (&self->calibration, diff);
+				pts_clock_time = external - diff;
+			} else {
+				diff = pts_clock_time - internal;
+				diff = gst_dreamsource_calibration_scale (&self->calibration, diff);
+				pts_clock_time = external + diff;
+			}
 
-				if ( pts_clock_time >= base_time )
-					result_pts = pts_clock_time - base_time;
-				else
-					GST_DEBUG_OBJECT (self, "pts_clock_time < base_time, skipping frame...");
+			if ( pts_clock_time >= base_time )
+				result_pts = pts_clock_time - base_time;
+			else
+				GST_DEBUG_OBJECT (self, "pts_clock_time < base_time, skipping frame...");
 
 #define extra_timestamp_debug
 #ifdef extra_timestamp_debug
-				GstClockTime my_int_time = gst_clock_get_internal_time(self->encoder_clock);
-				GstClockTime pipeline_int_time = GST_CLOCK_TIME_NONE;
-				GstClock *elemclk = gst_element_get_clock (GST_ELEMENT (self));
-				if (elemclk)
-				{
-					pipeline_int_time = gst_clock_get_internal_time(elemclk);
-					gst_object_unref (elemclk);
-				}
-
-				GST_LOG_OBJECT (self, "post-calibration\n"
-				"  %" GST_TIME_FORMAT " =base_time       %" GST_TIME_FORMAT " =clock_time\n"
-				"  %" GST_TIME_FORMAT " =encoder_pts     %" GST_TIME_FORMAT " =pts_clock_time     %" GST_TIME_FORMAT " =result_pts\n"
-				"  %" GST_TIME_FORMAT " =internal        %" GST_TIME_FORMAT " =external           %" GST_TIME_FORMAT " =diff                %" PRId64 "/%" PRId64 " =rate\n"
-				"  %" GST_TIME_FORMAT " =my_int_time     %" GST_TIME_FORMAT " =pipeline_int_time"
-				,
-				GST_TIME_ARGS (base_time), GST_TIME_ARGS (clock_time),
-				GST_TIME_ARGS (encoder_pts), GST_TIME_ARGS (pts_clock_time), GST_TIME_ARGS (result_pts),
-				GST_TIME_ARGS (internal), GST_TIME_ARGS (external), GST_TIME_ARGS (diff), rate_n, rate_d,
-				GST_TIME_ARGS (my_int_time), GST_TIME_ARGS (pipeline_int_time)
-				);
-#endif
-			}
-
-			struct _buffer_memorytracker * memtrack = malloc(sizeof(struct _buffer_memorytracker));
-			if (G_UNLIKELY (!memtrack))
+			GstClockTime my_int_time = gst_clock_get_internal_time(self->encoder_clock);
+			GstClockTime pipeline_int_time = GST_CLOCK_TIME_NONE;
+			GstClock *elemclk = gst_element_get_clock (GST_ELEMENT (self));
+			if (elemclk)
 			{
-				GST_ERROR_OBJECT (self, "can't allocate buffer_memorytracker");
-				goto stop_running;
+				pipeline_int_time = gst_clock_get_internal_time(elemclk);
+				gst_object_unref (elemclk);
 			}
 
-			if (readbuf)
-			{
-				GST_INFO_OBJECT (self, "LAST BUFFER WAS INCOMPLETE... appending");
-				GstBuffer *append_buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, enc->cdb, AMMAPSIZE, desc->stCommon.uiOffset, desc->stCommon.uiLength, memtrack, (GDestroyNotify) gst_dreamaudiosource_free_buffer);
-				readbuf = gst_buffer_append (readbuf, append_buffer);
-			}
-			else
-			{
-				GST_OBJECT_LOCK (self);
-				readbuf = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, enc->cdb, AMMAPSIZE, desc->stCommon.uiOffset, desc->stCommon.uiLength, memtrack, (GDestroyNotify) gst_dreamaudiosource_free_buffer);
-				if (desc->stCommon.uiLength == 0)
-				{
-					GST_WARNING_OBJECT (self, "ZERO SIZE BUFFER");
-					_gst_dreamaudiosource_emit_signal_lost (self);
-				}
-				memtrack->self = self;
-				memtrack->buffer = readbuf;
-				memtrack->uiOffset = desc->stCommon.uiOffset;
-				memtrack->uiLength = desc->stCommon.uiLength;
-				self->memtrack_list = g_list_append(self->memtrack_list, memtrack);
-				GST_OBJECT_UNLOCK (self);
-			}
-			if (result_pts != GST_CLOCK_TIME_NONE)
-			{
-				GST_BUFFER_PTS(readbuf) = result_pts;
-				GST_BUFFER_DTS(readbuf) = result_pts;
-			}
-#ifdef dump
-			int wret = write(self->dumpfd, (unsigned char*)(enc->cdb + desc->stCommon.uiOffset), desc->stCommon.uiLength);
-			GST_LOG_OBJECT (self, "read=%i dumped=%i gst_buffer_get_size=%" G_GSIZE_FORMAT " ", desc->stCommon.uiLength, wret, gst_buffer_get_size (readbuf) );
+			GST_LOG_OBJECT (self, "post-calibration\n"
+			"  %" GST_TIME_FORMAT " =base_time       %" GST_TIME_FORMAT " =clock_time\n"
+			"  %" GST_TIME_FORMAT " =encoder_pts     %" GST_TIME_FORMAT " =pts_clock_time     %" GST_TIME_FORMAT " =result_pts\n"
+			"  %" GST_TIME_FORMAT " =internal        %" GST_TIME_FORMAT " =external           %" GST_TIME_FORMAT " =diff                %" PRId64 "/%" PRId64 " =rate\n"
+			"  %" GST_TIME_FORMAT " =my_int_time     %" GST_TIME_FORMAT " =pipeline_int_time"
+			,
+			GST_TIME_ARGS (base_time), GST_TIME_ARGS (clock_time),
+			GST_TIME_ARGS (encoder_pts), GST_TIME_ARGS (pts_clock_time), GST_TIME_ARGS (result_pts),
+			GST_TIME_ARGS (internal), GST_TIME_ARGS (external), GST_TIME_ARGS (diff), rate_n, rate_d,
+			GST_TIME_ARGS (my_int_time), GST_TIME_ARGS (pipeline_int_time)
+			);
 #endif
-			self->descriptors_count++;
-			break;
 		}
 
-		if (self->descriptors_count == self->descriptors_available)
+		/* nothing to wrap or split, but the encoder still wants the descriptor back */
+		if (G_UNLIKELY (desc->stCommon.uiLength == 0))
 		{
-			GST_LOG_OBJECT (self, "self->descriptors_count == self->descriptors_available -> release %i consumed descriptors", self->descriptors_count);
-			if (state == READTHREADSTATE_STOP)
-				GST_DEBUG_OBJECT (self, "readthread stopping, don't write to fd anymore!");
-			/* release consumed descs */
-			else if (write(enc->fd, &self->descriptors_count, sizeof(self->descriptors_count)) != sizeof(self->descriptors_count)) {
-				GST_WARNING_OBJECT (self, "release consumed descs write error!");
-				goto stop_running;
-			}
-			self->descriptors_available = 0;
+			GST_WARNING_OBJECT (self, "ZERO SIZE BUFFER, dropping descriptor %d", self->descriptors_count);
+			_gst_dreamaudiosource_emit_signal_lost (self);
+			self->descriptors_count++;
+			continue;
 		}
 
-		if (readbuf)
-		{
-			g_mutex_lock (&self->mutex);
-			if (!self->flushing)
-			{
-				if (gst_buffer_get_size (readbuf) == 0)
-				{
-					GstClockTime duration = timeout * GST_MSECOND;
-#if 1 // generate silence adts frames
-#define ADTS_HEADER_LEN       0x07
-#define AAC_PAYLOAD_LEN       0x06
-#define ADTS_DUMMY_FRAME_LEN  ADTS_HEADER_LEN + AAC_PAYLOAD_LEN
-					gst_buffer_unref(readbuf);
-					readbuf = gst_buffer_new_and_alloc (ADTS_DUMMY_FRAME_LEN);
-					GST_BUFFER_PTS (readbuf) = self->last_ts;
-					GST_BUFFER_DTS (readbuf) = self->last_ts;
-					GST_BUFFER_DURATION (readbuf) = duration;
-					GstMapInfo map;
-					gst_buffer_map (readbuf, &map, GST_MAP_WRITE);
-					guint8 *adts_header = map.data;
-					adts_header[0] = 0xff;
-					adts_header[1] = 0xf1;
-					adts_header[2] = 0x4c;
-					adts_header[3] = 0xb0;
-					adts_header[4] = 0x01;
-					adts_header[5] = 0xA0;
-					adts_header[6] = 0x00;
-					guint8 *payload = map.data+ADTS_HEADER_LEN;
-					payload[0] = 0x21;
-					payload[1] = 0x10;
-					payload[2] = 0x04;
-					payload[3] = 0x60;
-					payload[4] = 0x8c;
-					payload[5] = 0x1c;
-					gst_buffer_unmap (readbuf, &map);
-					GST_DEBUG_OBJECT (self, "Generated silence ADTS frame %" GST_PTR_FORMAT "" , readbuf);
-#else // produce gap events (mpegtsmux doesn't handle gap yet)
-					GstEvent *event = NULL;
-					event = gst_event_new_gap (self->last_ts, duration);
-					GST_DEBUG_OBJECT (self, "Sending %" GST_PTR_FORMAT" (from %" GST_TIME_FORMAT " to %" GST_TIME_FORMAT ")" , event, GST_TIME_ARGS (self->last_ts), GST_TIME_ARGS (self->last_ts+duration));
-					gst_pad_push_event (GST_BASE_SRC_PAD (self), event);
+		readbuf = gst_dreamaudiosource_wrap_descriptor (self, desc);
+#ifdef dump
+		int wret = write(self->dumpfd, (unsigned char*)(enc->cdb + desc->stCommon.uiOffset), desc->stCommon.uiLength);
+		GST_LOG_OBJECT (self, "read=%i dumped=%i gst_buffer_get_size=%" G_GSIZE_FORMAT " ", desc->stCommon.uiLength, wret, gst_buffer_get_size (readbuf) );
 #endif
-					self->last_ts += duration;
-				}
-				else
-					self->last_ts = GST_BUFFER_PTS(readbuf);
-				while (g_queue_get_length (&self->current_frames) >= self->buffer_size)
-				{
-					GstBuffer * oldbuf = g_queue_pop_head (&self->current_frames);
-					GST_WARNING_OBJECT (self, "dropping %" GST_PTR_FORMAT " because of queue overflow! buffers count=%i", oldbuf, g_queue_get_length (&self->current_frames));
-					gst_buffer_unref(oldbuf);
-					GST_BUFFER_FLAG_SET ((GstBuffer *) g_queue_peek_head (&self->current_frames), GST_BUFFER_FLAG_DISCONT);
-				}
-				if (discont)
-				{
-					GST_BUFFER_FLAG_SET (readbuf, GST_BUFFER_FLAG_DISCONT);
-					discont = FALSE;
-				}
-				g_queue_push_tail (&self->current_frames, readbuf);
-				GST_INFO_OBJECT (self, "read %" GST_PTR_FORMAT " to queue... buffers count=%i", readbuf, g_queue_get_length (&self->current_frames));
-			}
-			else
-			{
-				if (self->flushing)
-				{
-					GST_INFO_OBJECT (self, "dropping %" GST_PTR_FORMAT " because we're flushing", readbuf);
-					gst_buffer_unref(readbuf);
-				}
-				else
-				{
+		gst_dreamaudiosource_split_frames (self, readbuf, result_pts, raw, &batch);
+		self->descriptors_count++;
+	}
 
-				}
-				gst_buffer_unref(readbuf);
-			}
-			g_cond_signal (&self->cond);
-			g_mutex_unlock (&self->mutex);
-			readbuf = NULL;
+	if (self->descriptors_count == self->descriptors_available)
+	{
+		GST_LOG_OBJECT (self, "self->descriptors_count == self->descriptors_available -> release %i consumed descriptors", self->descriptors_count);
+		/* release consumed descs */
+		if (write(enc->fd, &self->descriptors_count, sizeof(self->descriptors_count)) != sizeof(self->descriptors_count)) {
+			GST_WARNING_OBJECT (self, "release consumed descs write error!");
+			g_queue_foreach (&batch, (GFunc) gst_buffer_unref, NULL);
+			g_queue_clear (&batch);
+			gst_dreamaudiosource_read_error (self);
+			return;
 		}
+		/* audio descriptors are returned right away, the tracker forgets about them */
+		gst_dreamsource_memtracker_detach (enc->memtracker);
+		self->descriptors_available = 0;
+		self->descriptors_count = 0;
 	}
 
-	g_assert_not_reached ();
-	return;
+	/* hand all frames of this read over, create() only takes them from the head */
+	if (!g_queue_is_empty (&batch))
+	{
+		if (!(gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING))
+		{
+			while ((readbuf = g_queue_pop_head (&batch)))
+				gst_dreamaudiosource_queue (self, readbuf);
+		}
+		else
+		{
+			GST_INFO_OBJECT (self, "dropping %i buffers because we're flushing", g_queue_get_length (&batch));
+			g_queue_foreach (&batch, (GFunc) gst_buffer_unref, NULL);
+			g_queue_clear (&batch);
+		}
+		readbuf = NULL;
+	}
+
+	gst_dreamaudiosource_rearm (self);
+}
+
+static void gst_dreamaudiosource_encoder_cb (GstDreamAudioSource * self, guint32 events)
+{
+	EncoderInfo *enc = self->encoder;
+
+	if (CONTROL_STATE (gst_dreamsource_control_get (&self->control)) != READTRREADSTATE_RUNNING)
+		return;
 
-	stop_running:
+	if (events == 0)
 	{
-//		g_mutex_unlock (&self->mutex);
-		g_cond_signal (&self->cond);
-		GST_DEBUG ("stop running, exit thread");
-		message = gst_message_new_stream_status (GST_OBJECT_CAST (self), GST_STREAM_STATUS_TYPE_LEAVE, GST_ELEMENT_CAST (GST_OBJECT_PARENT(self)));
-		g_value_init (&val, GST_TYPE_G_THREAD);
-		g_value_set_boxed (&val, self->readthread);
-		gst_message_set_stream_status_object (message, &val);
-		g_value_unset (&val);
-		GST_DEBUG_OBJECT (self, "posting LEAVE stream status");
-		gst_element_post_message (GST_ELEMENT_CAST (self), message);
+		gst_clock_get_internal_time(self->encoder_clock);
+		if ((gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING))
+		{
+			GST_DEBUG_OBJECT (self, "FLUSHING!");
+			gst_dreamsource_frame_ring_wakeup (self->current_frames);
+			gst_dreamaudiosource_rearm (self);
+			return;
+		}
+		GST_DEBUG_OBJECT (self, "ENCODER TIMEOUT");
+		self->discont = TRUE;
+		gst_dreamaudiosource_gap_start (self);
+		gst_dreamaudiosource_rearm (self);
 		return;
 	}
+
+	gst_dreamaudiosource_gap_stop (self);
+
+	self->clock_time = gst_clock_get_internal_time (self->encoder_clock);
+	self->base_time = gst_element_get_base_time(GST_ELEMENT(self));
+	int rlen = read(enc->fd, enc->buffer, ABUFSIZE);
+	if (rlen <= 0 || rlen % ABDSIZE ) {
+		GST_WARNING_OBJECT (self, "read error %s (%i)", strerror(errno), errno);
+		gst_dreamaudiosource_read_error (self);
+		return;
+	}
+	self->descriptors_available = rlen / ABDSIZE;
+	GST_LOG_OBJECT (self, "encoder buffer was empty, %d descriptors available", self->descriptors_available);
+	gst_dreamaudiosource_consume (self);
+}
+
+/* called on the reactor thread, which owns the descriptors, before a pause stops the encoder */
+static void gst_dreamaudiosource_release_descriptors (GstDreamAudioSource * self)
+{
+	/* consume() returns a whole read at once, only a read it didn't finish is still outstanding */
+	unsigned int released = self->descriptors_available;
+
+	if (released)
+		write(self->encoder->fd, &released, sizeof(released));
+	self->descriptors_available = self->descriptors_count = 0;
+	GST_DEBUG_OBJECT (self, "returned %u descriptors to the encoder", released);
+
+	g_mutex_lock (&self->mutex);
+	self->release_pending = FALSE;
+	g_cond_signal (&self->release_cond);
+	g_mutex_unlock (&self->mutex);
+}
+
+static void gst_dreamaudiosource_control_cb (GstDreamAudioSource * self, guint32 events)
+{
+	gint word = gst_dreamsource_control_take (&self->control);
+
+	GST_LOG_OBJECT (self, "control word 0x%02x", word);
+	if (word & CONTROL_RELEASE)
+		gst_dreamaudiosource_release_descriptors (self);
+	gst_dreamaudiosource_rearm (self);
+}
+
+static void gst_dreamaudiosource_push_gap (GstDreamAudioSource * self, GstBuffer * marker)
+{
+	GstEvent *event = gst_event_new_gap (GST_BUFFER_PTS (marker), GST_BUFFER_DURATION (marker));
+
+	GST_DEBUG_OBJECT (self, "Sending %" GST_PTR_FORMAT, event);
+	gst_pad_push_event (GST_BASE_SRC_PAD (self), event);
+	gst_buffer_unref (marker);
 }
 
 static GstFlowReturn
@@ -906,25 +1247,51 @@ gst_dreamaudiosource_create (GstPushSrc * psrc, GstBuffer ** outbuf)
 {
 	GstDreamAudioSource *self = GST_DREAMAUDIOSOURCE (psrc);
 
-	GST_LOG_OBJECT (self, "new buffer requested. queue has %i buffers", g_queue_get_length (&self->current_frames));
+	if (G_UNLIKELY (!self->current_frames))
+		return GST_FLOW_FLUSHING;
 
-	g_mutex_lock (&self->mutex);
-	while (g_queue_is_empty (&self->current_frames) && !self->flushing)
+	if (G_UNLIKELY (self->pending_gap))
 	{
-		GST_DEBUG_OBJECT (self, "waiting for buffer from encoder");
-		g_cond_wait (&self->cond, &self->mutex);
+		gst_dreamaudiosource_push_gap (self, self->pending_gap);
+		self->pending_gap = NULL;
 	}
 
-	*outbuf = g_queue_pop_head (&self->current_frames);
-	g_mutex_unlock (&self->mutex);
+	GST_LOG_OBJECT (self, "new buffer requested. queue has %i buffers", gst_dreamsource_frame_ring_length (self->current_frames));
+
+	while ((*outbuf = gst_dreamsource_frame_ring_wait (self->current_frames, &self->control)) && GAP_MARKER (*outbuf))
+		gst_dreamaudiosource_push_gap (self, *outbuf);
+	if (!*outbuf)
+	{
+		GST_INFO_OBJECT (self, "FLUSHING");
+		return GST_FLOW_FLUSHING;
+	}
 
-	if (*outbuf)
+	/* the first frame brought the codec_data that raw caps were waiting for */
+	if (G_UNLIKELY (g_atomic_int_get (&self->caps_pending)) && !gst_dreamaudiosource_negotiate (GST_BASE_SRC (psrc)))
 	{
-		GST_INFO_OBJECT (self, "pushing %" GST_PTR_FORMAT ". queue has %i buffers", *outbuf, g_queue_get_length (&self->current_frames));
+		gst_buffer_unref (*outbuf);
+		*outbuf = NULL;
+		return GST_FLOW_NOT_NEGOTIATED;
+	}
+
+#if GST_CHECK_VERSION(1,14,0)
+	if (self->buffer_list && gst_dreamsource_frame_ring_length (self->current_frames) > 0)
+	{
+		GstBufferList *list = gst_buffer_list_new_sized (gst_dreamsource_frame_ring_length (self->current_frames) + 1);
+		do
+			gst_buffer_list_add (list, *outbuf);
+		while ((*outbuf = gst_dreamsource_frame_ring_pop (self->current_frames)) && !GAP_MARKER (*outbuf));
+		/* the list goes out after we return, so a GAP event has to wait for the next call */
+		self->pending_gap = *outbuf;
+		*outbuf = NULL;
+		GST_INFO_OBJECT (self, "pushing list of %i buffers", gst_buffer_list_length (list));
+		gst_base_src_submit_buffer_list (GST_BASE_SRC (psrc), list);
 		return GST_FLOW_OK;
 	}
-	GST_INFO_OBJECT (self, "FLUSHING");
-	return GST_FLOW_FLUSHING;
+#endif
+
+	GST_INFO_OBJECT (self, "pushing %" GST_PTR_FORMAT ". queue has %i buffers", *outbuf, gst_dreamsource_frame_ring_length (self->current_frames));
+	return GST_FLOW_OK;
 }
 
 static GstStateChangeReturn gst_dreamaudiosource_change_state (GstElement * element, GstStateChange transition)
@@ -960,12 +1327,39 @@ static GstStateChangeReturn gst_dreamaudiosource_change_state (GstElement * elem
 				GST_INFO_OBJECT (self, "%" GST_PTR_FORMAT "'s bitrate=%i -> set internal buffer_size to %i", self->dreamvideosrc, videobitrate, self->buffer_size);
 			}
 			self->dts_offset = GST_CLOCK_TIME_NONE;
+			self->last_ts = GST_CLOCK_TIME_NONE;
+			self->next_ts = GST_CLOCK_TIME_NONE;
+			self->ts_anchor = GST_CLOCK_TIME_NONE;
+			gst_dreamsource_unwrapper_reset (&self->pts_unwrapper);
+			/* the encoder may come back with another configuration, raw caps wait for its first header */
+			GST_OBJECT_LOCK (self);
+			gst_buffer_replace (&self->codec_data, NULL);
+			GST_OBJECT_UNLOCK (self);
 #ifdef PROVIDE_CLOCK
 			gst_element_post_message (element, gst_message_new_clock_provide (GST_OBJECT_CAST (element), self->encoder_clock, TRUE));
 #endif
-			self->flushing = TRUE;
-			self->readthread = g_thread_try_new ("dreamaudiosrc-read", (GThreadFunc) gst_dreamaudiosource_read_thread_func, self, NULL);
-			GST_DEBUG_OBJECT (self, "started readthread @%p", self->readthread);
+			self->current_frames = gst_dreamsource_frame_ring_new (self->buffer_size);
+			if (!self->current_frames)
+				return GST_STATE_CHANGE_FAILURE;
+			gst_dreamsource_control_reset (&self->control, READTRREADSTATE_PAUSED | CONTROL_FLUSHING);
+			self->discont = TRUE;
+			/* the encoder fd is only watched while running, commands arm it */
+			self->encoder_watch = gst_dreamsource_reactor_add (self->encoder->fd, 0, (ReactorFunc) gst_dreamaudiosource_encoder_cb, self);
+			if (self->encoder_watch)
+				self->control_watch = gst_dreamsource_reactor_add (self->control.fd, EPOLLIN, (ReactorFunc) gst_dreamaudiosource_control_cb, self);
+			if (self->control_watch)
+				self->gap_watch = gst_dreamsource_reactor_add (self->gap_timer, EPOLLIN, (ReactorFunc) gst_dreamaudiosource_gap_cb, self);
+			if (!self->gap_watch)
+			{
+				gst_dreamsource_reactor_remove (self->control_watch);
+				gst_dreamsource_reactor_remove (self->encoder_watch);
+				self->control_watch = NULL;
+				self->encoder_watch = NULL;
+				gst_dreamsource_frame_ring_free (self->current_frames, (GDestroyNotify) gst_buffer_unref);
+				self->current_frames = NULL;
+				return GST_STATE_CHANGE_FAILURE;
+			}
+			GST_DEBUG_OBJECT (self, "watching encoder fd=%i", self->encoder->fd);
 			break;
 		case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 			g_mutex_lock (&self->mutex);
@@ -987,7 +1381,6 @@ static GstStateChangeReturn gst_dreamaudiosource_change_state (GstElement * elem
 			if ( ret != 0 )
 				goto fail;
 			self->descriptors_available = 0;
-			CLEAR_COMMAND (self);
 			g_mutex_unlock (&self->mutex);
 			break;
 		default:
@@ -1000,18 +1393,19 @@ static GstStateChangeReturn gst_dreamaudiosource_change_state (GstElement * elem
 	switch (transition) {
 		case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 			g_mutex_lock (&self->mutex);
-			SEND_COMMAND (self, CONTROL_RUN);
+			gst_dreamsource_control_set_state (&self->control, READTRREADSTATE_RUNNING);
 			GST_INFO_OBJECT (self, "started encoder!");
 			g_mutex_unlock (&self->mutex);
 			break;
 		case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 			g_mutex_lock (&self->mutex);
 			GST_DEBUG_OBJECT (self, "GST_STATE_CHANGE_PLAYING_TO_PAUSED self->descriptors_count=%i self->descriptors_available=%i", self->descriptors_count, self->descriptors_available);
-			SEND_COMMAND (self, CONTROL_PAUSE);
-			if (self->descriptors_count < self->descriptors_available)
-				self->descriptors_count = self->descriptors_available;
-			if (self->descriptors_count)
-				write(self->encoder->fd, &self->descriptors_count, sizeof(self->descriptors_count));
+			gst_dreamsource_control_set_state (&self->control, READTRREADSTATE_PAUSED);
+			/* the reactor thread returns the descriptors, wait for it before stopping the encoder */
+			self->release_pending = TRUE;
+			gst_dreamsource_control_set_flags (&self->control, CONTROL_RELEASE);
+			while (self->release_pending)
+				g_cond_wait (&self->release_cond, &self->mutex);
 			ret = ioctl(self->encoder->fd, AENC_STOP);
 			if ( ret != 0 )
 				goto fail;
@@ -1027,9 +1421,18 @@ static GstStateChangeReturn gst_dreamaudiosource_change_state (GstElement * elem
 			gst_element_post_message (element, gst_message_new_clock_lost (GST_OBJECT_CAST (element), self->encoder_clock));
 			gst_clock_set_calibration (self->encoder_clock, 0, 0, 1, 1);
 #endif
-			GST_DEBUG_OBJECT (self, "stopping readthread @%p...", self->readthread);
-			SEND_COMMAND (self, CONTROL_STOP);
-			g_thread_join (self->readthread);
+			GST_DEBUG_OBJECT (self, "stop watching encoder fd=%i", self->encoder->fd);
+			gst_dreamsource_reactor_remove (self->gap_watch);
+			gst_dreamsource_reactor_remove (self->control_watch);
+			gst_dreamsource_reactor_remove (self->encoder_watch);
+			self->gap_watch = NULL;
+			self->control_watch = NULL;
+			self->encoder_watch = NULL;
+			gst_dreamaudiosource_gap_stop (self);
+			gst_buffer_replace (&self->pending_gap, NULL);
+			g_atomic_int_set (&self->caps_pending, FALSE);
+			gst_dreamsource_frame_ring_free (self->current_frames, (GDestroyNotify) gst_buffer_unref);
+			self->current_frames = NULL;
 			if (self->dreamvideosrc)
 				gst_object_unref(self->dreamvideosrc);
 			self->dreamvideosrc = NULL;
@@ -1056,9 +1459,8 @@ gst_dreamaudiosource_dispose (GObject * gobject)
 #ifdef dump
 	close(self->dumpfd);
 #endif
-	g_list_free(self->memtrack_list);
+	g_cond_clear (&self->release_cond);
 	g_mutex_clear (&self->mutex);
-	g_cond_clear (&self->cond);
 	GST_DEBUG_OBJECT (self, "disposed");
 	G_OBJECT_CLASS (parent_class)->dispose (gobject);
 }
@@ -34,11 +34,17 @@ struct _AudioBufferDescriptor
 struct _AudioFormatInfo {
 	gint bitrate;
 	gint samplerate;
+	gint channels;
 };
 
 #define ABDSIZE		sizeof(AudioBufferDescriptor)
 #define ABUFSIZE	(1024*16)
 #define AMMAPSIZE	(256*1024)
+#define AMEMTRACKSIZE	256	/* buffers which may be held downstream, power of two */
+
+#define AAC_FRAME_SAMPLES	1024
+#define ADTS_HEADER_LEN		7
+#define ALIGNMENT_THRESHOLD	(40 * GST_MSECOND)	/* encoder PTS deviation that resyncs the sample counter */
 
 #define AENC_START        _IO('v', 128)
 #define AENC_STOP         _IO('v', 129)
@@ -74,14 +80,6 @@ typedef struct _AudioBufferDescriptor      AudioBufferDescriptor;
 // #define dump 1
 #define PROVIDE_CLOCK
 
-struct _buffer_memorytracker
-{
-	GstDreamAudioSource *self;
-	GstBuffer *buffer;
-	guint uiOffset;
-	guint uiLength;
-};
-
 struct _GstDreamAudioSource
 {
 	GstPushSrc element;
@@ -91,6 +89,9 @@ struct _GstDreamAudioSource
 	GstDreamAudioSourceInputMode input_mode;
 
 	AudioFormatInfo audio_info;
+	volatile gint raw_output;       /* stream-format=raw, frames go out without ADTS header */
+	GstBuffer *codec_data;          /* AudioSpecificConfig from the first ADTS header */
+	volatile gint caps_pending;     /* raw caps wait for codec_data */
 
 	unsigned int descriptors_available;
 	unsigned int descriptors_count;
@@ -102,18 +103,45 @@ struct _GstDreamAudioSource
 	gint64 dts_offset;
 
 	GMutex mutex;
-	GCond cond;
-	int control_sock[2];
+	GCond release_cond;
+	gboolean release_pending;       /* a pause waits for the reactor thread to return the descriptors */
+	ControlChannel control;
+
 
-	gboolean flushing;
+	/* read side, driven by the reactor callbacks */
+	ReactorWatch *encoder_watch;
+	ReactorWatch *control_watch;
+	GstClockTime clock_time, base_time;
+	gboolean discont;
 
-	GThread *readthread;
-	GQueue current_frames;
+	FrameRing *current_frames;
 	guint buffer_size;
-	GList *memtrack_list;
+	gboolean buffer_list;
 
 	GstClock *encoder_clock;
 	GstClockTime last_ts;
+	TimestampUnwrapper pts_unwrapper;
+	ClockCalibration calibration;
+
+	/* frames are timestamped by counting samples from an encoder PTS */
+	GstClockTime ts_anchor;
+	gint anchor_rate;
+	guint64 anchor_samples;
+
+	/* silence generation while the encoder delivers nothing */
+	GstBuffer *silence;             /* ADTS silence frame for the negotiated format */
+	gboolean gap_events;
+	int gap_timer;
+	ReactorWatch *gap_watch;
+	gboolean gap_active;
+	GstBuffer *gap_silence;         /* snapshot of silence for the running gap */
+	gboolean gap_raw;
+	gint gap_rate;
+	gboolean gap_send_events;
+	GstClockTime gap_start;
+	guint64 gap_samples;
+	GstClockTime next_ts;           /* end of the last queued frame */
+	GstBuffer *pending_gap;         /* gap marker held back behind a buffer list */
 };
 
 struct _GstDreamAudioSourceClass
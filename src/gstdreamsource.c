@@ -22,55 +22,84 @@
 #include <gst/gst.h>
 
 #include "gstdreamsource.h"
-#include "gstdreamaudiosource.h"
-#include "gstdreamvideosource.h"
-#include "gstdreamtssource.h"
-
-static gboolean
-plugin_init (GstPlugin * plugin)
-{
-  gboolean res = TRUE;
-  res &= gst_dreamaudiosource_plugin_init (plugin);
-  res &= gst_dreamvideosource_plugin_init (plugin);
-  res &= gst_dreamtssource_plugin_init (plugin);
-
-  return res;
-}
-
-GST_PLUGIN_DEFINE (
-	GST_VERSION_MAJOR,
-	GST_VERSION_MINOR,
-	dreamsource,
-	"Dreambox Audio/Video Source",
-	plugin_init,
-	VERSION,
-	"Proprietary",
-	"dreamsource",
-	"https://schwerkraft.elitedvb.net/scm/browser.php?group_id=10"
-)
 
 GST_DEBUG_CATEGORY_STATIC (dreamsourceclock_debug);
 #define GST_CAT_DEFAULT dreamsourceclock_debug
 
 G_DEFINE_TYPE (GstDreamSourceClock, gst_dreamsource_clock, GST_TYPE_SYSTEM_CLOCK);
 
+enum
+{
+	ARG_0,
+	ARG_SAMPLE_INTERVAL
+};
+
+#define DEFAULT_SAMPLE_INTERVAL  (100 * GST_MSECOND)
+#define MAX_SAMPLE_INTERVAL      (10 * GST_SECOND)  /* well below the 159s STC wrap */
+
 static GstClockTime gst_dreamsource_clock_get_internal_time (GstClock * clock);
+static void gst_dreamsource_clock_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec);
+static void gst_dreamsource_clock_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec);
 
 static void
 gst_dreamsource_clock_class_init (GstDreamSourceClockClass * klass)
 {
+	GObjectClass *gobject_class = (GObjectClass *) klass;
 	GstClockClass *clock_class = (GstClockClass *) klass;
 	GST_DEBUG_CATEGORY_INIT (dreamsourceclock_debug, "dreamsourceclock", 0, "dreamsourceclock");
+	gobject_class->set_property = gst_dreamsource_clock_set_property;
+	gobject_class->get_property = gst_dreamsource_clock_get_property;
 	clock_class->get_internal_time = gst_dreamsource_clock_get_internal_time;
+
+	g_object_class_install_property (gobject_class, ARG_SAMPLE_INTERVAL,
+	  g_param_spec_uint64 ("sample-interval", "Sample interval",
+	    "Interval in ns at which the encoder STC is sampled and extrapolated in between (0=query it on every call)", 0, MAX_SAMPLE_INTERVAL, DEFAULT_SAMPLE_INTERVAL,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+}
+
+static void
+gst_dreamsource_clock_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+	GstDreamSourceClock *self = GST_DREAMSOURCE_CLOCK (object);
+
+	switch (prop_id) {
+		case ARG_SAMPLE_INTERVAL:
+			GST_OBJECT_LOCK (self);
+			self->sample_interval = g_value_get_uint64 (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void
+gst_dreamsource_clock_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
+{
+	GstDreamSourceClock *self = GST_DREAMSOURCE_CLOCK (object);
+
+	switch (prop_id) {
+		case ARG_SAMPLE_INTERVAL:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint64 (value, self->sample_interval);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
 }
 
 static void
 gst_dreamsource_clock_init (GstDreamSourceClock * self)
 {
 	self->fd = 0;
-	self->stc_offset = 0;
+	gst_dreamsource_unwrapper_init (&self->stc_unwrapper, STC_BITS);
 	self->first_stc = 0;
-	self->prev_stc = 0;
+	self->sample_interval = DEFAULT_SAMPLE_INTERVAL;
+	self->seqnum = 0;
+	self->sampled = FALSE;
 	GST_OBJECT_FLAG_SET (self, GST_CLOCK_FLAG_CAN_SET_MASTER);
 }
 
@@ -83,34 +112,28 @@ gst_dreamsource_clock_new (const gchar * name, int fd)
 	return GST_CLOCK_CAST (self);
 }
 
-static GstClockTime gst_dreamsource_clock_get_internal_time (GstClock * clock)
+static inline gint64 gst_dreamsource_clock_monotonic_time (void)
 {
-	GstDreamSourceClock *self = GST_DREAMSOURCE_CLOCK (clock);
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
 
+/* called with the object lock held, returns GST_CLOCK_TIME_NONE on failure */
+static GstClockTime gst_dreamsource_clock_read_stc (GstDreamSourceClock * self)
+{
 	uint32_t stc = 0;
-	GstClockTime encoder_time = 0;
+	GstClockTime encoder_time = GST_CLOCK_TIME_NONE;
 
-	GST_OBJECT_LOCK(self);
 	if (self->fd > 0) {
 		int ret = ioctl(self->fd, ENC_GET_STC, &stc);
 		if (ret == 0)
 		{
 			GST_TRACE_OBJECT (self, "current stc=%" GST_TIME_FORMAT "", GST_TIME_ARGS(ENCTIME_TO_GSTTIME(stc)));
-			if (G_UNLIKELY(self->first_stc == 0))
+			if (G_UNLIKELY(!self->stc_unwrapper.valid))
 				self->first_stc = stc;
 
-			stc -= self->first_stc;
-
-			if (stc < self->prev_stc)
-			{
-				self->stc_offset += UINT32_MAX;
-				GST_LOG_OBJECT (self, "clock_wrap! new offset=%" PRIu64 " ", self->stc_offset);
-			}
-
-			self->prev_stc = stc;
-
-			uint64_t total_stc = stc + self->stc_offset;
-// 			GST_WARNING_OBJECT (self, "after subtract stc_offset=%" PRIu64 "   new total_stc=%" PRIu64 "", self->stc_offset, total_stc);
+			uint64_t total_stc = gst_dreamsource_unwrapper_unwrap (&self->stc_unwrapper, stc) - self->first_stc;
 			encoder_time = ENCTIME_TO_GSTTIME(total_stc);
 			GST_TRACE_OBJECT (self, "result %" GST_TIME_FORMAT "", GST_TIME_ARGS(encoder_time));
 		}
@@ -120,6 +143,751 @@ static GstClockTime gst_dreamsource_clock_get_internal_time (GstClock * clock)
 	else
 		GST_ERROR_OBJECT (self, "timebase not available because encoder device is not opened");
 
-	GST_OBJECT_UNLOCK(self);
 	return encoder_time;
 }
+
+/*
+ * Called with the object lock held. Rather than jumping to the new sample,
+ * the applied rate is slewed so the extrapolation meets the sampled STC
+ * trajectory after one more interval, which keeps the clock continuous.
+ */
+static void gst_dreamsource_clock_sample (GstDreamSourceClock * self)
+{
+	GstClockTime stc_time = gst_dreamsource_clock_read_stc (self);
+	gint64 now = gst_dreamsource_clock_monotonic_time ();
+	GstClockTime base_time;
+	gdouble rate;
+
+	if (stc_time == GST_CLOCK_TIME_NONE)
+		return;
+
+	if (G_UNLIKELY (!self->sampled))
+	{
+		base_time = stc_time;
+		rate = self->fitted_rate = 1.0;
+		self->sampled = TRUE;
+	}
+	else
+	{
+		gint64 elapsed = now - self->last_sample_mono;
+		gdouble extrapolated = self->base_time + (now - self->base_mono) * self->rate;
+		gdouble error;
+
+		if (elapsed > 0)
+		{
+			gdouble measured = (gdouble) ((gint64) (stc_time - self->last_sample)) / elapsed;
+			self->fitted_rate += (measured - self->fitted_rate) / 8;
+		}
+		error = (gdouble) stc_time - extrapolated;
+		rate = self->fitted_rate + error / MAX (self->sample_interval, GST_MSECOND);
+		rate = CLAMP (rate, self->fitted_rate / 2, self->fitted_rate * 2);
+		base_time = extrapolated > 0 ? (GstClockTime) extrapolated : 0;
+		GST_LOG_OBJECT (self, "stc sample %" GST_TIME_FORMAT " error %.0fns fitted rate %.9f applied %.9f", GST_TIME_ARGS (stc_time), error, self->fitted_rate, rate);
+	}
+
+	self->last_sample = stc_time;
+	self->last_sample_mono = now;
+
+	g_atomic_int_inc (&self->seqnum);
+	self->base_mono = now;
+	self->base_time = base_time;
+	self->rate = rate;
+	g_atomic_int_inc (&self->seqnum);
+}
+
+static GstClockTime gst_dreamsource_clock_get_internal_time (GstClock * clock)
+{
+	GstDreamSourceClock *self = GST_DREAMSOURCE_CLOCK (clock);
+	GstClockTime encoder_time;
+	gint64 base_mono, now;
+	GstClockTime base_time;
+	gdouble rate;
+	gint seqnum;
+
+	if (!self->sample_interval)
+	{
+		GST_OBJECT_LOCK(self);
+		encoder_time = gst_dreamsource_clock_read_stc (self);
+		GST_OBJECT_UNLOCK(self);
+		return encoder_time == GST_CLOCK_TIME_NONE ? 0 : encoder_time;
+	}
+
+	now = gst_dreamsource_clock_monotonic_time ();
+	do {
+		seqnum = g_atomic_int_get (&self->seqnum);
+		base_mono = self->base_mono;
+		base_time = self->base_time;
+		rate = self->rate;
+	} while ((seqnum & 1) || seqnum != g_atomic_int_get (&self->seqnum));
+
+	/* only one thread samples, everybody else keeps extrapolating meanwhile */
+	if (G_UNLIKELY (seqnum == 0))
+	{
+		GST_OBJECT_LOCK(self);
+		if (!self->sampled)
+			gst_dreamsource_clock_sample (self);
+		encoder_time = self->sampled ? self->base_time : 0;
+		GST_OBJECT_UNLOCK(self);
+		return encoder_time;
+	}
+	else if (now - base_mono >= (gint64) self->sample_interval && g_mutex_trylock (GST_OBJECT_GET_LOCK (self)))
+	{
+		if (self->base_mono == base_mono)
+			gst_dreamsource_clock_sample (self);
+		GST_OBJECT_UNLOCK(self);
+	}
+
+	if (now < base_mono)
+		now = base_mono;
+	return base_time + (GstClockTime) ((now - base_mono) * rate);
+}
+
+void
+gst_dreamsource_unwrapper_init (TimestampUnwrapper *unwrapper, guint bits)
+{
+	unwrapper->mask = COUNTER_MASK (bits);
+	gst_dreamsource_unwrapper_reset (unwrapper);
+}
+
+void
+gst_dreamsource_unwrapper_reset (TimestampUnwrapper *unwrapper)
+{
+	unwrapper->last = 0;
+	unwrapper->valid = FALSE;
+}
+
+/* extends value to the 64 bit value closest to reference */
+guint64
+gst_dreamsource_unwrap_near (guint64 mask, guint64 value, guint64 reference)
+{
+	guint64 forward = (value - reference) & mask;
+	guint64 backward = (reference - value) & mask;
+
+	if (forward <= (mask >> 1))
+		return reference + forward;
+	if (backward <= reference)
+		return reference - backward;
+	/* a step back from before the first wrap, there is nothing below 0 */
+	return 0;
+}
+
+guint64
+gst_dreamsource_unwrapper_unwrap (TimestampUnwrapper *unwrapper, guint64 value)
+{
+	if (G_UNLIKELY (!unwrapper->valid))
+	{
+		unwrapper->last = value & unwrapper->mask;
+		unwrapper->valid = TRUE;
+		return unwrapper->last;
+	}
+	unwrapper->last = gst_dreamsource_unwrap_near (unwrapper->mask, value, unwrapper->last);
+	return unwrapper->last;
+}
+
+void
+gst_dreamsource_calibration_update (ClockCalibration *calibration, GstClock *clock)
+{
+	GstClockTime rate_num, rate_denom;
+
+	gst_clock_get_calibration (clock, &calibration->internal, &calibration->external, &rate_num, &rate_denom);
+	if (G_UNLIKELY (rate_num != calibration->rate_num || rate_denom != calibration->rate_denom))
+	{
+		calibration->rate_num = rate_num;
+		calibration->rate_denom = rate_denom;
+		calibration->rate = gst_util_uint64_scale (rate_num, G_GUINT64_CONSTANT (1) << 32, rate_denom);
+	}
+}
+
+MemoryTracker *
+gst_dreamsource_memtracker_new (guint capacity)
+{
+	MemoryTracker *tracker;
+
+	g_return_val_if_fail ((capacity & (capacity - 1)) == 0, NULL);
+
+	tracker = g_new0 (MemoryTracker, 1);
+	tracker->refcount = 1;
+	g_mutex_init (&tracker->mutex);
+	tracker->entries = g_new0 (MemoryTrackerEntry, capacity);
+	tracker->capacity = capacity;
+	tracker->last_offset = UINT32_MAX;
+	return tracker;
+}
+
+MemoryTracker *
+gst_dreamsource_memtracker_ref (MemoryTracker *tracker)
+{
+	g_atomic_int_inc (&tracker->refcount);
+	return tracker;
+}
+
+void
+gst_dreamsource_memtracker_unref (MemoryTracker *tracker)
+{
+	if (!g_atomic_int_dec_and_test (&tracker->refcount))
+		return;
+	g_mutex_clear (&tracker->mutex);
+	g_free (tracker->entries);
+	g_free (tracker);
+}
+
+void
+gst_dreamsource_memtracker_set_notify (MemoryTracker *tracker, MemoryTrackerNotify notify, gpointer user_data)
+{
+	g_mutex_lock (&tracker->mutex);
+	tracker->notify = notify;
+	tracker->user_data = user_data;
+	g_mutex_unlock (&tracker->mutex);
+}
+
+gboolean
+gst_dreamsource_memtracker_is_full (MemoryTracker *tracker)
+{
+	gboolean full;
+	g_mutex_lock (&tracker->mutex);
+	full = (tracker->tail - tracker->head == tracker->capacity);
+	g_mutex_unlock (&tracker->mutex);
+	return full;
+}
+
+/* takes a slot for a descriptor whose memory gets wrapped into a buffer,
+ * returns NULL if all slots are in use */
+MemoryTrackerEntry *
+gst_dreamsource_memtracker_push (MemoryTracker *tracker, guint offset, guint length)
+{
+	MemoryTrackerEntry *entry = NULL;
+
+	g_mutex_lock (&tracker->mutex);
+	if (tracker->tail - tracker->head < tracker->capacity)
+	{
+		entry = &tracker->entries[tracker->tail & (tracker->capacity - 1)];
+		entry->tracker = gst_dreamsource_memtracker_ref (tracker);
+		entry->uiOffset = offset;
+		entry->uiLength = length;
+		entry->skipped = 0;
+		entry->in_use = TRUE;
+		tracker->tail++;
+		tracker->outstanding++;
+		tracker->last_offset = offset;
+		tracker->last_length = length;
+	}
+	g_mutex_unlock (&tracker->mutex);
+	return entry;
+}
+
+/* accounts a descriptor that was consumed without handing out its memory */
+void
+gst_dreamsource_memtracker_skip (MemoryTracker *tracker, guint offset, guint length)
+{
+	g_mutex_lock (&tracker->mutex);
+	if (tracker->tail == tracker->head)
+		tracker->releasable++;
+	else
+		tracker->entries[(tracker->tail - 1) & (tracker->capacity - 1)].skipped++;
+	tracker->outstanding++;
+	tracker->last_offset = offset;
+	tracker->last_length = length;
+	g_mutex_unlock (&tracker->mutex);
+}
+
+/* GDestroyNotify for buffers wrapping tracked memory */
+void
+gst_dreamsource_memtracker_release (MemoryTrackerEntry *entry)
+{
+	MemoryTracker *tracker = entry->tracker;
+	gboolean advanced = FALSE;
+
+	g_mutex_lock (&tracker->mutex);
+	entry->in_use = FALSE;
+	while (tracker->head != tracker->tail)
+	{
+		MemoryTrackerEntry *oldest = &tracker->entries[tracker->head & (tracker->capacity - 1)];
+		guint count, detached;
+		if (oldest->in_use)
+			break;
+		count = 1 + oldest->skipped;
+		detached = MIN (count, tracker->detached);
+		tracker->detached -= detached;
+		tracker->releasable += count - detached;
+		tracker->head++;
+		advanced = TRUE;
+	}
+	if (advanced && tracker->notify)
+		tracker->notify (tracker->user_data);
+	g_mutex_unlock (&tracker->mutex);
+	gst_dreamsource_memtracker_unref (tracker);
+}
+
+/* returns the number of descriptors which may be written back to the driver */
+guint
+gst_dreamsource_memtracker_pop_released (MemoryTracker *tracker)
+{
+	guint count;
+	g_mutex_lock (&tracker->mutex);
+	count = tracker->releasable;
+	tracker->releasable = 0;
+	tracker->outstanding -= count;
+	g_mutex_unlock (&tracker->mutex);
+	return count;
+}
+
+/* forgets about all descriptors not yet returned to the driver, e.g. when the
+ * encoder is stopped. Returns their number, slots still referenced by buffers
+ * stay occupied until those are freed */
+guint
+gst_dreamsource_memtracker_detach (MemoryTracker *tracker)
+{
+	guint count;
+	g_mutex_lock (&tracker->mutex);
+	count = tracker->outstanding;
+	tracker->detached += tracker->outstanding - tracker->releasable;
+	tracker->releasable = 0;
+	tracker->outstanding = 0;
+	g_mutex_unlock (&tracker->mutex);
+	return count;
+}
+
+/* The driver hands out every descriptor which wasn't returned to it yet on each
+ * read, so the descriptors which were already consumed are at the start of the
+ * array. Returns the index of the first descriptor not seen before. */
+guint
+gst_dreamsource_memtracker_find_unseen (MemoryTracker *tracker, const unsigned char *descriptors, guint count, gsize stride)
+{
+	guint i;
+	g_mutex_lock (&tracker->mutex);
+	for (i = MIN (tracker->outstanding, count); i > 0; i--)
+	{
+		const CompressedBufferDescriptor *desc = (const CompressedBufferDescriptor *) (descriptors + (i - 1) * stride);
+		if (desc->uiOffset == tracker->last_offset && desc->uiLength == tracker->last_length)
+			break;
+	}
+	g_mutex_unlock (&tracker->mutex);
+	return i;
+}
+
+FrameRing *
+gst_dreamsource_frame_ring_new (guint size)
+{
+	FrameRing *ring;
+	int fd = eventfd (0, 0);
+
+	if (fd < 0)
+	{
+		GST_ERROR ("cannot create eventfd: %s (%i)", strerror(errno), errno);
+		return NULL;
+	}
+
+	ring = g_new0 (FrameRing, 1);
+	ring->capacity = 1 << g_bit_storage (MAX (size, 1) - 1);
+	ring->slots = g_new0 (FrameRingSlot, ring->capacity);
+	ring->wakeup_fd = fd;
+	return ring;
+}
+
+void
+gst_dreamsource_frame_ring_free (FrameRing *ring, GDestroyNotify free_func)
+{
+	gst_dreamsource_frame_ring_clear (ring, free_func);
+	close (ring->wakeup_fd);
+	g_free (ring->slots);
+	g_free (ring);
+}
+
+guint
+gst_dreamsource_frame_ring_length (FrameRing *ring)
+{
+	return (guint) g_atomic_int_get (&ring->tail) - (guint) g_atomic_int_get (&ring->head);
+}
+
+guint
+gst_dreamsource_frame_ring_bytes (FrameRing *ring)
+{
+	return (guint) g_atomic_int_get (&ring->bytes_in) - (guint) g_atomic_int_get (&ring->bytes_out);
+}
+
+/* producer side, timespan between the oldest and the newest queued frame */
+GstClockTime
+gst_dreamsource_frame_ring_duration (FrameRing *ring)
+{
+	guint tail = (guint) ring->tail;
+	guint head = (guint) g_atomic_int_get (&ring->head);
+	GstClockTime first, last;
+
+	if (tail == head)
+		return 0;
+
+	/* slots are only ever written by the producer, so reading the head slot is safe */
+	first = ring->slots[head & (ring->capacity - 1)].timestamp;
+	last = ring->slots[(tail - 1) & (ring->capacity - 1)].timestamp;
+	if (!GST_CLOCK_TIME_IS_VALID (first) || !GST_CLOCK_TIME_IS_VALID (last) || last < first)
+		return 0;
+	return last - first;
+}
+
+/* producer side, returns FALSE if the ring is full */
+gboolean
+gst_dreamsource_frame_ring_push (FrameRing *ring, gpointer frame, guint size, GstClockTime timestamp)
+{
+	guint tail = (guint) ring->tail;
+	FrameRingSlot *slot;
+
+	if (tail - (guint) g_atomic_int_get (&ring->head) == ring->capacity)
+		return FALSE;
+
+	slot = &ring->slots[tail & (ring->capacity - 1)];
+	slot->frame = frame;
+	slot->size = size;
+	slot->timestamp = timestamp;
+	g_atomic_int_set (&ring->bytes_in, (guint) ring->bytes_in + size);
+	g_atomic_int_set (&ring->tail, tail + 1);
+
+	if (g_atomic_int_get (&ring->waiting))
+		gst_dreamsource_frame_ring_wakeup (ring);
+	return TRUE;
+}
+
+/* consumer side, returns NULL if the ring is empty */
+gpointer
+gst_dreamsource_frame_ring_pop (FrameRing *ring)
+{
+	guint head = (guint) ring->head;
+	FrameRingSlot *slot;
+	gpointer frame;
+
+	if (head == (guint) g_atomic_int_get (&ring->tail))
+		return NULL;
+
+	/* the slot may be reused as soon as head moves on */
+	slot = &ring->slots[head & (ring->capacity - 1)];
+	frame = slot->frame;
+	g_atomic_int_set (&ring->bytes_out, (guint) ring->bytes_out + slot->size);
+	g_atomic_int_set (&ring->head, head + 1);
+	return frame;
+}
+
+/* consumer side, blocks until a frame is available or the control channel is flushing */
+gpointer
+gst_dreamsource_frame_ring_wait (FrameRing *ring, ControlChannel *control)
+{
+	gpointer frame;
+
+	while (!(frame = gst_dreamsource_frame_ring_pop (ring)))
+	{
+		eventfd_t count;
+		if (gst_dreamsource_control_get (control) & CONTROL_FLUSHING)
+			return NULL;
+		g_atomic_int_set (&ring->waiting, TRUE);
+		/* re-check after announcing ourselves, the producer might have missed it */
+		if (gst_dreamsource_frame_ring_length (ring) == 0 && !(gst_dreamsource_control_get (control) & CONTROL_FLUSHING))
+			eventfd_read (ring->wakeup_fd, &count);
+		g_atomic_int_set (&ring->waiting, FALSE);
+	}
+	return frame;
+}
+
+void
+gst_dreamsource_frame_ring_wakeup (FrameRing *ring)
+{
+	eventfd_write (ring->wakeup_fd, 1);
+}
+
+/* consumer side, only while the streaming thread doesn't pop */
+void
+gst_dreamsource_frame_ring_clear (FrameRing *ring, GDestroyNotify free_func)
+{
+	gpointer frame;
+	while ((frame = gst_dreamsource_frame_ring_pop (ring)))
+		free_func (frame);
+}
+
+gboolean
+gst_dreamsource_control_init (ControlChannel *control)
+{
+	control->word = READTHREADSTATE_NONE;
+	control->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (control->fd < 0)
+	{
+		GST_ERROR ("cannot create eventfd: %s (%i)", strerror(errno), errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void
+gst_dreamsource_control_clear (ControlChannel *control)
+{
+	if (control->fd >= 0)
+		close (control->fd);
+	control->fd = -1;
+}
+
+/* only while the read side doesn't watch the channel */
+void
+gst_dreamsource_control_reset (ControlChannel *control, gint word)
+{
+	eventfd_t count;
+	eventfd_read (control->fd, &count);
+	g_atomic_int_set (&control->word, word);
+}
+
+void
+gst_dreamsource_control_set_state (ControlChannel *control, GstDreamSourceReadthreadState state)
+{
+	gint old, word;
+
+	do {
+		old = g_atomic_int_get (&control->word);
+		if (CONTROL_STATE (old) == READTHREADSTATE_STOP)
+			return;
+		word = (old & ~CONTROL_STATE_MASK) | state;
+	} while (!g_atomic_int_compare_and_exchange (&control->word, old, word));
+
+	if (word != old)
+		eventfd_write (control->fd, 1);
+}
+
+void
+gst_dreamsource_control_set_flags (ControlChannel *control, gint flags)
+{
+	if (((gint) g_atomic_int_or (&control->word, flags) & flags) != flags)
+		eventfd_write (control->fd, 1);
+}
+
+void
+gst_dreamsource_control_clear_flags (ControlChannel *control, gint flags)
+{
+	g_atomic_int_and (&control->word, ~flags);
+}
+
+/* read side, acknowledges the wakeup and returns the word with the one-shot flags
+ * still set, changes after this will signal the eventfd again */
+gint
+gst_dreamsource_control_take (ControlChannel *control)
+{
+	eventfd_t count;
+	eventfd_read (control->fd, &count);
+	return g_atomic_int_and (&control->word, ~(CONTROL_WAKEUP | CONTROL_RELEASE));
+}
+
+/* the process wide reactor, its thread is started with the first watch and exits
+ * after the last one was removed */
+static struct
+{
+	GMutex lock;
+	GCond dispatched;       /* signalled after every callback */
+	GThread *thread;
+	int epoll_fd;
+	int wakeup_fd;
+	GList *watches;
+	GList *removed;         /* unreffed by the reactor thread once no event refers to them */
+} reactor;
+
+/* with the reactor lock held */
+static void
+gst_dreamsource_reactor_watch_unref (ReactorWatch *watch)
+{
+	if (--watch->refcount == 0)
+		g_free (watch);
+}
+
+static gint
+gst_dreamsource_reactor_timeout (gint64 now)
+{
+	gint64 deadline = 0;
+	GList *l;
+
+	for (l = reactor.watches; l; l = l->next)
+	{
+		ReactorWatch *watch = l->data;
+		if (watch->deadline && (!deadline || watch->deadline < deadline))
+			deadline = watch->deadline;
+	}
+	if (!deadline)
+		return -1;
+	if (deadline <= now)
+		return 0;
+	return (deadline - now + 999) / 1000;
+}
+
+/* called with the reactor lock held, which is dropped while the callback runs so
+ * that it may take locks the other threads hold while calling into the reactor */
+static void
+gst_dreamsource_reactor_dispatch (ReactorWatch *watch, guint32 events)
+{
+	watch->deadline = 0;
+	watch->refcount++;
+	watch->dispatching = TRUE;
+	g_mutex_unlock (&reactor.lock);
+	watch->func (watch->user_data, events);
+	g_mutex_lock (&reactor.lock);
+	watch->dispatching = FALSE;
+	g_cond_broadcast (&reactor.dispatched);
+	gst_dreamsource_reactor_watch_unref (watch);
+}
+
+static gpointer
+gst_dreamsource_reactor_thread_func (gpointer data)
+{
+	struct epoll_event events[16];
+	int i, n, timeout;
+	GList *l;
+
+	g_mutex_lock (&reactor.lock);
+	while (TRUE)
+	{
+		g_list_free_full (reactor.removed, (GDestroyNotify) gst_dreamsource_reactor_watch_unref);
+		reactor.removed = NULL;
+		if (!reactor.watches)
+			break;
+		timeout = gst_dreamsource_reactor_timeout (g_get_monotonic_time ());
+		g_mutex_unlock (&reactor.lock);
+
+		n = epoll_wait (reactor.epoll_fd, events, G_N_ELEMENTS (events), timeout);
+		if (n < 0 && errno != EINTR)
+		{
+			GST_ERROR ("reactor epoll error: %s (%i)", strerror(errno), errno);
+			g_usleep (G_USEC_PER_SEC / 10);
+		}
+
+		g_mutex_lock (&reactor.lock);
+		for (i = 0; i < n; i++)
+		{
+			ReactorWatch *watch = events[i].data.ptr;
+			if (!watch)
+			{
+				eventfd_t count;
+				eventfd_read (reactor.wakeup_fd, &count);
+				continue;
+			}
+			if (!watch->removed)
+				gst_dreamsource_reactor_dispatch (watch, events[i].events);
+		}
+
+		/* callbacks may remove other watches, so collect the expired ones first */
+		gint64 now = g_get_monotonic_time ();
+		GList *expired = NULL;
+		for (l = reactor.watches; l; l = l->next)
+		{
+			ReactorWatch *watch = l->data;
+			if (watch->deadline && watch->deadline <= now)
+			{
+				watch->refcount++;
+				expired = g_list_prepend (expired, watch);
+			}
+		}
+		for (l = expired; l; l = l->next)
+		{
+			ReactorWatch *watch = l->data;
+			if (!watch->removed && watch->deadline && watch->deadline <= now)
+				gst_dreamsource_reactor_dispatch (watch, 0);
+		}
+		g_list_free_full (expired, (GDestroyNotify) gst_dreamsource_reactor_watch_unref);
+	}
+
+	/* the next watch starts over with a new thread */
+	GST_DEBUG ("stopping idle reactor thread @%p", reactor.thread);
+	close (reactor.epoll_fd);
+	close (reactor.wakeup_fd);
+	reactor.epoll_fd = reactor.wakeup_fd = -1;
+	g_thread_unref (reactor.thread);
+	reactor.thread = NULL;
+	g_mutex_unlock (&reactor.lock);
+	return NULL;
+}
+
+/* called with the reactor lock held, lets the reactor thread recompute its timeout */
+static void
+gst_dreamsource_reactor_wakeup (void)
+{
+	if (g_thread_self () != reactor.thread)
+		eventfd_write (reactor.wakeup_fd, 1);
+}
+
+/* with the reactor lock held */
+static void
+gst_dreamsource_reactor_modify_locked (ReactorWatch *watch, guint32 events)
+{
+	struct epoll_event event = { .events = events, .data.ptr = watch };
+	int op;
+
+	if (watch->events == events)
+		return;
+	op = !watch->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	if (epoll_ctl (reactor.epoll_fd, op, watch->fd, &event) < 0)
+		GST_ERROR ("cannot watch fd %i: %s (%i)", watch->fd, strerror(errno), errno);
+	else
+		watch->events = events;
+}
+
+ReactorWatch *
+gst_dreamsource_reactor_add (int fd, guint32 events, ReactorFunc func, gpointer user_data)
+{
+	ReactorWatch *watch;
+
+	g_mutex_lock (&reactor.lock);
+	if (!reactor.thread)
+	{
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+		reactor.epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+		reactor.wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (reactor.epoll_fd < 0 || reactor.wakeup_fd < 0 || epoll_ctl (reactor.epoll_fd, EPOLL_CTL_ADD, reactor.wakeup_fd, &event) < 0 ||
+		    !(reactor.thread = g_thread_try_new ("dreamsrc-reactor", gst_dreamsource_reactor_thread_func, NULL, NULL)))
+		{
+			GST_ERROR ("cannot start reactor: %s (%i)", strerror(errno), errno);
+			if (reactor.epoll_fd >= 0)
+				close (reactor.epoll_fd);
+			if (reactor.wakeup_fd >= 0)
+				close (reactor.wakeup_fd);
+			reactor.epoll_fd = reactor.wakeup_fd = -1;
+			g_mutex_unlock (&reactor.lock);
+			return NULL;
+		}
+		GST_DEBUG ("started reactor thread @%p", reactor.thread);
+	}
+
+	watch = g_new0 (ReactorWatch, 1);
+	watch->refcount = 1;
+	watch->fd = fd;
+	watch->func = func;
+	watch->user_data = user_data;
+	reactor.watches = g_list_prepend (reactor.watches, watch);
+	gst_dreamsource_reactor_modify_locked (watch, events);
+	g_mutex_unlock (&reactor.lock);
+	return watch;
+}
+
+void
+gst_dreamsource_reactor_modify (ReactorWatch *watch, guint32 events)
+{
+	g_mutex_lock (&reactor.lock);
+	gst_dreamsource_reactor_modify_locked (watch, events);
+	g_mutex_unlock (&reactor.lock);
+}
+
+/* timeout in ms from now, negative to disable it */
+void
+gst_dreamsource_reactor_set_timeout (ReactorWatch *watch, gint timeout)
+{
+	g_mutex_lock (&reactor.lock);
+	watch->deadline = timeout < 0 ? 0 : g_get_monotonic_time () + (gint64) timeout * 1000;
+	if (timeout >= 0)
+		gst_dreamsource_reactor_wakeup ();
+	g_mutex_unlock (&reactor.lock);
+}
+
+void
+gst_dreamsource_reactor_remove (ReactorWatch *watch)
+{
+	if (!watch)
+		return;
+	g_mutex_lock (&reactor.lock);
+	gst_dreamsource_reactor_modify_locked (watch, 0);
+	watch->removed = TRUE;
+	reactor.watches = g_list_remove (reactor.watches, watch);
+	reactor.removed = g_list_prepend (reactor.removed, watch);
+	gst_dreamsource_reactor_wakeup ();
+	/* its user data must not be used after this, unless we're the callback itself */
+	while (watch->dispatching && g_thread_self () != reactor.thread)
+		g_cond_wait (&reactor.dispatched, &reactor.lock);
+	g_mutex_unlock (&reactor.lock);
+}
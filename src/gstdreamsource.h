@@ -34,32 +34,21 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <time.h>
 
 #include "gstdreamsource-marshal.h"
 
-#define CONTROL_RUN            'R'     /* start producing frames */
-#define CONTROL_PAUSE          'P'     /* pause producing frames */
-#define CONTROL_STOP           'S'     /* stop the select call */
-#define CONTROL_SOCKETS(src)   src->control_sock
-#define WRITE_SOCKET(src)      src->control_sock[1]
-#define READ_SOCKET(src)       src->control_sock[0]
-
-#define CLEAR_COMMAND(src)                  \
-G_STMT_START {                              \
-  char c;                                   \
-  read(READ_SOCKET(src), &c, 1);            \
-} G_STMT_END
-
-#define SEND_COMMAND(src, command)          \
-G_STMT_START {                              \
-  int G_GNUC_UNUSED _res; unsigned char c; c = command;   \
-  _res = write (WRITE_SOCKET(src), &c, 1);  \
-} G_STMT_END
-
-#define READ_COMMAND(src, command, res)        \
-G_STMT_START {                                 \
-  res = read(READ_SOCKET(src), &command, 1);   \
-} G_STMT_END
+#define CONTROL_STATE_MASK     0x0F    /* the requested GstDreamSourceReadthreadState */
+#define CONTROL_FLUSHING       0x10    /* unlocked, don't produce or wait for frames */
+#define CONTROL_WAKEUP         0x20    /* buffers were freed downstream, cleared when taken */
+#define CONTROL_RELEASE        0x40    /* pausing, return the descriptors to the encoder, cleared when taken */
+#define CONTROL_STATE(word)    ((GstDreamSourceReadthreadState) ((word) & CONTROL_STATE_MASK))
+
+#define ENCODER_TIMEOUT        200     /* ms without descriptors before the read side times out */
+#define STALLED_TIMEOUT        20      /* ms to wait for downstream to free buffers */
 
 typedef enum
 {
@@ -73,9 +62,62 @@ G_BEGIN_DECLS
 
 typedef struct _CompressedBufferDescriptor CompressedBufferDescriptor;
 typedef struct _EncoderInfo                EncoderInfo;
+typedef struct _MemoryTracker              MemoryTracker;
+typedef struct _MemoryTrackerEntry         MemoryTrackerEntry;
+typedef struct _FrameRing                  FrameRing;
+typedef struct _FrameRingSlot              FrameRingSlot;
+typedef struct _TimestampUnwrapper         TimestampUnwrapper;
+typedef struct _ClockCalibration           ClockCalibration;
+typedef struct _ReactorWatch               ReactorWatch;
+typedef struct _ControlChannel             ControlChannel;
+
+typedef void (*MemoryTrackerNotify) (gpointer user_data);
+typedef void (*ReactorFunc) (gpointer user_data, guint32 events);
+
+#define ENCTIME_TO_GSTTIME(time)           (gst_dreamsource_enctime_to_gsttime (time))
+#define MPEGTIME_TO_GSTTIME(time)          (gst_dreamsource_mpegtime_to_gsttime (time))
+
+/* high 64 bits of a 64x64 bit product */
+static inline guint64
+gst_dreamsource_umulh (guint64 a, guint64 b)
+{
+#ifdef __SIZEOF_INT128__
+	return (guint64) (((unsigned __int128) a * b) >> 64);
+#else
+	guint64 a_lo = (guint32) a, a_hi = a >> 32;
+	guint64 b_lo = (guint32) b, b_hi = b >> 32;
+	guint64 lo_lo = a_lo * b_lo;
+	guint64 hi_lo = a_hi * b_lo;
+	guint64 lo_hi = a_lo * b_hi;
+	guint64 cross = (lo_lo >> 32) + (guint32) hi_lo + lo_hi;
+	return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+/*
+ * Exact floor (ticks * 1000 / 27) and floor (ticks * 100000 / 9) without a
+ * 64 bit division: 1000 = 27 * 37 + 1 and 100000 = 9 * 11111 + 1, so only
+ * ticks / 27 and ticks / 9 remain, which are done by multiplying with the
+ * rounded up reciprocals 2^68/27 and 2^67/9. Both are exact for any 64 bit
+ * input and only overflow where the result exceeds 2^64 ns anyway.
+ */
+static inline GstClockTime
+gst_dreamsource_enctime_to_gsttime (guint64 ticks)
+{
+	return ticks * 37 + (gst_dreamsource_umulh (ticks, G_GUINT64_CONSTANT (0x97B425ED097B425F)) >> 4);
+}
+
+static inline GstClockTime
+gst_dreamsource_mpegtime_to_gsttime (guint64 ticks)
+{
+	return ticks * 11111 + (gst_dreamsource_umulh (ticks, G_GUINT64_CONSTANT (0xE38E38E38E38E38F)) >> 3);
+}
 
-#define ENCTIME_TO_GSTTIME(time)           (gst_util_uint64_scale ((time), GST_USECOND, 27LL))
-#define MPEGTIME_TO_GSTTIME(time)          (gst_util_uint64_scale ((time), GST_MSECOND/10, 9LL))
+/* widths of the free running encoder counters */
+#define STC_BITS                           32  /* ENC_GET_STC, 27 MHz */
+#define MPEGTIME_BITS                      33  /* uiPTS, uiDTS, 90 kHz */
+#define STCSNAPSHOT_BITS                   42  /* uiSTCSnapshot, 27 MHz */
+#define COUNTER_MASK(bits)                 ((G_GUINT64_CONSTANT (1) << (bits)) - 1)
 
 /* validity flags */
 #define CDB_FLAG_ORIGINALPTS_VALID         0x00000001
@@ -125,10 +167,195 @@ struct _EncoderInfo {
 	/* mmapp'ed data buffer */
 	unsigned char *cdb;
 
-	guint         used_range_min;
-	guint         used_range_max;
+	/* cdb ranges still referenced by downstream buffers */
+	MemoryTracker *memtracker;
+};
+
+/*
+ * The memory tracker keeps one slot per descriptor that was wrapped into a
+ * GstBuffer, in the order the encoder handed them out. Since the cdb is a ring
+ * and buffers are freed roughly in order, the oldest slot still in use bounds
+ * the number of descriptors that may be returned to the driver. Descriptors
+ * which were dropped without a buffer don't take a slot, they are counted in
+ * the 'skipped' field of the preceding slot instead.
+ */
+struct _MemoryTrackerEntry
+{
+	MemoryTracker *tracker;
+	guint uiOffset;
+	guint uiLength;
+	guint skipped;
+	gboolean in_use;
+};
+
+struct _MemoryTracker
+{
+	volatile gint refcount;
+	GMutex mutex;
+
+	MemoryTrackerEntry *entries;
+	guint capacity;         /* power of two */
+	guint head, tail;       /* oldest and next free slot, wrap with capacity */
+
+	guint releasable;       /* descriptors which may be returned to the driver */
+	guint outstanding;      /* descriptors not yet returned to the driver */
+	guint detached;         /* slots which were already returned by a detach */
+
+	guint last_offset;      /* most recently tracked descriptor */
+	guint last_length;
+
+	MemoryTrackerNotify notify;
+	gpointer user_data;
+};
+
+MemoryTracker *gst_dreamsource_memtracker_new (guint capacity);
+MemoryTracker *gst_dreamsource_memtracker_ref (MemoryTracker *tracker);
+void gst_dreamsource_memtracker_unref (MemoryTracker *tracker);
+void gst_dreamsource_memtracker_set_notify (MemoryTracker *tracker, MemoryTrackerNotify notify, gpointer user_data);
+gboolean gst_dreamsource_memtracker_is_full (MemoryTracker *tracker);
+MemoryTrackerEntry *gst_dreamsource_memtracker_push (MemoryTracker *tracker, guint offset, guint length);
+void gst_dreamsource_memtracker_skip (MemoryTracker *tracker, guint offset, guint length);
+void gst_dreamsource_memtracker_release (MemoryTrackerEntry *entry);
+guint gst_dreamsource_memtracker_pop_released (MemoryTracker *tracker);
+guint gst_dreamsource_memtracker_detach (MemoryTracker *tracker);
+guint gst_dreamsource_memtracker_find_unseen (MemoryTracker *tracker, const unsigned char *descriptors, guint count, gsize stride);
+
+/*
+ * Extends a free running counter to 64 bits. Every value is taken as the
+ * step from the previous one which is shorter than half the counter range,
+ * so small backward steps (e.g. PTS reordering) don't count as a wrap.
+ */
+struct _TimestampUnwrapper
+{
+	guint64 mask;
+	guint64 last;           /* last extended value */
+	gboolean valid;
+};
+
+void gst_dreamsource_unwrapper_init (TimestampUnwrapper *unwrapper, guint bits);
+void gst_dreamsource_unwrapper_reset (TimestampUnwrapper *unwrapper);
+guint64 gst_dreamsource_unwrapper_unwrap (TimestampUnwrapper *unwrapper, guint64 value);
+guint64 gst_dreamsource_unwrap_near (guint64 mask, guint64 value, guint64 reference);
+
+/*
+ * Clock calibration as used to convert encoder times to pipeline clock times,
+ * with the rate kept as a Q32 fixed-point factor which is only recomputed
+ * when the calibration rate changes. Scaling is off by less than 1ns for
+ * every 4s of distance from the calibration point.
+ */
+struct _ClockCalibration
+{
+	GstClockTime internal;
+	GstClockTime external;
+	GstClockTime rate_num;
+	GstClockTime rate_denom;
+	guint64 rate;           /* rate_num / rate_denom in Q32 */
+};
+
+void gst_dreamsource_calibration_update (ClockCalibration *calibration, GstClock *clock);
+
+static inline GstClockTime
+gst_dreamsource_calibration_scale (const ClockCalibration *calibration, GstClockTime value)
+{
+	guint64 hi;
+
+	if (calibration->rate_num == calibration->rate_denom)
+		return value;
+	hi = gst_dreamsource_umulh (value, calibration->rate);
+	if (G_UNLIKELY (hi >> 32))
+		return G_MAXUINT64;
+	return (hi << 32) | ((value * calibration->rate) >> 32);
+}
+
+/*
+ * Control channel between the state changes and an element's read side. The
+ * requested state and the flags live in one atomic word which the read side
+ * checks without a syscall, the eventfd only wakes up whoever waits in epoll
+ * for a change. A stopped channel stays stopped until it is reset.
+ */
+struct _ControlChannel
+{
+	volatile gint word;
+	int fd;
+};
+
+gboolean gst_dreamsource_control_init (ControlChannel *control);
+void gst_dreamsource_control_clear (ControlChannel *control);
+void gst_dreamsource_control_reset (ControlChannel *control, gint word);
+void gst_dreamsource_control_set_state (ControlChannel *control, GstDreamSourceReadthreadState state);
+void gst_dreamsource_control_set_flags (ControlChannel *control, gint flags);
+void gst_dreamsource_control_clear_flags (ControlChannel *control, gint flags);
+gint gst_dreamsource_control_take (ControlChannel *control);
+
+static inline gint
+gst_dreamsource_control_get (ControlChannel *control)
+{
+	return g_atomic_int_get (&control->word);
+}
+
+/*
+ * Bounded single-producer/single-consumer queue handing frames from the read
+ * thread to create(). Only the read thread pushes and only the streaming
+ * thread pops, so neither side takes a lock. The consumer blocks on an eventfd
+ * which the producer only signals while the consumer is waiting.
+ */
+struct _FrameRingSlot
+{
+	gpointer frame;
+	guint size;
+	GstClockTime timestamp;
+};
+
+struct _FrameRing
+{
+	FrameRingSlot *slots;
+	guint capacity;         /* power of two */
+	volatile gint head;     /* written by the consumer only */
+	volatile gint tail;     /* written by the producer only */
+	volatile gint bytes_in; /* written by the producer only */
+	volatile gint bytes_out;/* written by the consumer only */
+	volatile gint waiting;
+	int wakeup_fd;
+};
+
+FrameRing *gst_dreamsource_frame_ring_new (guint size);
+void gst_dreamsource_frame_ring_free (FrameRing *ring, GDestroyNotify free_func);
+guint gst_dreamsource_frame_ring_length (FrameRing *ring);
+guint gst_dreamsource_frame_ring_bytes (FrameRing *ring);
+GstClockTime gst_dreamsource_frame_ring_duration (FrameRing *ring);
+gboolean gst_dreamsource_frame_ring_push (FrameRing *ring, gpointer frame, guint size, GstClockTime timestamp);
+gpointer gst_dreamsource_frame_ring_pop (FrameRing *ring);
+gpointer gst_dreamsource_frame_ring_wait (FrameRing *ring, ControlChannel *control);
+void gst_dreamsource_frame_ring_wakeup (FrameRing *ring);
+void gst_dreamsource_frame_ring_clear (FrameRing *ring, GDestroyNotify free_func);
+
+/*
+ * A single epoll thread per process serves the control and encoder fds of all
+ * elements, so idle or paused elements cost neither a thread nor wakeups.
+ * Callbacks run on the reactor thread, one at a time and without the reactor
+ * lock held, and must not block; they get the ready epoll events, or 0 once
+ * the watch's timeout expired. Timeouts are one-shot and cleared by every
+ * dispatch of their watch. A watch with no events isn't registered with epoll
+ * at all. Removing a watch waits for a running callback and may also be done
+ * from inside one. The thread exits with the last watch removed.
+ */
+struct _ReactorWatch
+{
+	int fd;
+	guint32 events;
+	gint64 deadline;        /* monotonic time of the timeout, 0 for none */
+	gboolean removed;
+	gboolean dispatching;   /* the callback is running */
+	gint refcount;          /* the owner's and one per running dispatch, under the reactor lock */
+	ReactorFunc func;
+	gpointer user_data;
 };
 
+ReactorWatch *gst_dreamsource_reactor_add (int fd, guint32 events, ReactorFunc func, gpointer user_data);
+void gst_dreamsource_reactor_modify (ReactorWatch *watch, guint32 events);
+void gst_dreamsource_reactor_set_timeout (ReactorWatch *watch, gint timeout);
+void gst_dreamsource_reactor_remove (ReactorWatch *watch);
+
 #define ENC_GET_STC      _IOR('v', 141, uint32_t)
 
 #define GST_TYPE_DREAMSOURCE_CLOCK \
@@ -151,10 +378,24 @@ struct _GstDreamSourceClock
 {
 	GstSystemClock clock;
 
-	uint32_t prev_stc;
-	uint32_t first_stc;
-	uint64_t stc_offset;
+	TimestampUnwrapper stc_unwrapper;
+	uint64_t first_stc;
 	int fd;
+
+	/* interpolation between STC samples, 0 queries the STC on every call */
+	GstClockTime sample_interval;
+
+	/* extrapolation parameters, published to readers through a seqlock */
+	volatile gint seqnum;
+	gint64 base_mono;           /* CLOCK_MONOTONIC when base_time was valid */
+	GstClockTime base_time;
+	gdouble rate;               /* applied rate, slewed towards the samples */
+
+	/* only touched by the sampling thread with the object lock held */
+	gboolean sampled;
+	gint64 last_sample_mono;
+	GstClockTime last_sample;
+	gdouble fitted_rate;        /* smoothed measured STC rate */
 };
 
 struct _GstDreamSourceClockClass
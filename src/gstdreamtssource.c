@@ -23,12 +23,19 @@
 #include <gst/gst.h>
 #include "gstdreamtssource.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 GST_DEBUG_CATEGORY_STATIC (dreamtssource_debug);
 #define GST_CAT_DEFAULT dreamtssource_debug
 
 enum
 {
 	SIGNAL_GET_BASE_PTS,
+	SIGNAL_REPLAY_GOP_CACHE,
 	LAST_SIGNAL
 };
 
@@ -36,6 +43,21 @@ enum
 {
 	ARG_0,
 	ARG_SREF,
+	ARG_CHUNK_SIZE,
+	ARG_BATCH_BYTES,
+	ARG_BATCH_LATENCY,
+	ARG_PCR_PID,
+	ARG_HOST,
+	ARG_PORT,
+	ARG_PATH,
+	ARG_RECONNECT,
+	ARG_REWRITE_PSI,
+	ARG_GOP_CACHE_TIME,
+	ARG_DEMUX_BUFFER_SIZE,
+	ARG_MAX_DEMUX_BUFFER_SIZE,
+	ARG_DEMUX_DEVICE,
+	ARG_STATS_INTERVAL,
+	ARG_STATS,
 };
 
 #define safe_write write
@@ -57,6 +79,8 @@ G_DEFINE_TYPE (GstDreamTsSource, gst_dreamtssource, GST_TYPE_PUSH_SRC);
 static gboolean gst_dreamtssource_start (GstBaseSrc * bsrc);
 static gboolean gst_dreamtssource_stop (GstBaseSrc * bsrc);
 static gboolean gst_dreamtssource_unlock (GstBaseSrc * bsrc);
+static gboolean gst_dreamtssource_unlock_stop (GstBaseSrc * bsrc);
+static gboolean gst_dreamtssource_event (GstBaseSrc * bsrc, GstEvent * event);
 static void gst_dreamtssource_dispose (GObject * gobject);
 static GstFlowReturn gst_dreamtssource_create (GstPushSrc * psrc, GstBuffer ** outbuf);
 
@@ -65,10 +89,11 @@ static void gst_dreamtssource_get_property (GObject * object, guint prop_id, GVa
 
 static GstStateChangeReturn gst_dreamtssource_change_state (GstElement * element, GstStateChange transition);
 static gint64 gst_dreamtssource_get_base_pts (GstDreamTsSource *self);
+static void gst_dreamtssource_replay_gop_cache (GstDreamTsSource *self);
 static void gst_dreamtssource_set_sref (GstDreamTsSource *self, const gchar * sref);
 
-static int handle_upstream(GstDreamTsSource * self);
-static int handle_upstream_line(GstDreamTsSource * self);
+static int handle_upstream(GstDreamTsSource * self, TsService * service);
+static int handle_upstream_line(GstDreamTsSource * self, TsService * service);
 
 static void
 gst_dreamtssource_class_init (GstDreamTsSourceClass * klass)
@@ -100,13 +125,98 @@ gst_dreamtssource_class_init (GstDreamTsSourceClass * klass)
 	gstbsrc_class->start = gst_dreamtssource_start;
 	gstbsrc_class->stop = gst_dreamtssource_stop;
 	gstbsrc_class->unlock = gst_dreamtssource_unlock;
+	gstbsrc_class->unlock_stop = gst_dreamtssource_unlock_stop;
+	gstbsrc_class->event = gst_dreamtssource_event;
 	
 	gstpush_src_class->create = gst_dreamtssource_create;
 	
 	g_object_class_install_property (gobject_class, ARG_SREF,
 		g_param_spec_string ("sref", "serviceref",
-		"Enigma2 Service Reference", NULL,
+		"Enigma2 Service Reference (several separated by ';' stream as one multi-program TS)", NULL,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_CHUNK_SIZE,
+		g_param_spec_uint ("chunk-size", "Chunk size",
+		"Size of the pooled buffers read from the demux (rounded down to whole TS packets)",
+		TS_PACKET_SIZE, MAX_CHUNK_SIZE, DEFAULT_CHUNK_SIZE,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_BATCH_BYTES,
+		g_param_spec_uint ("batch-bytes", "Batch size (bytes)",
+		"Drain up to this many bytes from the demux per wakeup and push them as a buffer list (0=one chunk per wakeup)",
+		0, G_MAXUINT, DEFAULT_BATCH_BYTES,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_BATCH_LATENCY,
+		g_param_spec_uint64 ("batch-latency", "Batch latency (ns)",
+		"Stop draining the demux after this much time per wakeup (0=unlimited)",
+		0, G_MAXUINT64, DEFAULT_BATCH_LATENCY,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_PCR_PID,
+		g_param_spec_int ("pcr-pid", "PCR PID",
+		"PID carrying the program clock reference used to timestamp buffers (-1=first PID with a PCR), only buffers of the first service in sref are timestamped",
+		-1, TS_MAX_PID, DEFAULT_PCR_PID,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_HOST,
+		g_param_spec_string ("host", "Host",
+		"Host of the enigma2 streaming server", DEFAULT_HOST,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_PORT,
+		g_param_spec_uint ("port", "Port",
+		"Port of the enigma2 streaming server", 1, G_MAXUINT16, DEFAULT_PORT,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_PATH,
+		g_param_spec_string ("path", "Path",
+		"Request path of the enigma2 streaming server", DEFAULT_PATH,
 		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_RECONNECT,
+		g_param_spec_boolean ("reconnect", "Reconnect",
+		"Reconnect with exponential backoff when an established upstream drops", DEFAULT_RECONNECT,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_REWRITE_PSI,
+		g_param_spec_boolean ("rewrite-psi", "Rewrite PSI",
+		"Reduce PAT and PMT to the streamed programs and filtered elementary streams (only PMTs fitting into one packet are cached, rewritten and injected after a discontinuity)", DEFAULT_REWRITE_PSI,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_GOP_CACHE_TIME,
+		g_param_spec_uint64 ("gop-cache-time", "GOP cache time (ns)",
+		"Keep the stream since the last video random access point for up to this long and replay it after a flush or on the replay-gop-cache action signal (0=disabled)",
+		0, G_MAXUINT64, DEFAULT_GOP_CACHE_TIME,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_DEMUX_BUFFER_SIZE,
+		g_param_spec_uint ("demux-buffer-size", "Demux buffer size",
+		"Initial size of the kernel demux buffer of each service in bytes",
+		MIN_DEMUX_BUFFER_SIZE, MAX_DEMUX_BUFFER_SIZE, DEFAULT_DEMUX_BUFFER_SIZE,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_MAX_DEMUX_BUFFER_SIZE,
+		g_param_spec_uint ("max-demux-buffer-size", "Maximum demux buffer size",
+		"Size up to which the demux buffer is doubled on every overflow (at most demux-buffer-size disables growing)",
+		MIN_DEMUX_BUFFER_SIZE, MAX_DEMUX_BUFFER_SIZE, DEFAULT_MAX_DEMUX_BUFFER_SIZE,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_DEMUX_DEVICE,
+		g_param_spec_string ("demux-device", "Demux device",
+		"Demux device node, the demux number announced by the server is appended", DEFAULT_DEMUX_DEVICE,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_STATS_INTERVAL,
+		g_param_spec_uint64 ("stats-interval", "Statistics interval (ns)",
+		"Post the statistics as element message this often, also the window of the per-PID rates (0=no messages, 1 second rate window)",
+		0, G_MAXUINT64, DEFAULT_STATS_INTERVAL,
+		G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_STATS,
+		g_param_spec_boxed ("stats", "Statistics",
+		"Transport stream, per-PID rate and demux statistics", GST_TYPE_STRUCTURE,
+		G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
   
 	gst_dreamtssource_signals[SIGNAL_GET_BASE_PTS] =
 	g_signal_new ("get-base-pts",
@@ -114,15 +224,35 @@ gst_dreamtssource_class_init (GstDreamTsSourceClass * klass)
 		      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
 	       G_STRUCT_OFFSET (GstDreamTsSourceClass, get_base_pts),
 		      NULL, NULL, gst_dreamsource_marshal_INT64__VOID, G_TYPE_INT64, 0);
+
+	gst_dreamtssource_signals[SIGNAL_REPLAY_GOP_CACHE] =
+	g_signal_new ("replay-gop-cache",
+		      G_TYPE_FROM_CLASS (klass),
+		      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+	       G_STRUCT_OFFSET (GstDreamTsSourceClass, replay_gop_cache),
+		      NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
 	
 	klass->get_base_pts = gst_dreamtssource_get_base_pts;
+	klass->replay_gop_cache = gst_dreamtssource_replay_gop_cache;
 }
 
 static gint64
 gst_dreamtssource_get_base_pts (GstDreamTsSource *self)
 {
-	GST_DEBUG_OBJECT (self, "gst_dreamtssource_get_base_pts %" GST_TIME_FORMAT"", GST_TIME_ARGS (self->base_pts) );
-	return self->base_pts;
+	GstClockTime base_pts;
+	GST_OBJECT_LOCK (self);
+	base_pts = self->base_pts;
+	GST_OBJECT_UNLOCK (self);
+	GST_DEBUG_OBJECT (self, "gst_dreamtssource_get_base_pts %" GST_TIME_FORMAT"", GST_TIME_ARGS (base_pts) );
+	return base_pts;
+}
+
+/* for a newly linked downstream, which doesn't see a flush */
+static void
+gst_dreamtssource_replay_gop_cache (GstDreamTsSource *self)
+{
+	GST_DEBUG_OBJECT (self, "replay GOP cache requested");
+	g_atomic_int_set (&self->gop_replay_pending, TRUE);
 }
 
 gboolean
@@ -137,15 +267,44 @@ gst_dreamtssource_init (GstDreamTsSource * self)
 {
 	g_mutex_init (&self->mutex);
 	
-	self->reason = "";
-	self->demux_fd = -1;
+	self->services = NULL;
+	self->n_services = 0;
+	self->epoll_fd = -1;
+	self->control.word = READTHREADSTATE_NONE;
+	self->control.fd = -1;
+	self->host = g_strdup (DEFAULT_HOST);
+	self->port = DEFAULT_PORT;
+	self->path = g_strdup (DEFAULT_PATH);
+	self->demux_device = g_strdup (DEFAULT_DEMUX_DEVICE);
+	self->reconnect = DEFAULT_RECONNECT;
+	self->connectthread = NULL;
+	self->rewrite_psi = DEFAULT_REWRITE_PSI;
+	self->gop_cache_time = DEFAULT_GOP_CACHE_TIME;
+	g_queue_init (&self->gop_cache);
+	self->gop_cache_bytes = 0;
+	self->gop_replay = NULL;
+	self->gop_replay_pts = GST_CLOCK_TIME_NONE;
+	self->gop_replay_pending = FALSE;
+	self->pid_stats = NULL;
+	self->demux_buffer_size = DEFAULT_DEMUX_BUFFER_SIZE;
+	self->max_demux_buffer_size = DEFAULT_MAX_DEMUX_BUFFER_SIZE;
+	self->stats_interval = DEFAULT_STATS_INTERVAL;
+	self->chunk_size = DEFAULT_CHUNK_SIZE;
+	self->batch_bytes = DEFAULT_BATCH_BYTES;
+	self->batch_latency = DEFAULT_BATCH_LATENCY;
+	self->pcr_pid = DEFAULT_PCR_PID;
+	self->base_pts = GST_CLOCK_TIME_NONE;
+	gst_dreamsource_unwrapper_init (&self->pcr_unwrapper, MPEGTIME_BITS);
+	self->pool = NULL;
 	
 	gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
 	gst_base_src_set_live (GST_BASE_SRC (self), TRUE);
+	gst_base_src_set_async (GST_BASE_SRC (self), TRUE);
 }
 
 static void gst_dreamtssource_set_sref (GstDreamTsSource *self, const gchar * sref)
 {
+	g_free (self->service_ref);
 	self->service_ref = g_strdup(sref);
 	GST_INFO_OBJECT (self, "service reference set: %s", sref);
 }
@@ -159,12 +318,202 @@ gst_dreamtssource_set_property (GObject * object, guint prop_id, const GValue *
 		case ARG_SREF:
 			gst_dreamtssource_set_sref(self, g_value_get_string (value));
 			break;
+		case ARG_CHUNK_SIZE:
+			GST_OBJECT_LOCK (self);
+			self->chunk_size = g_value_get_uint (value) / TS_PACKET_SIZE * TS_PACKET_SIZE;
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_BATCH_BYTES:
+			GST_OBJECT_LOCK (self);
+			self->batch_bytes = g_value_get_uint (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_BATCH_LATENCY:
+			GST_OBJECT_LOCK (self);
+			self->batch_latency = g_value_get_uint64 (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_PCR_PID:
+			GST_OBJECT_LOCK (self);
+			self->pcr_pid = g_value_get_int (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_HOST:
+			GST_OBJECT_LOCK (self);
+			g_free (self->host);
+			self->host = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_PORT:
+			GST_OBJECT_LOCK (self);
+			self->port = g_value_get_uint (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_PATH:
+			GST_OBJECT_LOCK (self);
+			g_free (self->path);
+			self->path = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_DEMUX_DEVICE:
+			GST_OBJECT_LOCK (self);
+			g_free (self->demux_device);
+			self->demux_device = g_value_dup_string (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_RECONNECT:
+			GST_OBJECT_LOCK (self);
+			self->reconnect = g_value_get_boolean (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_REWRITE_PSI:
+			GST_OBJECT_LOCK (self);
+			self->rewrite_psi = g_value_get_boolean (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_GOP_CACHE_TIME:
+			GST_OBJECT_LOCK (self);
+			self->gop_cache_time = g_value_get_uint64 (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_DEMUX_BUFFER_SIZE:
+			GST_OBJECT_LOCK (self);
+			self->demux_buffer_size = g_value_get_uint (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_MAX_DEMUX_BUFFER_SIZE:
+			GST_OBJECT_LOCK (self);
+			self->max_demux_buffer_size = g_value_get_uint (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_STATS_INTERVAL:
+			GST_OBJECT_LOCK (self);
+			self->stats_interval = g_value_get_uint64 (value);
+			GST_OBJECT_UNLOCK (self);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
 	}
 }
 
+/* the per-PID packet counters are bumped by the streaming thread without the lock,
+ * a reader may see them a packet behind which is fine for statistics */
+static GstStructure *
+gst_dreamtssource_get_stats (GstDreamTsSource * self)
+{
+	GstStructure *s;
+	GValue pids = G_VALUE_INIT;
+	int pid;
+
+	g_value_init (&pids, GST_TYPE_ARRAY);
+	GST_OBJECT_LOCK (self);
+	s = gst_structure_new ("dreamtssource-stats",
+		"packets", G_TYPE_UINT64, self->stats.packets,
+		"sync-errors", G_TYPE_UINT64, self->stats.sync_errors,
+		"cc-errors", G_TYPE_UINT64, self->stats.cc_errors,
+		"tei-errors", G_TYPE_UINT64, self->stats.tei_errors,
+		"overflows", G_TYPE_UINT64, self->stats.overflows,
+		"wakeups", G_TYPE_UINT64, self->stats.wakeups,
+		"reads", G_TYPE_UINT64, self->stats.reads,
+		"read-bytes", G_TYPE_UINT64, self->stats.read_bytes,
+		"average-read-size", G_TYPE_UINT64, self->stats.reads ? self->stats.read_bytes / self->stats.reads : 0,
+		"demux-buffer-size", G_TYPE_UINT, self->stats.demux_buffer_size,
+		NULL);
+	for (pid = 0; self->pid_stats && pid <= TS_MAX_PID; pid++)
+	{
+		TsPidStats *p = &self->pid_stats[pid];
+		GValue v = G_VALUE_INIT;
+		if (!p->packets)
+			continue;
+		g_value_init (&v, GST_TYPE_STRUCTURE);
+		g_value_take_boxed (&v, gst_structure_new ("pid-stats",
+			"pid", G_TYPE_INT, pid,
+			"packets", G_TYPE_UINT64, p->packets,
+			"bytes", G_TYPE_UINT64, p->packets * TS_PACKET_SIZE,
+			"packet-rate", G_TYPE_UINT, p->packet_rate,
+			"byte-rate", G_TYPE_UINT64, (guint64) p->packet_rate * TS_PACKET_SIZE,
+			NULL));
+		gst_value_array_append_and_take_value (&pids, &v);
+	}
+	GST_OBJECT_UNLOCK (self);
+	gst_structure_take_value (s, "pids", &pids);
+	return s;
+}
+
+/* counts a wakeup of the streaming thread and, once per rate window, refreshes the
+ * per-PID rates and posts the statistics if an interval is set */
+static void
+gst_dreamtssource_update_stats (GstDreamTsSource * self, GstClockTime interval)
+{
+	gint64 now = g_get_monotonic_time ();
+	gint64 elapsed = now - self->rate_window_start;
+	int pid;
+
+	GST_OBJECT_LOCK (self);
+	self->stats.wakeups++;
+	if (elapsed < (gint64) ((interval ? interval : STATS_RATE_WINDOW) / GST_USECOND))
+	{
+		GST_OBJECT_UNLOCK (self);
+		return;
+	}
+	for (pid = 0; pid <= TS_MAX_PID; pid++)
+	{
+		TsPidStats *p = &self->pid_stats[pid];
+		if (p->packets == p->window_packets && !p->packet_rate)
+			continue;
+		p->packet_rate = (p->packets - p->window_packets) * G_USEC_PER_SEC / elapsed;
+		p->window_packets = p->packets;
+	}
+	GST_OBJECT_UNLOCK (self);
+	self->rate_window_start = now;
+
+	if (interval)
+		gst_element_post_message (GST_ELEMENT (self), gst_message_new_element (GST_OBJECT (self), gst_dreamtssource_get_stats (self)));
+}
+
+static void
+gst_dreamtssource_count_read (GstDreamTsSource * self, gssize r)
+{
+	GST_OBJECT_LOCK (self);
+	self->stats.reads++;
+	self->stats.read_bytes += r;
+	GST_OBJECT_UNLOCK (self);
+}
+
+/* the demux dropped data because its buffer ran full - count it and double the buffer
+ * up to the configured maximum so a bursty service settles at the size it needs */
+static void
+gst_dreamtssource_demux_overflow (GstDreamTsSource * self, TsService * service)
+{
+	guint size;
+
+	GST_OBJECT_LOCK (self);
+	self->stats.overflows++;
+	size = MIN ((guint64) service->demux_buffer_size * 2, self->max_demux_buffer_size);
+	GST_OBJECT_UNLOCK (self);
+
+	service->discont = TRUE;
+	service->partial_len = 0;
+	if (size <= service->demux_buffer_size)
+	{
+		GST_WARNING_OBJECT (self, "service %u demux overflow with %u byte buffer", service->index, service->demux_buffer_size);
+		return;
+	}
+
+	/* the kernel only resizes a stopped filter */
+	ioctl(service->demux_fd, DMX_STOP);
+	if (ioctl(service->demux_fd, DMX_SET_BUFFER_SIZE, size) == 0)
+		service->demux_buffer_size = size;
+	if (ioctl(service->demux_fd, DMX_START) < 0)
+		GST_ERROR_OBJECT (self, "service %u can't restart demux: %s", service->index, g_strerror (errno));
+	GST_INFO_OBJECT (self, "service %u demux overflow, buffer now %u bytes", service->index, service->demux_buffer_size);
+
+	GST_OBJECT_LOCK (self);
+	self->stats.demux_buffer_size = MAX (self->stats.demux_buffer_size, service->demux_buffer_size);
+	GST_OBJECT_UNLOCK (self);
+}
+
 static void
 gst_dreamtssource_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
 {
@@ -174,6 +523,79 @@ gst_dreamtssource_get_property (GObject * object, guint prop_id, GValue * value,
 		case ARG_SREF:
 			g_value_set_string (value, self->service_ref);
 			break;
+		case ARG_CHUNK_SIZE:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint (value, self->chunk_size);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_BATCH_BYTES:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint (value, self->batch_bytes);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_BATCH_LATENCY:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint64 (value, self->batch_latency);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_PCR_PID:
+			GST_OBJECT_LOCK (self);
+			g_value_set_int (value, self->pcr_pid);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_HOST:
+			GST_OBJECT_LOCK (self);
+			g_value_set_string (value, self->host);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_PORT:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint (value, self->port);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_PATH:
+			GST_OBJECT_LOCK (self);
+			g_value_set_string (value, self->path);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_DEMUX_DEVICE:
+			GST_OBJECT_LOCK (self);
+			g_value_set_string (value, self->demux_device);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_RECONNECT:
+			GST_OBJECT_LOCK (self);
+			g_value_set_boolean (value, self->reconnect);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_REWRITE_PSI:
+			GST_OBJECT_LOCK (self);
+			g_value_set_boolean (value, self->rewrite_psi);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_GOP_CACHE_TIME:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint64 (value, self->gop_cache_time);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_DEMUX_BUFFER_SIZE:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint (value, self->demux_buffer_size);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_MAX_DEMUX_BUFFER_SIZE:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint (value, self->max_demux_buffer_size);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_STATS_INTERVAL:
+			GST_OBJECT_LOCK (self);
+			g_value_set_uint64 (value, self->stats_interval);
+			GST_OBJECT_UNLOCK (self);
+			break;
+		case ARG_STATS:
+			g_value_take_boxed (value, gst_dreamtssource_get_stats (self));
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -184,275 +606,1500 @@ static gboolean gst_dreamtssource_unlock (GstBaseSrc * bsrc)
 {
 	GstDreamTsSource *self = GST_DREAMTSSOURCE (bsrc);
 	GST_LOG_OBJECT (self, "stop creating buffers");
-	SEND_COMMAND (self, CONTROL_STOP);
+	gst_dreamsource_control_set_flags (&self->control, CONTROL_FLUSHING);
+	return TRUE;
+}
+
+static gboolean gst_dreamtssource_unlock_stop (GstBaseSrc * bsrc)
+{
+	GstDreamTsSource *self = GST_DREAMTSSOURCE (bsrc);
+	GST_LOG_OBJECT (self, "stop flushing");
+	gst_dreamsource_control_clear_flags (&self->control, CONTROL_FLUSHING);
+	gst_dreamsource_control_take (&self->control);
+	return TRUE;
+}
+
+/* unlock_stop also runs on every PLAYING -> PAUSED -> PLAYING of a live source,
+ * only an actual flush replays the GOP cache */
+static gboolean gst_dreamtssource_event (GstBaseSrc * bsrc, GstEvent * event)
+{
+	GstDreamTsSource *self = GST_DREAMTSSOURCE (bsrc);
+	if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+	{
+		GST_LOG_OBJECT (self, "flush stop, replay GOP cache");
+		g_atomic_int_set (&self->gop_replay_pending, TRUE);
+	}
+	return GST_BASE_SRC_CLASS (parent_class)->event (bsrc, event);
+}
+
+static gboolean
+gst_dreamtssource_start_pool (GstDreamTsSource * self)
+{
+	GstStructure *config;
+	guint chunk_size;
+
+	GST_OBJECT_LOCK (self);
+	chunk_size = self->chunk_size;
+	GST_OBJECT_UNLOCK (self);
+
+	self->pool = gst_buffer_pool_new ();
+	config = gst_buffer_pool_get_config (self->pool);
+	gst_buffer_pool_config_set_params (config, NULL, chunk_size, MIN_POOL_BUFFERS, 0);
+	if (!gst_buffer_pool_set_config (self->pool, config) || !gst_buffer_pool_set_active (self->pool, TRUE))
+	{
+		GST_ERROR_OBJECT (self, "can't activate buffer pool with chunk size %u", chunk_size);
+		gst_object_unref (self->pool);
+		self->pool = NULL;
+		return FALSE;
+	}
+	GST_DEBUG_OBJECT (self, "activated buffer pool with chunk size %u", chunk_size);
 	return TRUE;
 }
 
 static void
-gst_dreamtssource_free_buffer (GstDreamTsSource * self)
+gst_dreamtssource_stop_pool (GstDreamTsSource * self)
 {
-	GST_TRACE_OBJECT (self, "gst_dreamtssource_free_buffer");
+	if (!self->pool)
+		return;
+	gst_buffer_pool_set_active (self->pool, FALSE);
+	gst_object_unref (self->pool);
+	self->pool = NULL;
 }
 
-static int handle_upstream(GstDreamTsSource * self)
+static void
+gst_dreamtssource_reset_pcr (GstDreamTsSource * self)
 {
-	char buffer[MAX_LINE_LENGTH];
-	int n = read(self->upstream, buffer, MAX_LINE_LENGTH);
-	GST_LOG_OBJECT (self, "handle_upstream read %i", n);
-	if (n == 0)
-		return 1;
+	GST_OBJECT_LOCK (self);
+	self->base_pts = GST_CLOCK_TIME_NONE;
+	self->detected_pcr_pid = self->pcr_pid;
+	GST_OBJECT_UNLOCK (self);
+	gst_dreamsource_unwrapper_reset (&self->pcr_unwrapper);
+	self->last_pcr = GST_CLOCK_TIME_NONE;
+	self->bytes_since_pcr = 0;
+	self->ns_per_byte = 0;
+	self->pcr_offset = 0;
+	self->pcr_offset_valid = FALSE;
+	self->last_pts = GST_CLOCK_TIME_NONE;
+}
 
-	if (n < 0)
+/* returns the 27 MHz PCR of a packet on the given PID (any PID if pid < 0) as nanoseconds,
+ * unwrapping its 33 bit base, or GST_CLOCK_TIME_NONE if the packet carries none */
+static GstClockTime
+gst_dreamtssource_parse_pcr (GstDreamTsSource * self, const guint8 * packet, gint * pid)
+{
+	gint packet_pid = ((packet[1] & 0x1F) << 8) | packet[2];
+	guint64 base;
+	guint ext;
+
+	if (packet[0] != TS_SYNC_BYTE || (*pid >= 0 && packet_pid != *pid))
+		return GST_CLOCK_TIME_NONE;
+	if (!(packet[3] & 0x20) || packet[4] < 7 || !(packet[5] & 0x10))
+		return GST_CLOCK_TIME_NONE;
+
+	base = ((guint64) packet[6] << 25) | (packet[7] << 17) | (packet[8] << 9) | (packet[9] << 1) | (packet[10] >> 7);
+	ext = ((packet[10] & 0x01) << 8) | packet[11];
+	*pid = packet_pid;
+	base = gst_dreamsource_unwrapper_unwrap (&self->pcr_unwrapper, base);
+	return MPEGTIME_TO_GSTTIME (base) + ext * 1000 / 27;
+}
+
+/* feeds a PCR observed at running time now into the smoothed PCR -> running time offset */
+static gboolean
+gst_dreamtssource_update_pcr (GstDreamTsSource * self, GstClockTime pcr, GstClockTime now)
+{
+	gboolean discont = FALSE;
+
+	if (GST_CLOCK_TIME_IS_VALID (self->last_pcr))
 	{
-		perror("read");
-		return 1;
+		if (pcr > self->last_pcr && pcr - self->last_pcr < MAX_PCR_GAP && self->bytes_since_pcr)
+			self->ns_per_byte = (gdouble) (pcr - self->last_pcr) / self->bytes_since_pcr;
+		else
+		{
+			GST_INFO_OBJECT (self, "PCR discontinuity %" GST_TIME_FORMAT " -> %" GST_TIME_FORMAT, GST_TIME_ARGS (self->last_pcr), GST_TIME_ARGS (pcr));
+			self->ns_per_byte = 0;
+			self->pcr_offset_valid = FALSE;
+			discont = TRUE;
+		}
 	}
-	
-	char *c = buffer;
-	
-	while (n)
+	else
 	{
-		char *next_line;
-		int valid;
+		GST_OBJECT_LOCK (self);
+		self->base_pts = pcr;
+		GST_OBJECT_UNLOCK (self);
+		GST_INFO_OBJECT (self, "first PCR on pid %i: %" GST_TIME_FORMAT, self->detected_pcr_pid, GST_TIME_ARGS (pcr));
+	}
+	self->last_pcr = pcr;
+	self->bytes_since_pcr = 0;
 
-		next_line = memchr(c, '\n', n);
-		if (!next_line)
-			next_line = c + n;
-		else
-			next_line++;
-		
-		valid = next_line - c;
-		if (valid > sizeof(self->response_line)-self->response_p)
-			return 1;
-		
-		memcpy(self->response_line + self->response_p, c, valid);
-		c += valid;
-		self->response_p += valid;
-		n -= valid;
-		
-				/* line received? */
-		if (self->response_line[self->response_p - 1] == '\n')
+	if (GST_CLOCK_TIME_IS_VALID (now))
+	{
+		gint64 observed = (gint64) now - (gint64) pcr;
+		if (!self->pcr_offset_valid || ABS (observed - self->pcr_offset) > (gint64) MAX_PCR_GAP)
 		{
-			self->response_line[self->response_p-1] = 0;
-			
-			if (self->response_p >= 2 && self->response_line[self->response_p - 2] == '\r')
-				self->response_line[self->response_p-2] = 0;
-			self->response_p = 0;
-		
-			if (handle_upstream_line(self))
-				return 1;
+			self->pcr_offset = observed;
+			self->pcr_offset_valid = TRUE;
 		}
+		else
+			self->pcr_offset += (observed - self->pcr_offset) / PCR_SMOOTHING;
 	}
-	return 0;
+	return discont;
 }
 
-static int handle_upstream_line(GstDreamTsSource * self)
+/* stamps a buffer with the running time of its first packet, interpolating
+ * between PCRs by the byte rate measured across the previous PCR interval */
+static void
+gst_dreamtssource_timestamp_buffer (GstDreamTsSource * self, GstBuffer * buffer)
 {
-	GST_LOG_OBJECT (self, "handle_upstream_line upstream_state %i response_line=%s", self->upstream_state, self->response_line);
-	switch (self->upstream_state)
-	{
-	case 0:
-		if (strncmp(self->response_line, "HTTP/1.", 7) || strlen(self->response_line) < 9) {
-			self->reason = "Invalid upstream response.";
-			return 1;
-		}
-		self->upstream_response_code = atoi(self->response_line + 9);
-		self->reason = strdup(self->response_line + 9);
-		self->upstream_state++;
-		break;
-	case 1:
-		if (!*self->response_line)
-		{
-			if (self->upstream_response_code == 200)
-				self->upstream_state = 2;
-			else
-				return 1; /* reason was already set in state 0, but we need all header lines for potential WWW-Authenticate */
-		}/* else if (!strncasecmp(self->response_line, "WWW-Authenticate: ", 18))
-			snprintf(wwwauthenticate, MAX_LINE_LENGTH, "%s\r\n", self->response_line);*/
-		break;
-	case 2:
-	case 3:
-		if (self->response_line[0] == '+') {
-					/* parse (and possibly open) demux */
-			int demux = atoi(self->response_line + 1);
+	GstClockTime now = GST_CLOCK_TIME_NONE, first = GST_CLOCK_TIME_NONE;
+	GstClock *clock;
+	GstMapInfo map;
+	gsize offset;
 
-					/* parse new pids */
-			const char *p = strchr(self->response_line, ':');
-			int old_active_pids[MAX_PIDS];
-			
-			memcpy(old_active_pids, self->active_pids, sizeof(self->active_pids));
-			
-			int nr_pids = 0, i, j;
-			while (p)
-			{
-				++p;
-				int pid = strtoul(p, 0, 0x10);
-				p = strchr(p, ',');
-				
-					/* do not add pids twice */
-				for (i = 0; i < nr_pids; ++i)
-					if (self->active_pids[i] == pid)
-						break;
+	if ((clock = gst_element_get_clock (GST_ELEMENT (self))))
+	{
+		now = gst_clock_get_time (clock) - gst_element_get_base_time (GST_ELEMENT (self));
+		gst_object_unref (clock);
+	}
 
-				if (i != nr_pids)
-					continue;
+	if (GST_CLOCK_TIME_IS_VALID (self->last_pcr) && self->ns_per_byte > 0)
+		first = self->last_pcr + (GstClockTime) (self->bytes_since_pcr * self->ns_per_byte);
 
-				self->active_pids[nr_pids++] = pid;
-				GST_DEBUG_OBJECT (self, "added pid %i: %i", nr_pids, self->active_pids[nr_pids-1]);
-				
-				if (nr_pids == MAX_PIDS)
-					break;
-			}
-			
-			for (i = nr_pids; i < MAX_PIDS; ++i)
-				self->active_pids[i] = -1;
-				
-					/* check for added pids */
-			for (i = 0; i < nr_pids; ++i)
-			{
-				for (j = 0; j < MAX_PIDS; ++j)
-					if (self->active_pids[i] == old_active_pids[j])
-						break;
-				if (j == MAX_PIDS) {
-					if (self->demux_fd < 0) {
-						struct dmx_pes_filter_params flt; 
-						char demuxfn[32];
-						sprintf(demuxfn, "/dev/dvb/adapter0/demux%d", demux);
-						self->demux_fd = open(demuxfn, O_RDWR | O_NONBLOCK);
-						if (self->demux_fd < 0) {
-							self->reason = "DEMUX OPEN FAILED";
-							return 2;
-						}
-						GST_DEBUG_OBJECT (self, "opened demux fd=%i",self->demux_fd);
-
-						ioctl(self->demux_fd, DMX_SET_BUFFER_SIZE, 1024*1024);
-
-						flt.pid = self->active_pids[i];
-						flt.input = DMX_IN_FRONTEND;
-#if DVB_API_VERSION > 3
-						flt.output = DMX_OUT_TSDEMUX_TAP;
-						flt.pes_type = DMX_PES_OTHER;
-#else
-						flt.output = DMX_OUT_TAP;
-						flt.pes_type = DMX_TAP_TS;
-#endif
-						flt.flags = DMX_IMMEDIATE_START;
-
-						if (ioctl(self->demux_fd, DMX_SET_PES_FILTER, &flt) < 0) {
-							self->reason = "DEMUX PES FILTER SET FAILED";
-							return 2;
-						}
-					}
-					else {
-						uint16_t pid = self->active_pids[i];
-						int ret;
-#if DVB_API_VERSION > 3
-						ret = ioctl(self->demux_fd, DMX_ADD_PID, &pid);
-#else
-						ret = ioctl(self->demux_fd, DMX_ADD_PID, pid);
-#endif
-						GST_DEBUG_OBJECT (self, "i=%i ioctl(%i, DMX_ADD_PID, %i)=%i", i, self->demux_fd, pid, ret);
-						
-						if (ret < 0) {
-							self->reason = "DMX_ADD_PID FAILED";
-							return 2;
-						}
-					}
-				}
-			}
-			
-					/* check for removed pids */
-			for (i = 0; i < MAX_PIDS; ++i)
+	gst_buffer_map (buffer, &map, GST_MAP_READ);
+	for (offset = 0; offset + TS_PACKET_SIZE <= map.size; offset += TS_PACKET_SIZE)
+	{
+		GstClockTime pcr = gst_dreamtssource_parse_pcr (self, map.data + offset, &self->detected_pcr_pid);
+		if (GST_CLOCK_TIME_IS_VALID (pcr))
+		{
+			if (gst_dreamtssource_update_pcr (self, pcr, now))
 			{
-				if (old_active_pids[i] == -1)
-					continue;
-				for (j = 0; j < nr_pids; ++j)
-					if (old_active_pids[i] == self->active_pids[j])
-						break;
-				if (j == nr_pids) {
-#if DVB_API_VERSION > 3
-					uint16_t pid = old_active_pids[i];
-					ioctl(self->demux_fd, DMX_REMOVE_PID, &pid);
-#else
-					ioctl(self->demux_fd, DMX_REMOVE_PID, old_active_pids[i]);
-#endif
-				}
-			}
-			if (self->upstream_state == 2) {
-// 				char *c = "HTTP/1.0 200 OK\r\nConnection: Close\r\nContent-Type: video/mpeg\r\nServer: stream_enigma2\r\n\r\n";
-// 				safe_write(1, c, strlen(c));
-				self->upstream_state = 3; /* HTTP response sent */
+				GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+				first = GST_CLOCK_TIME_NONE;
+				self->last_pts = GST_CLOCK_TIME_NONE;
 			}
+			if (!GST_CLOCK_TIME_IS_VALID (first))
+				first = pcr - MIN (pcr, (GstClockTime) (offset * self->ns_per_byte));
 		}
-		else if (self->response_line[0] == '-') {
-			self->reason = strdup(self->response_line + 1);
-			return 1;
-		}
-				/* ignore everything not starting with + or - */
-		break;
+		self->bytes_since_pcr += TS_PACKET_SIZE;
 	}
-	return 0;
-}
+	gst_buffer_unmap (buffer, &map);
 
+	if (!GST_CLOCK_TIME_IS_VALID (first) || !self->pcr_offset_valid || (gint64) first + self->pcr_offset < 0)
+		return;
 
-static GstFlowReturn
-gst_dreamtssource_create (GstPushSrc * psrc, GstBuffer ** outbuf)
+	GstClockTime pts = first + self->pcr_offset;
+	if (GST_CLOCK_TIME_IS_VALID (self->last_pts) && pts < self->last_pts)
+		pts = self->last_pts;
+	GST_BUFFER_PTS (buffer) = self->last_pts = pts;
+	GST_LOG_OBJECT (self, "buffer of %" G_GSIZE_FORMAT " bytes pts=%" GST_TIME_FORMAT, map.size, GST_TIME_ARGS (pts));
+}
+
+static gboolean
+gst_dreamtssource_psi_valid (GstDreamTsSource * self)
 {
-	GstDreamTsSource *self = GST_DREAMTSSOURCE (psrc);
+	guint i;
 
-	GST_DEBUG_OBJECT (self, "create");
+	if (!self->pat_valid)
+		return FALSE;
+	for (i = 0; i < self->n_services; i++)
+		if (self->services[i].pmt_pid >= 0 && !self->services[i].pmt_valid)
+			return FALSE;
+	return TRUE;
+}
 
-	while (1)
+/* MPEG-2 section CRC (polynomial 0x04C11DB7, msb first) */
+static guint32
+gst_dreamtssource_crc32 (const guint8 * data, gsize len)
+{
+	guint32 crc = 0xFFFFFFFF;
+	gsize i;
+	int bit;
+
+	for (i = 0; i < len; i++)
 	{
-		*outbuf = NULL;
+		crc ^= (guint32) data[i] << 24;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	}
+	return crc;
+}
 
-		struct pollfd rfd[3];
+/* returns the offset of a complete, CRC checked PAT or PMT section starting in a packet,
+ * SECTION_SPANS_PACKETS for a section continued in the next packet, which isn't cached,
+ * or -1 */
+static gint
+gst_dreamtssource_section_offset (const guint8 * packet, guint8 table_id)
+{
+	gint offset = 4;
+	guint len;
 
-		rfd[0].fd = self->upstream;
-		rfd[0].events = POLLIN | POLLERR | POLLHUP | POLLPRI;
-		rfd[1].fd = READ_SOCKET (self);
-		rfd[1].events = POLLIN | POLLERR | POLLHUP | POLLPRI;
-		rfd[2].fd = self->demux_fd;
-		rfd[2].events = POLLIN | POLLERR | POLLHUP | POLLPRI;
-		
-		int ret = poll(rfd, 3, 1000);
+	if (packet[0] != TS_SYNC_BYTE || !(packet[1] & 0x40) || !(packet[3] & 0x10))
+		return -1;
+	if (packet[3] & 0x20)
+		offset += 1 + packet[4];
+	if (offset >= TS_PACKET_SIZE)
+		return -1;
+	offset += 1 + packet[offset];
+	if (offset + 3 > TS_PACKET_SIZE || packet[offset] != table_id)
+		return -1;
+	len = ((packet[offset + 1] & 0x0F) << 8) | packet[offset + 2];
+	/* the fixed fields and the CRC, anything shorter would wrap the end of the entries */
+	if (len < (table_id == 0x00 ? PAT_MIN_SECTION_LENGTH : PMT_MIN_SECTION_LENGTH))
+		return -1;
+	if (offset + 3 + len > TS_PACKET_SIZE)
+		return SECTION_SPANS_PACKETS;
+	/* the CRC over a whole section including its own CRC comes out 0 */
+	if (gst_dreamtssource_crc32 (packet + offset, 3 + len))
+		return -1;
+	return offset;
+}
 
-		if (G_UNLIKELY (ret == -1))
-		{
-			GST_ERROR_OBJECT (self, "SELECT ERROR!");
-			break;
-		}
-		else if ( ret == 0 )
-		{
-			GST_LOG_OBJECT (self, "SELECT TIMEOUT");
-		}
-		else if ( rfd[0].revents )
+/* writes a section behind a fresh payload-only header taken from the original packet */
+static void
+gst_dreamtssource_write_section (guint8 * packet, const guint8 * header, guint8 * section, gsize len)
+{
+	guint32 crc;
+
+	section[1] = (section[1] & 0xF0) | (((len + 4 - 3) >> 8) & 0x0F);
+	section[2] = (len + 4 - 3) & 0xFF;
+	crc = gst_dreamtssource_crc32 (section, len);
+	section[len++] = crc >> 24;
+	section[len++] = crc >> 16;
+	section[len++] = crc >> 8;
+	section[len++] = crc;
+
+	packet[0] = TS_SYNC_BYTE;
+	packet[1] = header[1];
+	packet[2] = header[2];
+	packet[3] = (header[3] & 0xC0) | 0x10 | (header[3] & 0x0F);
+	packet[4] = 0;
+	memcpy(packet + 5, section, len);
+	memset(packet + 5 + len, 0xFF, TS_PACKET_SIZE - 5 - len);
+}
+
+/* reduces a PAT to the programs of the streamed services */
+static void
+gst_dreamtssource_rewrite_pat (GstDreamTsSource * self, guint8 * packet, gint offset)
+{
+	guint8 section[TS_PACKET_SIZE];
+	gsize len = 8;
+	guint i;
+
+	memcpy(section, packet + offset, len);
+	for (i = 0; i < self->n_services && len + 4 + 4 <= TS_PACKET_SIZE - 5; i++)
+	{
+		TsService *service = &self->services[i];
+		if (service->pmt_pid < 0)
+			continue;
+		section[len++] = service->sid >> 8;
+		section[len++] = service->sid & 0xFF;
+		section[len++] = 0xE0 | (service->pmt_pid >> 8);
+		section[len++] = service->pmt_pid & 0xFF;
+	}
+	gst_dreamtssource_write_section (packet, packet, section, len);
+}
+
+/* reduces a PMT to the elementary streams actually filtered */
+static void
+gst_dreamtssource_rewrite_pmt (GstDreamTsSource * self, TsService * service, guint8 * packet, gint offset)
+{
+	const guint8 *pmt = packet + offset;
+	gsize end = 3 + (((pmt[1] & 0x0F) << 8) | pmt[2]) - 4;
+	gsize pos = 12 + (((pmt[10] & 0x0F) << 8) | pmt[11]);
+	guint8 section[TS_PACKET_SIZE];
+	gsize len;
+
+	if (pos > end)
+		return;
+	memcpy(section, pmt, pos);
+	len = pos;
+	while (pos + 5 <= end)
+	{
+		int pid = ((pmt[pos + 1] & 0x1F) << 8) | pmt[pos + 2];
+		gsize es_len = 5 + (((pmt[pos + 3] & 0x0F) << 8) | pmt[pos + 4]);
+		if (pos + es_len > end)
+			break;
+		if (PID_SET_HAS(service->wanted_pids, pid))
+		{
+			memcpy(section + len, pmt + pos, es_len);
+			len += es_len;
+		}
+		pos += es_len;
+	}
+	gst_dreamtssource_write_section (packet, packet, section, len);
+}
+
+/* remembers the first video stream of a service's PMT, its random access points start the GOP cache */
+static void
+gst_dreamtssource_find_video_pid (TsService * service)
+{
+	const guint8 *pmt = service->pmt + gst_dreamtssource_section_offset (service->pmt, 0x02);
+	gsize end = 3 + (((pmt[1] & 0x0F) << 8) | pmt[2]) - 4;
+	gsize pos = 12 + (((pmt[10] & 0x0F) << 8) | pmt[11]);
+
+	service->video_pid = -1;
+	for (; pos + 5 <= end; pos += 5 + (((pmt[pos + 3] & 0x0F) << 8) | pmt[pos + 4]))
+	{
+		if (pmt[pos] == STREAM_TYPE_MPEG2 || pmt[pos] == STREAM_TYPE_H264 || pmt[pos] == STREAM_TYPE_H265)
+		{
+			service->video_type = pmt[pos];
+			service->video_pid = ((pmt[pos + 1] & 0x1F) << 8) | pmt[pos + 2];
+			return;
+		}
+	}
+}
+
+/* caches the latest single packet PAT and PMTs of the streamed programs, rewriting them
+ * (in the stream as well) into just the streamed programs if configured */
+static void
+gst_dreamtssource_scan_psi (GstDreamTsSource * self, GstBuffer * buffer, gboolean rewrite)
+{
+	gboolean was_valid = gst_dreamtssource_psi_valid (self);
+	GstMapInfo map;
+	gsize pos;
+	guint i;
+
+	if (!gst_buffer_map (buffer, &map, rewrite ? GST_MAP_READWRITE : GST_MAP_READ))
+		return;
+	for (pos = 0; pos + TS_PACKET_SIZE <= map.size; pos += TS_PACKET_SIZE)
+	{
+		guint8 *packet = map.data + pos;
+		int pid = ((packet[1] & 0x1F) << 8) | packet[2];
+		gint offset;
+
+		if (pid == 0 && (offset = gst_dreamtssource_section_offset (packet, 0x00)) >= 0)
+		{
+			const guint8 *pat = packet + offset;
+			gsize end = 3 + (((pat[1] & 0x0F) << 8) | pat[2]) - 4;
+			gsize entry;
+			for (entry = 8; entry + 4 <= end; entry += 4)
+			{
+				guint16 program = (pat[entry] << 8) | pat[entry + 1];
+				for (i = 0; i < self->n_services; i++)
+					if (program && self->services[i].sid == program)
+						self->services[i].pmt_pid = ((pat[entry + 2] & 0x1F) << 8) | pat[entry + 3];
+			}
+			if (rewrite)
+				gst_dreamtssource_rewrite_pat (self, packet, offset);
+			memcpy(self->pat, packet, TS_PACKET_SIZE);
+			self->pat_valid = TRUE;
+			continue;
+		}
+		for (i = 0; i < self->n_services; i++)
+		{
+			TsService *service = &self->services[i];
+			if (pid != service->pmt_pid)
+				continue;
+			if ((offset = gst_dreamtssource_section_offset (packet, 0x02)) == SECTION_SPANS_PACKETS && !service->pmt_spans_warned)
+			{
+				/* psi_valid () waits for every PMT, so this disables the injection for good */
+				GST_ELEMENT_WARNING (self, STREAM, FORMAT, (NULL), ("PMT of service %s spans several packets, PAT and PMT won't be injected", service->service_ref));
+				service->pmt_spans_warned = TRUE;
+			}
+			if (offset < 0)
+				continue;
+			if (((packet[offset + 3] << 8) | packet[offset + 4]) != service->sid)
+				continue;
+			if (rewrite)
+				gst_dreamtssource_rewrite_pmt (self, service, packet, offset);
+			memcpy(service->pmt, packet, TS_PACKET_SIZE);
+			service->pmt_valid = TRUE;
+			gst_dreamtssource_find_video_pid (service);
+		}
+	}
+	gst_buffer_unmap (buffer, &map);
+
+	/* the stream itself just delivered the tables, no need to repeat them */
+	if (!was_valid && gst_dreamtssource_psi_valid (self))
+		self->psi_pending = FALSE;
+}
+
+/* prepends the cached PAT and PMTs to a buffer, for a fresh start or after a discontinuity */
+static void
+gst_dreamtssource_inject_psi (GstDreamTsSource * self, GstBuffer * buffer)
+{
+	guint8 *data;
+	guint i, n = 0;
+
+	if (!(self->psi_pending || GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DISCONT)) || !gst_dreamtssource_psi_valid (self))
+		return;
+
+	data = g_malloc ((1 + self->n_services) * TS_PACKET_SIZE);
+	memcpy(data, self->pat, TS_PACKET_SIZE);
+	n++;
+	for (i = 0; i < self->n_services; i++)
+		if (self->services[i].pmt_valid)
+			memcpy(data + TS_PACKET_SIZE * n++, self->services[i].pmt, TS_PACKET_SIZE);
+	gst_buffer_prepend_memory (buffer, gst_memory_new_wrapped (0, data, n * TS_PACKET_SIZE, 0, n * TS_PACKET_SIZE, data, g_free));
+	self->psi_pending = FALSE;
+	GST_DEBUG_OBJECT (self, "injected PAT and %u PMT(s)", n - 1);
+}
+
+/* checks whether a PES starting in this packet begins with a random access point, either
+ * flagged in the adaptation field or by a sequence header/IDR in the payload */
+static gboolean
+gst_dreamtssource_is_rap (TsService * service, const guint8 * packet)
+{
+	gsize pos = 4;
+
+	if (!(packet[1] & 0x40))
+		return FALSE;
+	if (packet[3] & 0x20)
+	{
+		if (packet[4] && (packet[5] & 0x40))
+			return TRUE;
+		pos += 1 + packet[4];
+	}
+	for (; pos + 4 <= TS_PACKET_SIZE; pos++)
+	{
+		if (packet[pos] || packet[pos + 1] || packet[pos + 2] != 0x01)
+			continue;
+		guint8 code = packet[pos + 3];
+		switch (service->video_type)
+		{
+			case STREAM_TYPE_MPEG2:
+				if (code == 0xB3)
+					return TRUE;
+				break;
+			case STREAM_TYPE_H264:
+				if ((code & 0x1F) == 5 || (code & 0x1F) == 7)
+					return TRUE;
+				break;
+			case STREAM_TYPE_H265:
+				if (((code >> 1) & 0x3F) >= 16 && ((code >> 1) & 0x3F) <= 21)
+					return TRUE;
+				if (((code >> 1) & 0x3F) == 32)
+					return TRUE;
+				break;
+		}
+	}
+	return FALSE;
+}
+
+static void
+gst_dreamtssource_clear_gop_cache (GstDreamTsSource * self)
+{
+	g_queue_foreach (&self->gop_cache, (GFunc) gst_buffer_unref, NULL);
+	g_queue_clear (&self->gop_cache);
+	self->gop_cache_bytes = 0;
+	self->gop_replay = NULL;
+}
+
+/* adds a pushed buffer to the GOP cache, restarting the cache at a random access point of
+ * the first service's video - the cache shares the buffers, a RAP inside a buffer is cut
+ * out as a zero-copy sub-buffer */
+static void
+gst_dreamtssource_cache_buffer (GstDreamTsSource * self, TsService * service, GstBuffer * buffer, GstClockTime max_time)
+{
+	TsService *video = &self->services[0];
+	gsize size = gst_buffer_get_size (buffer);
+
+	if (!max_time)
+		return;
+
+	if (service == video && video->video_pid >= 0)
+	{
+		GstMapInfo map;
+		gsize pos;
+
+		gst_buffer_map (buffer, &map, GST_MAP_READ);
+		for (pos = 0; pos + TS_PACKET_SIZE <= map.size; pos += TS_PACKET_SIZE)
+		{
+			const guint8 *packet = map.data + pos;
+			if (packet[0] == TS_SYNC_BYTE && (((packet[1] & 0x1F) << 8) | packet[2]) == video->video_pid && gst_dreamtssource_is_rap (video, packet))
+				break;
+		}
+		gst_buffer_unmap (buffer, &map);
+
+		if (pos + TS_PACKET_SIZE <= size)
+		{
+			GST_LOG_OBJECT (self, "random access point, restarting GOP cache after %u buffers", g_queue_get_length (&self->gop_cache));
+			gst_dreamtssource_clear_gop_cache (self);
+			buffer = pos ? gst_buffer_copy_region (buffer, GST_BUFFER_COPY_ALL, pos, size - pos) : gst_buffer_ref (buffer);
+			self->gop_cache_bytes = size - pos;
+			g_queue_push_tail (&self->gop_cache, buffer);
+			return;
+		}
+	}
+
+	if (g_queue_is_empty (&self->gop_cache))
+		return;
+
+	GstBuffer *first = g_queue_peek_head (&self->gop_cache);
+	if (self->gop_cache_bytes + size > GOP_CACHE_MAX_BYTES ||
+	   (GST_BUFFER_PTS_IS_VALID (first) && GST_BUFFER_PTS_IS_VALID (buffer) && GST_BUFFER_PTS (buffer) - GST_BUFFER_PTS (first) > max_time))
+	{
+		GST_DEBUG_OBJECT (self, "GOP exceeds the cache, waiting for the next random access point");
+		gst_dreamtssource_clear_gop_cache (self);
+		return;
+	}
+	g_queue_push_tail (&self->gop_cache, gst_buffer_ref (buffer));
+	self->gop_cache_bytes += size;
+}
+
+/* hands out the next cached buffer while a replay is running, the first one as a
+ * DISCONT buffer carrying the PAT/PMT. The cached timestamps are long past, a syncing
+ * sink would drop the whole GOP as late, so the replay is stamped with the running
+ * time it started at */
+static GstBuffer *
+gst_dreamtssource_replay_buffer (GstDreamTsSource * self)
+{
+	GstBuffer *buffer;
+	GstClock *clock;
+
+	if (g_atomic_int_compare_and_exchange (&self->gop_replay_pending, TRUE, FALSE) && !g_queue_is_empty (&self->gop_cache))
+	{
+		GST_DEBUG_OBJECT (self, "replaying GOP cache of %u buffers (%" G_GSIZE_FORMAT " bytes)", g_queue_get_length (&self->gop_cache), self->gop_cache_bytes);
+		self->gop_replay = self->gop_cache.head;
+		self->gop_replay_pts = GST_CLOCK_TIME_NONE;
+		if ((clock = gst_element_get_clock (GST_ELEMENT (self))))
+		{
+			self->gop_replay_pts = gst_clock_get_time (clock) - gst_element_get_base_time (GST_ELEMENT (self));
+			gst_object_unref (clock);
+		}
+		/* live buffers must not be stamped before the replay */
+		if (GST_CLOCK_TIME_IS_VALID (self->gop_replay_pts) && (!GST_CLOCK_TIME_IS_VALID (self->last_pts) || self->last_pts < self->gop_replay_pts))
+			self->last_pts = self->gop_replay_pts;
+		buffer = gst_buffer_copy (self->gop_replay->data);
+		GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+		self->psi_pending = TRUE;
+		gst_dreamtssource_inject_psi (self, buffer);
+	}
+	else if (self->gop_replay)
+		buffer = gst_buffer_copy (self->gop_replay->data);
+	else
+		return NULL;
+	self->gop_replay = self->gop_replay->next;
+
+	GST_BUFFER_PTS (buffer) = self->gop_replay_pts;
+	GST_BUFFER_DTS (buffer) = GST_CLOCK_TIME_NONE;
+	return buffer;
+}
+
+/* returns the offset of the first sync byte that is confirmed by the sync bytes of the
+ * next two packets (as far as they are inside the data), or -1 */
+static gssize
+gst_dreamtssource_find_sync (const guint8 * data, gsize size)
+{
+	gsize pos = 0;
+
+#if defined(__SSE2__)
+	const __m128i sync = _mm_set1_epi8 (TS_SYNC_BYTE);
+	for (; pos + 16 <= size; pos += 16)
+	{
+		guint mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (data + pos)), sync));
+		gint bit;
+		for (bit = g_bit_nth_lsf (mask, -1); bit >= 0; bit = g_bit_nth_lsf (mask, bit))
+			if (TS_SYNC_CONFIRMED (data, size, pos + bit))
+				return pos + bit;
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t sync = vdupq_n_u8 (TS_SYNC_BYTE);
+	for (; pos + 16 <= size; pos += 16)
+	{
+		uint64x2_t eq = vreinterpretq_u64_u8 (vceqq_u8 (vld1q_u8 (data + pos), sync));
+		if (!(vgetq_lane_u64 (eq, 0) | vgetq_lane_u64 (eq, 1)))
+			continue;
+		gsize i;
+		for (i = pos; i < pos + 16; i++)
+			if (data[i] == TS_SYNC_BYTE && TS_SYNC_CONFIRMED (data, size, i))
+				return i;
+	}
+#endif
+	while (pos < size)
+	{
+		const guint8 *candidate = memchr (data + pos, TS_SYNC_BYTE, size - pos);
+		if (!candidate)
+			break;
+		pos = candidate - data;
+		if (TS_SYNC_CONFIRMED (data, size, pos))
+			return pos;
+		pos++;
+	}
+	return -1;
+}
+
+/* checks TEI and the continuity counter of a packet, returns TRUE if packets were lost */
+static gboolean
+gst_dreamtssource_check_packet (GstDreamTsSource * self, const guint8 * packet, guint * cc_errors, guint * tei_errors)
+{
+	int pid = ((packet[1] & 0x1F) << 8) | packet[2];
+	guint8 cc = packet[3] & 0x0F, last;
+
+	if (packet[1] & 0x80)
+	{
+		(*tei_errors)++;
+		return FALSE;
+	}
+	self->pid_stats[pid].packets++;
+	if (pid == TS_MAX_PID || !(packet[3] & 0x10))
+		return FALSE;
+
+	last = self->cc[pid];
+	self->cc[pid] = cc;
+	if ((packet[3] & 0x20) && packet[4] && (packet[5] & 0x80))
+		return FALSE;
+	if (last == CC_UNKNOWN || cc == ((last + 1) & 0x0F) || cc == last)
+		return FALSE;
+
+	GST_LOG_OBJECT (self, "continuity error on pid %i: %i -> %i", pid, last, cc);
+	(*cc_errors)++;
+	return TRUE;
+}
+
+static GstBuffer *
+gst_dreamtssource_append_region (GstBuffer * result, GstBuffer * buffer, gsize offset, gsize size)
+{
+	GstBuffer *region = gst_buffer_copy_region (buffer, GST_BUFFER_COPY_MEMORY, offset, size);
+	return result ? gst_buffer_append (result, region) : region;
+}
+
+/* validates the sync bytes of a chunk, realigning around garbage and packets split across
+ * reads, and tracks TEI and continuity counters - aligned chunks are returned as they are,
+ * others are rebuilt from zero-copy regions, NULL if nothing was usable */
+static GstBuffer *
+gst_dreamtssource_check_packets (GstDreamTsSource * self, TsService * service, GstBuffer * buffer)
+{
+	GstBuffer *result = NULL;
+	GstMapInfo map;
+	gsize pos = 0, start;
+	gboolean rebuilt = FALSE, discont = FALSE;
+	guint packets = 0, cc_errors = 0, tei_errors = 0, sync_errors = 0;
+
+	gst_buffer_map (buffer, &map, GST_MAP_READ);
+
+	/* complete a packet whose head came with the previous read */
+	if (service->partial_len)
+	{
+		gsize need = TS_PACKET_SIZE - service->partial_len;
+		if (map.size >= need && (map.size == need || map.data[need] == TS_SYNC_BYTE))
+		{
+			guint8 *packet = g_malloc (TS_PACKET_SIZE);
+			memcpy(packet, service->partial, service->partial_len);
+			memcpy(packet + service->partial_len, map.data, need);
+			discont |= gst_dreamtssource_check_packet (self, packet, &cc_errors, &tei_errors);
+			packets++;
+			result = gst_buffer_new_wrapped (packet, TS_PACKET_SIZE);
+			pos = need;
+		}
+		else
+		{
+			sync_errors++;
+			discont = TRUE;
+		}
+		service->partial_len = 0;
+		rebuilt = TRUE;
+	}
+
+	while (pos < map.size)
+	{
+		if (map.data[pos] != TS_SYNC_BYTE)
+		{
+			gssize sync = gst_dreamtssource_find_sync (map.data + pos, map.size - pos);
+			GST_DEBUG_OBJECT (self, "lost sync at %" G_GSIZE_FORMAT ", skipping %" G_GSSIZE_FORMAT " bytes", pos, sync < 0 ? (gssize) (map.size - pos) : sync);
+			sync_errors++;
+			discont = rebuilt = TRUE;
+			if (sync < 0)
+				break;
+			pos += sync;
+		}
+
+		start = pos;
+		while (pos + TS_PACKET_SIZE <= map.size && map.data[pos] == TS_SYNC_BYTE)
+		{
+			discont |= gst_dreamtssource_check_packet (self, map.data + pos, &cc_errors, &tei_errors);
+			packets++;
+			pos += TS_PACKET_SIZE;
+		}
+		if (pos > start && rebuilt)
+			result = gst_dreamtssource_append_region (result, buffer, start, pos - start);
+
+		if (pos < map.size && pos + TS_PACKET_SIZE > map.size && map.data[pos] == TS_SYNC_BYTE)
+		{
+			if (!rebuilt && pos)
+				result = gst_dreamtssource_append_region (result, buffer, 0, pos);
+			service->partial_len = map.size - pos;
+			memcpy(service->partial, map.data + pos, service->partial_len);
+			rebuilt = TRUE;
+			break;
+		}
+		if (!rebuilt && pos < map.size && pos > 0)
+		{
+			/* garbage follows an aligned run, keep the run as the first region */
+			result = gst_dreamtssource_append_region (result, buffer, 0, pos);
+			rebuilt = TRUE;
+		}
+	}
+	gst_buffer_unmap (buffer, &map);
+
+	GST_OBJECT_LOCK (self);
+	self->stats.packets += packets;
+	self->stats.sync_errors += sync_errors;
+	self->stats.cc_errors += cc_errors;
+	self->stats.tei_errors += tei_errors;
+	GST_OBJECT_UNLOCK (self);
+
+	if (rebuilt)
+	{
+		if (result)
+			gst_buffer_copy_into (result, buffer, GST_BUFFER_COPY_FLAGS, 0, -1);
+		gst_buffer_unref (buffer);
+		buffer = result;
+	}
+	if (buffer && discont)
+		GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+	return buffer;
+}
+
+/* reads one chunk from a service's demux straight into a recycled pool buffer,
+ * returns the number of bytes read like read() and leaves *outbuf NULL on failure */
+static int
+gst_dreamtssource_read_chunk (GstDreamTsSource * self, TsService * service, gboolean rewrite, GstBuffer ** outbuf)
+{
+	GstBuffer *buffer = NULL;
+	GstMapInfo map;
+	int r;
+
+	if (gst_buffer_pool_acquire_buffer (self->pool, &buffer, NULL) != GST_FLOW_OK)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+	r = read(service->demux_fd, map.data, map.size);
+	gst_buffer_unmap (buffer, &map);
+
+	if (r <= 0)
+	{
+		int read_errno = errno;
+		if (r < 0 && read_errno == EOVERFLOW)
+			gst_dreamtssource_demux_overflow (self, service);
+		gst_buffer_unref (buffer);
+		errno = read_errno;
+		return r;
+	}
+	gst_dreamtssource_count_read (self, r);
+	gst_buffer_resize (buffer, 0, r);
+	if (!(buffer = gst_dreamtssource_check_packets (self, service, buffer)))
+		return 0;
+	/* the PCR mapping interpolates over the byte stream of one demux, buffers of
+	 * further services of a multi-program stream go out without timestamps */
+	if (service->index == 0)
+		gst_dreamtssource_timestamp_buffer (self, buffer);
+	gst_dreamtssource_scan_psi (self, buffer, rewrite);
+	*outbuf = buffer;
+	return r;
+}
+
+/* drains the demux with readv() into as many pool buffers as the byte budget allows,
+ * repeating while the kernel keeps filling every chunk and the latency budget isn't spent */
+static gssize
+gst_dreamtssource_read_batch (GstDreamTsSource * self, TsService * service, guint max_bytes, GstClockTime max_time, gboolean rewrite, GstBufferList * list)
+{
+	GstBuffer *buffers[MAX_BATCH_CHUNKS];
+	GstMapInfo maps[MAX_BATCH_CHUNKS];
+	struct iovec iov[MAX_BATCH_CHUNKS];
+	gint64 deadline = max_time ? g_get_monotonic_time () + max_time / GST_USECOND : 0;
+	gsize total = 0, capacity;
+	gssize r;
+	guint n, i;
+
+	do {
+		capacity = 0;
+		for (n = 0; n < MAX_BATCH_CHUNKS && (n == 0 || total + capacity < max_bytes); n++)
+		{
+			buffers[n] = NULL;
+			if (gst_buffer_pool_acquire_buffer (self->pool, &buffers[n], NULL) != GST_FLOW_OK)
+				break;
+			gst_buffer_map (buffers[n], &maps[n], GST_MAP_WRITE);
+			iov[n].iov_base = maps[n].data;
+			iov[n].iov_len = maps[n].size;
+			capacity += maps[n].size;
+		}
+		if (n == 0)
+		{
+			errno = ENOMEM;
+			return total ? (gssize) total : -1;
+		}
+
+		r = readv(service->demux_fd, iov, n);
+		int read_errno = errno;
+		if (r > 0)
+			gst_dreamtssource_count_read (self, r);
+		else if (r < 0 && read_errno == EOVERFLOW)
+			gst_dreamtssource_demux_overflow (self, service);
+
+		gsize remaining = r > 0 ? r : 0;
+		for (i = 0; i < n; i++)
+		{
+			gst_buffer_unmap (buffers[i], &maps[i]);
+			if (remaining == 0)
+			{
+				gst_buffer_unref (buffers[i]);
+				continue;
+			}
+			gsize size = MIN (remaining, iov[i].iov_len);
+			gst_buffer_resize (buffers[i], 0, size);
+			remaining -= size;
+			if (!(buffers[i] = gst_dreamtssource_check_packets (self, service, buffers[i])))
+				continue;
+			if (service->index == 0)
+				gst_dreamtssource_timestamp_buffer (self, buffers[i]);
+			gst_dreamtssource_scan_psi (self, buffers[i], rewrite);
+			gst_buffer_list_add (list, buffers[i]);
+		}
+
+		if (r <= 0)
+		{
+			errno = read_errno;
+			return total ? (gssize) total : r;
+		}
+		total += r;
+	} while ((gsize) r == capacity && total < max_bytes && (!deadline || g_get_monotonic_time () < deadline));
+
+	GST_LOG_OBJECT (self, "drained %" G_GSIZE_FORMAT " bytes into %u buffers", total, gst_buffer_list_length (list));
+	return total;
+}
+
+static int handle_upstream(GstDreamTsSource * self, TsService * service)
+{
+	char buffer[MAX_LINE_LENGTH];
+	int n = read(service->upstream, buffer, MAX_LINE_LENGTH);
+	GST_LOG_OBJECT (self, "handle_upstream service %u read %i", service->index, n);
+	if (n == 0)
+		return 1;
+
+	if (n < 0)
+	{
+		perror("read");
+		return 1;
+	}
+	
+	char *c = buffer;
+	
+	while (n)
+	{
+		char *next_line;
+		int valid;
+
+		next_line = memchr(c, '\n', n);
+		if (!next_line)
+			next_line = c + n;
+		else
+			next_line++;
+		
+		valid = next_line - c;
+		if (valid > sizeof(service->response_line)-service->response_p)
+			return 1;
+		
+		memcpy(service->response_line + service->response_p, c, valid);
+		c += valid;
+		service->response_p += valid;
+		n -= valid;
+		
+				/* line received? */
+		if (service->response_line[service->response_p - 1] == '\n')
+		{
+			service->response_line[service->response_p-1] = 0;
+			
+			if (service->response_p >= 2 && service->response_line[service->response_p - 2] == '\r')
+				service->response_line[service->response_p-2] = 0;
+			service->response_p = 0;
+		
+			int ret = handle_upstream_line(self, service);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* returns the service which currently filters pid on the given demux, if any, the same
+ * pid on another demux belongs to another transponder */
+static TsService *gst_dreamtssource_pid_owner(GstDreamTsSource * self, int demux, int pid)
+{
+	guint i;
+	for (i = 0; i < self->n_services; i++)
+		if (self->services[i].demux == demux && PID_SET_HAS(self->services[i].active_pids, pid))
+			return &self->services[i];
+	return NULL;
+}
+
+static int gst_dreamtssource_add_pid(GstDreamTsSource * self, TsService * service, uint16_t pid)
+{
+	if (service->demux_fd < 0) {
+		struct dmx_pes_filter_params flt; 
+		gchar *demuxfn;
+		GST_OBJECT_LOCK (self);
+		demuxfn = g_strdup_printf ("%s%d", self->demux_device, service->demux);
+		GST_OBJECT_UNLOCK (self);
+		service->demux_fd = open(demuxfn, O_RDWR | O_NONBLOCK);
+		g_free (demuxfn);
+		if (service->demux_fd < 0) {
+			service->reason = "DEMUX OPEN FAILED";
+			return 2;
+		}
+		GST_DEBUG_OBJECT (self, "service %u opened demux fd=%i", service->index, service->demux_fd);
+
+		struct epoll_event event = { .events = EPOLLIN, .data.u64 = EPOLL_TAG (EPOLL_DEMUX, service->index) };
+		if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, service->demux_fd, &event) < 0) {
+			service->reason = "DEMUX EPOLL REGISTRATION FAILED";
+			return 2;
+		}
+
+		ioctl(service->demux_fd, DMX_SET_BUFFER_SIZE, service->demux_buffer_size);
+
+		flt.pid = pid;
+		flt.input = DMX_IN_FRONTEND;
+#if DVB_API_VERSION > 3
+		flt.output = DMX_OUT_TSDEMUX_TAP;
+		flt.pes_type = DMX_PES_OTHER;
+#else
+		flt.output = DMX_OUT_TAP;
+		flt.pes_type = DMX_TAP_TS;
+#endif
+		flt.flags = DMX_IMMEDIATE_START;
+
+		if (ioctl(service->demux_fd, DMX_SET_PES_FILTER, &flt) < 0) {
+			service->reason = "DEMUX PES FILTER SET FAILED";
+			return 2;
+		}
+	}
+	else {
+		int ret;
+#if DVB_API_VERSION > 3
+		ret = ioctl(service->demux_fd, DMX_ADD_PID, &pid);
+#else
+		ret = ioctl(service->demux_fd, DMX_ADD_PID, pid);
+#endif
+		GST_DEBUG_OBJECT (self, "ioctl(%i, DMX_ADD_PID, %i)=%i", service->demux_fd, pid, ret);
+		
+		if (ret < 0) {
+			service->reason = "DMX_ADD_PID FAILED";
+			return 2;
+		}
+	}
+	PID_SET_ADD(service->active_pids, pid);
+	return 0;
+}
+
+static void gst_dreamtssource_remove_pid(GstDreamTsSource * self, TsService * service, uint16_t pid)
+{
+	int ret;
+#if DVB_API_VERSION > 3
+	ret = ioctl(service->demux_fd, DMX_REMOVE_PID, &pid);
+#else
+	ret = ioctl(service->demux_fd, DMX_REMOVE_PID, pid);
+#endif
+	GST_DEBUG_OBJECT (self, "ioctl(%i, DMX_REMOVE_PID, %i)=%i", service->demux_fd, pid, ret);
+	PID_SET_REMOVE(service->active_pids, pid);
+}
+
+/* makes pids the wanted set of a service, filtering added pids unless another service
+ * on the same demux already does and handing removed ones over to another service of
+ * that demux still wanting them */
+static int gst_dreamtssource_update_pids(GstDreamTsSource * self, TsService * service, int demux, const guint32 * pids)
+{
+	int w, ret;
+
+	service->demux = demux;
+	memcpy(service->wanted_pids, pids, sizeof(service->wanted_pids));
+
+	/* check for added pids */
+	for (w = 0; w < PID_SET_WORDS; ++w)
+	{
+		guint32 added = pids[w] & ~service->active_pids[w];
+		gint bit;
+
+		for (bit = g_bit_nth_lsf (added, -1); bit >= 0; bit = g_bit_nth_lsf (added, bit))
+		{
+			int pid = w * 32 + bit;
+			if (gst_dreamtssource_pid_owner (self, service->demux, pid))
+				continue;
+			if ((ret = gst_dreamtssource_add_pid (self, service, pid)))
+				return ret;
+		}
+	}
+
+	/* check for removed pids */
+	for (w = 0; w < PID_SET_WORDS; ++w)
+	{
+		guint32 removed = service->active_pids[w] & ~pids[w];
+		gint bit;
+
+		for (bit = g_bit_nth_lsf (removed, -1); bit >= 0; bit = g_bit_nth_lsf (removed, bit))
+		{
+			int pid = w * 32 + bit;
+			guint i;
+
+			gst_dreamtssource_remove_pid (self, service, pid);
+			for (i = 0; i < self->n_services; i++)
+			{
+				TsService *other = &self->services[i];
+				if (other != service && other->demux == service->demux && PID_SET_HAS(other->wanted_pids, pid))
+				{
+					if ((ret = gst_dreamtssource_add_pid (self, other, pid)))
+						return ret;
+					break;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int handle_upstream_line(GstDreamTsSource * self, TsService * service)
+{
+	GST_LOG_OBJECT (self, "handle_upstream_line service %u upstream_state %i response_line=%s", service->index, service->upstream_state, service->response_line);
+	switch (service->upstream_state)
+	{
+	case 0:
+		if (strncmp(service->response_line, "HTTP/1.", 7) || strlen(service->response_line) < 9) {
+			service->reason = "Invalid upstream response.";
+			return 1;
+		}
+		service->upstream_response_code = atoi(service->response_line + 9);
+		service->reason = strdup(service->response_line + 9);
+		service->upstream_state++;
+		break;
+	case 1:
+		if (!*service->response_line)
+		{
+			if (service->upstream_response_code == 200)
+			{
+				service->upstream_state = 2;
+				service->established = TRUE;
+				service->reconnect_delay = RECONNECT_DELAY_MIN;
+			}
+			else
+				return 1; /* reason was already set in state 0, but we need all header lines for potential WWW-Authenticate */
+		}/* else if (!strncasecmp(service->response_line, "WWW-Authenticate: ", 18))
+			snprintf(wwwauthenticate, MAX_LINE_LENGTH, "%s\r\n", service->response_line);*/
+		break;
+	case 2:
+	case 3:
+		if (service->response_line[0] == '+') {
+					/* parse (and possibly open) demux */
+			int demux = atoi(service->response_line + 1);
+
+					/* parse new pids */
+			const char *p = strchr(service->response_line, ':');
+			guint32 new_active_pids[PID_SET_WORDS];
+			int ret;
+
+			memset(new_active_pids, 0, sizeof(new_active_pids));
+
+			while (p)
+			{
+				++p;
+				unsigned long pid = strtoul(p, 0, 0x10);
+				p = strchr(p, ',');
+
+				if (pid > TS_MAX_PID)
+					continue;
+				PID_SET_ADD(new_active_pids, pid);
+			}
+
+			if ((ret = gst_dreamtssource_update_pids (self, service, demux, new_active_pids)))
+				return ret;
+			if (service->upstream_state == 2) {
+// 				char *c = "HTTP/1.0 200 OK\r\nConnection: Close\r\nContent-Type: video/mpeg\r\nServer: stream_enigma2\r\n\r\n";
+// 				safe_write(1, c, strlen(c));
+				service->upstream_state = 3; /* HTTP response sent */
+			}
+		}
+		else if (service->response_line[0] == '-') {
+			service->reason = strdup(service->response_line + 1);
+			return 1;
+		}
+				/* ignore everything not starting with + or - */
+		break;
+	}
+	return 0;
+}
+
+
+static gboolean
+gst_dreamtssource_resolve (GstDreamTsSource * self)
+{
+	struct addrinfo hints, *res;
+	gchar *host, port[8];
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	GST_OBJECT_LOCK (self);
+	host = g_strdup (self->host);
+	g_snprintf(port, sizeof(port), "%u", self->port);
+	GST_OBJECT_UNLOCK (self);
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, (NULL), ("can't resolve upstream %s: %s", host, gai_strerror (ret)));
+		g_free (host);
+		return FALSE;
+	}
+	memcpy(&self->upstream_addr, res->ai_addr, res->ai_addrlen);
+	self->upstream_addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	g_free (host);
+	return TRUE;
+}
+
+/* starts a non-blocking connect, the request is sent by gst_dreamtssource_send_request
+ * once the socket signals EPOLLOUT */
+static gboolean
+gst_dreamtssource_connect_service (GstDreamTsSource * self, TsService * service)
+{
+	service->upstream = socket(self->upstream_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (service->upstream < 0) {
+		service->reason = "Failed to create socket.";
+		return FALSE;
+	}
+	service->link = LINK_CONNECTING;
+
+	if (connect(service->upstream, (struct sockaddr*)&self->upstream_addr, self->upstream_addrlen) < 0 && errno != EINPROGRESS)
+	{
+		service->reason = "Upstream connect failed.";
+		return FALSE;
+	}
+
+	struct epoll_event event = { .events = EPOLLOUT, .data.u64 = EPOLL_TAG (EPOLL_UPSTREAM, service->index) };
+	if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, service->upstream, &event) < 0) {
+		service->reason = "Failed to watch upstream socket.";
+		return FALSE;
+	}
+	GST_DEBUG_OBJECT (self, "service %u connecting...", service->index);
+	return TRUE;
+}
+
+static gboolean
+gst_dreamtssource_send_request (GstDreamTsSource * self, TsService * service)
+{
+	static gchar *xff_header = "";
+	static gchar *authorization = "";
+	gchar upstream_request[MAX_LINE_LENGTH];
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(service->upstream, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+		service->reason = "Upstream connect failed.";
+		return FALSE;
+	}
+
+	GST_OBJECT_LOCK (self);
+	g_snprintf(upstream_request, sizeof(upstream_request), "GET %s?StreamService=%s HTTP/1.0\r\n%s%s\r\n", self->path, service->service_ref, xff_header, authorization);
+	GST_OBJECT_UNLOCK (self);
+
+	if (safe_write(service->upstream, upstream_request, strlen(upstream_request)) != strlen(upstream_request)) {
+		service->reason = "Failed to issue upstream request.";
+		return FALSE;
+	}
+
+	struct epoll_event event = { .events = EPOLLIN, .data.u64 = EPOLL_TAG (EPOLL_UPSTREAM, service->index) };
+	if (epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, service->upstream, &event) < 0) {
+		service->reason = "Failed to watch upstream socket.";
+		return FALSE;
+	}
+	service->link = LINK_CONNECTED;
+	service->upstream_state = 0;
+	service->response_p = 0;
+
+	GST_DEBUG_OBJECT (self, "service %u upstream request=%s", service->index, upstream_request);
+	return TRUE;
+}
+
+/* tears down a service whose upstream went away and schedules its reconnect, its pids
+ * are released so that other services of a multi-program stream can take them over */
+static void
+gst_dreamtssource_drop_service (GstDreamTsSource * self, TsService * service)
+{
+	static const guint32 no_pids[PID_SET_WORDS];
+
+	GST_WARNING_OBJECT (self, "service %s dropped (%s), reconnecting in %" G_GINT64_FORMAT " ms", service->service_ref, service->reason, service->reconnect_delay / G_TIME_SPAN_MILLISECOND);
+
+	if (service->upstream >= 0)
+		close (service->upstream);
+	service->upstream = -1;
+	gst_dreamtssource_update_pids (self, service, service->demux, no_pids);
+	if (service->demux_fd >= 0)
+		close (service->demux_fd);
+	service->demux_fd = -1;
+
+	service->link = LINK_DISCONNECTED;
+	service->reconnect_at = g_get_monotonic_time () + service->reconnect_delay;
+	service->reconnect_delay = MIN (service->reconnect_delay * 2, RECONNECT_DELAY_MAX);
+	service->discont = TRUE;
+}
+
+/* starts due reconnects and returns the epoll timeout in ms until the next one */
+static int
+gst_dreamtssource_reconnect_services (GstDreamTsSource * self)
+{
+	gint64 now = g_get_monotonic_time ();
+	gint64 timeout = 1000;
+	guint i;
+
+	for (i = 0; i < self->n_services; i++)
+	{
+		TsService *service = &self->services[i];
+		if (service->link != LINK_DISCONNECTED)
+			continue;
+		if (now >= service->reconnect_at)
+		{
+			GST_INFO_OBJECT (self, "reconnecting service %s", service->service_ref);
+			if (gst_dreamtssource_connect_service (self, service))
+				continue;
+			gst_dreamtssource_drop_service (self, service);
+		}
+		timeout = MIN (timeout, (service->reconnect_at - now) / G_TIME_SPAN_MILLISECOND + 1);
+	}
+	return timeout;
+}
+
+/* waits for the initial non-blocking connects, sends the requests and reads the
+ * responses up to the end of the HTTP header, then lets GstBaseSrc start the
+ * streaming task, so a refused request fails the state change */
+static gpointer
+gst_dreamtssource_connect_thread_func (GstDreamTsSource * self)
+{
+	struct epoll_event event, events[MAX_EPOLL_EVENTS];
+	GstFlowReturn ret = GST_FLOW_OK;
+	guint i, pending = 0;
+	int ep = epoll_create1 (EPOLL_CLOEXEC);
+
+	event.events = EPOLLIN;
+	event.data.u64 = EPOLL_TAG (EPOLL_CONTROL, 0);
+	if (ep < 0 || epoll_ctl (ep, EPOLL_CTL_ADD, self->control.fd, &event) < 0)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, FAILED, (NULL), GST_ERROR_SYSTEM);
+		ret = GST_FLOW_ERROR;
+	}
+	for (i = 0; ret == GST_FLOW_OK && i < self->n_services; i++)
+	{
+		event.events = EPOLLOUT;
+		event.data.u64 = EPOLL_TAG (EPOLL_UPSTREAM, i);
+		if (epoll_ctl (ep, EPOLL_CTL_ADD, self->services[i].upstream, &event) == 0)
+			pending++;
+	}
+
+	while (pending && ret == GST_FLOW_OK)
+	{
+		int n = epoll_wait (ep, events, MAX_EPOLL_EVENTS, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			GST_ELEMENT_ERROR (self, RESOURCE, FAILED, (NULL), GST_ERROR_SYSTEM);
+			ret = GST_FLOW_ERROR;
+			break;
+		}
+		for (i = 0; i < n && ret == GST_FLOW_OK; i++)
 		{
-			if (handle_upstream(self))
+			if (EPOLL_TAG_KIND (events[i].data.u64) == EPOLL_CONTROL)
+			{
+				if (!(gst_dreamsource_control_take (&self->control) & CONTROL_FLUSHING))
+					continue;
+				GST_DEBUG_OBJECT (self, "flushing while connecting");
+				ret = GST_FLOW_FLUSHING;
 				break;
+			}
+			TsService *service = &self->services[EPOLL_TAG_INDEX (events[i].data.u64)];
+			if (service->link == LINK_CONNECTING)
+			{
+				if (gst_dreamtssource_send_request (self, service))
+				{
+					event.events = EPOLLIN;
+					event.data.u64 = events[i].data.u64;
+					epoll_ctl (ep, EPOLL_CTL_MOD, service->upstream, &event);
+					continue;
+				}
+			}
+			else if (!handle_upstream (self, service))
+			{
+				if (!service->established)
+					continue;
+				GST_DEBUG_OBJECT (self, "service %u established", service->index);
+				epoll_ctl (ep, EPOLL_CTL_DEL, service->upstream, NULL);
+				pending--;
+				continue;
+			}
+			GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL), ("Bad Gateway for %s: %s", service->service_ref, service->reason));
+			ret = GST_FLOW_ERROR;
+		}
+	}
+
+	if (ep >= 0)
+		close (ep);
+	GST_DEBUG_OBJECT (self, "upstream connect finished: %s", gst_flow_get_name (ret));
+	gst_base_src_start_complete (GST_BASE_SRC (self), ret);
+	return NULL;
+}
+
+/* picks the next service with a readable demux after the one served last, so a busy
+ * service can't starve the others of a multi-program stream */
+static TsService *
+gst_dreamtssource_next_ready_service (GstDreamTsSource * self, struct epoll_event * events, int n)
+{
+	TsService *service = NULL;
+	guint best = G_MAXUINT;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		guint index = EPOLL_TAG_INDEX (events[i].data.u64);
+		if (EPOLL_TAG_KIND (events[i].data.u64) != EPOLL_DEMUX || self->services[index].demux_fd < 0)
+			continue;
+		guint distance = (index + self->n_services - self->next_service) % self->n_services;
+		if (distance < best)
+		{
+			best = distance;
+			service = &self->services[index];
 		}
-		if ( G_LIKELY(rfd[1].revents & POLLIN) )
+	}
+	if (service)
+		self->next_service = (service->index + 1) % self->n_services;
+	return service;
+}
+
+static GstFlowReturn
+gst_dreamtssource_create (GstPushSrc * psrc, GstBuffer ** outbuf)
+{
+	GstDreamTsSource *self = GST_DREAMTSSOURCE (psrc);
+	TsService *service = NULL;
+	guint batch_bytes;
+	GstClockTime batch_latency;
+	gboolean reconnect, rewrite_psi;
+	GstClockTime gop_cache_time, stats_interval;
+
+	GST_DEBUG_OBJECT (self, "create");
+
+	GST_OBJECT_LOCK (self);
+	batch_bytes = self->batch_bytes;
+	batch_latency = self->batch_latency;
+	reconnect = self->reconnect;
+	rewrite_psi = self->rewrite_psi;
+	gop_cache_time = self->gop_cache_time;
+	stats_interval = self->stats_interval;
+	GST_OBJECT_UNLOCK (self);
+
+	if ((*outbuf = gst_dreamtssource_replay_buffer (self)))
+		return GST_FLOW_OK;
+
+	while (1)
+	{
+		*outbuf = NULL;
+		if (gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING)
 		{
-			char command;
-			READ_COMMAND (self, command, ret);
-			GST_LOG_OBJECT (self, "CONTROL_STOP!");
+			GST_LOG_OBJECT (self, "flushing");
 			return GST_FLOW_FLUSHING;
 		}
-		if (self->demux_fd > 0 && rfd[2].revents)
+
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+		int i, ret = epoll_wait(self->epoll_fd, events, MAX_EPOLL_EVENTS, gst_dreamtssource_reconnect_services (self));
+
+		if (G_UNLIKELY (ret == -1))
+		{
+			if (errno == EINTR)
+				continue;
+			GST_ERROR_OBJECT (self, "EPOLL ERROR!");
+			break;
+		}
+
+		gst_dreamtssource_update_stats (self, stats_interval);
+
+		if ( ret == 0 )
+		{
+			GST_LOG_OBJECT (self, "EPOLL TIMEOUT");
+			continue;
+		}
+
+		for (i = 0; i < ret; i++)
+		{
+			guint64 tag = events[i].data.u64;
+			if (EPOLL_TAG_KIND (tag) == EPOLL_CONTROL)
+			{
+				if (!(gst_dreamsource_control_take (&self->control) & CONTROL_FLUSHING))
+					continue;
+				GST_LOG_OBJECT (self, "flushing");
+				return GST_FLOW_FLUSHING;
+			}
+			if (EPOLL_TAG_KIND (tag) == EPOLL_UPSTREAM)
+			{
+				service = &self->services[EPOLL_TAG_INDEX (tag)];
+				int failed = service->link == LINK_CONNECTING ? !gst_dreamtssource_send_request (self, service) : handle_upstream(self, service);
+				if (failed == 1 && reconnect && service->established)
+					gst_dreamtssource_drop_service (self, service);
+				else if (failed)
+					goto upstream_error;
+			}
+		}
+
+		if (!(service = gst_dreamtssource_next_ready_service (self, events, ret)))
+			continue;
+#if GST_CHECK_VERSION(1,14,0)
+		if (batch_bytes)
 		{
-			unsigned char buffer[BSIZE];
-			int r = read(self->demux_fd, buffer, BSIZE);
-			if (r < 0) {
-				if (errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == EOVERFLOW)
+			GstBufferList *list = gst_buffer_list_new_sized (MAX_BATCH_CHUNKS);
+			gssize r = gst_dreamtssource_read_batch (self, service, batch_bytes, batch_latency, rewrite_psi, list);
+			if (r <= 0) {
+				gst_buffer_list_unref (list);
+				if (r == 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == EOVERFLOW)
 					continue;
 				break;
 			}
-			*outbuf = gst_buffer_ref(gst_buffer_new_wrapped (buffer, r));
+			/* all chunks read were garbage or partial packets */
+			if (gst_buffer_list_length (list) == 0)
+			{
+				gst_buffer_list_unref (list);
+				continue;
+			}
+			if (service->discont)
+			{
+				GST_BUFFER_FLAG_SET (gst_buffer_list_get (list, 0), GST_BUFFER_FLAG_DISCONT);
+				service->discont = FALSE;
+			}
+			/* check_packets may have flagged any chunk of the batch DISCONT, each gets the PSI */
+			for (i = 0; i < gst_buffer_list_length (list); i++)
+			{
+				gst_dreamtssource_inject_psi (self, gst_buffer_list_get (list, i));
+				gst_dreamtssource_cache_buffer (self, service, gst_buffer_list_get (list, i), gop_cache_time);
+			}
+			if (gst_buffer_list_length (list) == 1)
+			{
+				*outbuf = gst_buffer_ref (gst_buffer_list_get (list, 0));
+				gst_buffer_list_unref (list);
+				return GST_FLOW_OK;
+			}
+			GST_DEBUG_OBJECT (self, "pushing list of %i buffers from service %u", gst_buffer_list_length (list), service->index);
+			gst_base_src_submit_buffer_list (GST_BASE_SRC (psrc), list);
 			return GST_FLOW_OK;
 		}
+#endif
+		int r = gst_dreamtssource_read_chunk (self, service, rewrite_psi, outbuf);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == EOVERFLOW)
+				continue;
+			break;
+		}
+		if (r == 0)
+			continue;
+		if (service->discont)
+		{
+			GST_BUFFER_FLAG_SET (*outbuf, GST_BUFFER_FLAG_DISCONT);
+			service->discont = FALSE;
+		}
+		gst_dreamtssource_inject_psi (self, *outbuf);
+		gst_dreamtssource_cache_buffer (self, service, *outbuf, gop_cache_time);
+		return GST_FLOW_OK;
 	}
-	GST_ERROR_OBJECT("reason: %s", self->reason);
-	*outbuf = gst_buffer_new();
+	GST_ERROR_OBJECT (self, "streaming failed: %s", g_strerror (errno));
+	return GST_FLOW_ERROR;
+
+upstream_error:
+	GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL), ("service %s: %s", service->service_ref, service->reason));
 	return GST_FLOW_ERROR;
 }
 
@@ -498,58 +2145,130 @@ default:
 	return GST_STATE_CHANGE_SUCCESS;
 }
 
+static void
+gst_dreamtssource_free_services (GstDreamTsSource * self)
+{
+	guint i;
+
+	for (i = 0; i < self->n_services; i++)
+	{
+		TsService *service = &self->services[i];
+		if (service->demux_fd >= 0)
+			close (service->demux_fd);
+		if (service->upstream >= 0)
+			close (service->upstream);
+		g_free (service->service_ref);
+	}
+	g_free (self->services);
+	self->services = NULL;
+	self->n_services = 0;
+}
+
 static gboolean
 gst_dreamtssource_start (GstBaseSrc * bsrc)
 {
 	GstDreamTsSource *self = GST_DREAMTSSOURCE (bsrc);
+	gchar **srefs;
+	guint i, demux_buffer_size;
 	
 	GST_DEBUG_OBJECT (self, "start");
 	
-	int control_sock[2];
-	if (socketpair (PF_UNIX, SOCK_STREAM, 0, control_sock) < 0)
+	if (!gst_dreamsource_control_init (&self->control))
 	{
 		GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ_WRITE, (NULL), GST_ERROR_SYSTEM);
 		return FALSE;
 	}
-	READ_SOCKET (self) = control_sock[0];
-	WRITE_SOCKET (self) = control_sock[1];
-	fcntl (READ_SOCKET (self), F_SETFL, O_NONBLOCK);
-	fcntl (WRITE_SOCKET (self), F_SETFL, O_NONBLOCK);
-	
-	static gchar *xff_header = "";
-	static gchar *authorization = "";
-	gchar upstream_request[256];
-	
-	self->upstream = socket(PF_INET, SOCK_STREAM, 0);
-	if (self->upstream < 0) {
-		self->reason = "Failed to create socket.";
-		goto bad_gateway;
+
+	self->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	struct epoll_event event = { .events = EPOLLIN, .data.u64 = EPOLL_TAG (EPOLL_CONTROL, 0) };
+	if (self->epoll_fd < 0 || epoll_ctl (self->epoll_fd, EPOLL_CTL_ADD, self->control.fd, &event) < 0)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ_WRITE, (NULL), GST_ERROR_SYSTEM);
+		return FALSE;
 	}
-	
-	struct sockaddr_in sin;
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(80);
-	sin.sin_addr.s_addr = inet_addr("127.0.0.1");
-	if (connect(self->upstream, (struct sockaddr*)&sin, sizeof(struct sockaddr_in)))
+
+	gst_dreamtssource_reset_pcr (self);
+
+	if (!gst_dreamtssource_start_pool (self))
 	{
-		self->reason = "Upstream connect failed.";
-		goto bad_gateway;
+		GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT, (NULL), ("can't allocate demux buffer pool"));
+		return FALSE;
 	}
 
-	g_snprintf(upstream_request, sizeof(upstream_request), "GET /web/stream?StreamService=%s HTTP/1.0\r\n%s%s\r\n", self->service_ref, xff_header, authorization);
+	GST_OBJECT_LOCK (self);
+	srefs = g_strsplit (self->service_ref ? self->service_ref : "", ";", -1);
+	demux_buffer_size = MAX (self->demux_buffer_size, MIN_DEMUX_BUFFER_SIZE);
+	GST_OBJECT_UNLOCK (self);
 
-	if (safe_write(self->upstream, upstream_request, strlen(upstream_request)) != strlen(upstream_request)) {
-		self->reason = "Failed to issue upstream request.";
-		goto bad_gateway;
+	self->services = g_new0 (TsService, g_strv_length (srefs));
+	self->n_services = 0;
+	self->next_service = 0;
+	for (i = 0; srefs[i]; i++)
+	{
+		gchar *sref = g_strstrip (srefs[i]);
+		if (!*sref)
+			continue;
+		TsService *service = &self->services[self->n_services];
+		service->service_ref = g_strdup (sref);
+		service->index = self->n_services++;
+		service->reason = "";
+		service->upstream = -1;
+		service->demux_fd = -1;
+		service->demux_buffer_size = demux_buffer_size;
+		service->reconnect_delay = RECONNECT_DELAY_MIN;
+		service->pmt_pid = -1;
+		service->video_pid = -1;
+		gchar **fields = g_strsplit (sref, ":", 5);
+		if (g_strv_length (fields) >= 4)
+			service->sid = strtoul (fields[3], NULL, 16);
+		g_strfreev (fields);
+	}
+	self->pat_valid = FALSE;
+	self->psi_pending = TRUE;
+	memset(self->cc, CC_UNKNOWN, sizeof(self->cc));
+	GST_OBJECT_LOCK (self);
+	memset(&self->stats, 0, sizeof(self->stats));
+	self->stats.demux_buffer_size = demux_buffer_size;
+	self->pid_stats = g_new0 (TsPidStats, TS_MAX_PID + 1);
+	GST_OBJECT_UNLOCK (self);
+	self->rate_window_start = g_get_monotonic_time ();
+	g_strfreev (srefs);
+
+	if (self->n_services == 0)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, (NULL), ("no service reference set"));
+		gst_dreamtssource_stop (bsrc);
+		return FALSE;
+	}
+
+	if (!gst_dreamtssource_resolve (self))
+	{
+		gst_dreamtssource_stop (bsrc);
+		return FALSE;
+	}
+
+	for (i = 0; i < self->n_services; i++)
+	{
+		TsService *service = &self->services[i];
+		if (!gst_dreamtssource_connect_service (self, service))
+		{
+			GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL), ("Bad Gateway for %s: %s", service->service_ref, service->reason));
+			gst_dreamtssource_stop (bsrc);
+			return FALSE;
+		}
+	}
+
+	/* the connects complete in the background, the streaming task starts once all requests are out */
+	self->connectthread = g_thread_try_new ("dreamtssrc-connect", (GThreadFunc) gst_dreamtssource_connect_thread_func, self, NULL);
+	if (!self->connectthread)
+	{
+		GST_ELEMENT_ERROR (self, RESOURCE, FAILED, (NULL), ("can't start upstream connect thread"));
+		gst_dreamtssource_stop (bsrc);
+		return FALSE;
 	}
 	
-	GST_DEBUG_OBJECT (self, "started! upstream request=%s", upstream_request);
-	
+	GST_DEBUG_OBJECT (self, "connecting %u service(s) to %s", self->n_services, self->host);
 	return TRUE;
-
-bad_gateway:
-	GST_ERROR_OBJECT("Bad Gateway: %s", self->reason);
-	return FALSE;
 }
 
 static gboolean
@@ -557,6 +2276,24 @@ gst_dreamtssource_stop (GstBaseSrc * bsrc)
 {
 	GstDreamTsSource *self = GST_DREAMTSSOURCE (bsrc);
 	GST_DEBUG_OBJECT (self, "stop");
+	if (self->connectthread)
+	{
+		g_thread_join (self->connectthread);
+		self->connectthread = NULL;
+	}
+	gst_dreamtssource_clear_gop_cache (self);
+	gst_dreamtssource_free_services (self);
+	GST_OBJECT_LOCK (self);
+	g_free (self->pid_stats);
+	self->pid_stats = NULL;
+	GST_OBJECT_UNLOCK (self);
+	if (self->epoll_fd >= 0)
+	{
+		close (self->epoll_fd);
+		self->epoll_fd = -1;
+	}
+	gst_dreamtssource_stop_pool (self);
+	gst_dreamsource_control_clear (&self->control);
 	return TRUE;
 }
 
@@ -564,6 +2301,14 @@ static void
 gst_dreamtssource_dispose (GObject * gobject)
 {
 	GstDreamTsSource *self = GST_DREAMTSSOURCE (gobject);
+	g_free (self->service_ref);
+	self->service_ref = NULL;
+	g_free (self->host);
+	self->host = NULL;
+	g_free (self->path);
+	self->path = NULL;
+	g_free (self->demux_device);
+	self->demux_device = NULL;
 	g_mutex_clear (&self->mutex);
 	GST_DEBUG_OBJECT (self, "disposed");
 	G_OBJECT_CLASS (parent_class)->dispose (gobject);
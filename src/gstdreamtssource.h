@@ -22,14 +22,78 @@
 #include "gstdreamsource.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <linux/dvb/dmx.h>
 #include <linux/dvb/version.h>
 
-#define MAX_PIDS 32
 #define MAX_LINE_LENGTH 512
 
 #define BSIZE                    32712
+#define TS_PACKET_SIZE           188
+
+#define DEFAULT_CHUNK_SIZE       BSIZE
+#define MAX_CHUNK_SIZE           (TS_PACKET_SIZE*4096)
+#define MIN_POOL_BUFFERS         4
+#define MAX_BATCH_CHUNKS         64
+
+#define DEFAULT_BATCH_BYTES      0
+#define DEFAULT_BATCH_LATENCY    0
+#define DEFAULT_PCR_PID          -1
+#define DEFAULT_HOST             "127.0.0.1"
+#define DEFAULT_PORT             80
+#define DEFAULT_PATH             "/web/stream"
+#define DEFAULT_DEMUX_DEVICE     "/dev/dvb/adapter0/demux"
+#define DEFAULT_RECONNECT        TRUE
+#define DEFAULT_REWRITE_PSI      FALSE
+#define DEFAULT_GOP_CACHE_TIME   0
+#define DEFAULT_DEMUX_BUFFER_SIZE     (1024*1024)
+#define DEFAULT_MAX_DEMUX_BUFFER_SIZE (8*1024*1024)
+#define MIN_DEMUX_BUFFER_SIZE    (64*1024)
+#define MAX_DEMUX_BUFFER_SIZE    (64*1024*1024)
+#define DEFAULT_STATS_INTERVAL   0
+#define STATS_RATE_WINDOW        GST_SECOND
+
+#define GOP_CACHE_MAX_BYTES      (16*1024*1024)
+
+#define CC_UNKNOWN               0xFF
+#define TS_SYNC_CONFIRMED(data, size, pos) \
+	(((pos) + TS_PACKET_SIZE >= (size) || (data)[(pos) + TS_PACKET_SIZE] == TS_SYNC_BYTE) && \
+	 ((pos) + 2*TS_PACKET_SIZE >= (size) || (data)[(pos) + 2*TS_PACKET_SIZE] == TS_SYNC_BYTE))
+
+#define STREAM_TYPE_MPEG2        0x02
+#define STREAM_TYPE_H264         0x1B
+#define STREAM_TYPE_H265         0x24
+
+#define RECONNECT_DELAY_MIN      (500 * G_TIME_SPAN_MILLISECOND)
+#define RECONNECT_DELAY_MAX      (30 * G_TIME_SPAN_SECOND)
+
+#define TS_SYNC_BYTE             0x47
+#define TS_MAX_PID               0x1FFF
+#define PID_SET_WORDS            ((TS_MAX_PID + 1) / 32)
+#define PID_SET_ADD(set, pid)    ((set)[(pid) >> 5] |= 1U << ((pid) & 31))
+#define PID_SET_REMOVE(set, pid) ((set)[(pid) >> 5] &= ~(1U << ((pid) & 31)))
+#define PID_SET_HAS(set, pid)    ((set)[(pid) >> 5] & (1U << ((pid) & 31)))
+
+#define MAX_EPOLL_EVENTS         16
+
+#define PAT_MIN_SECTION_LENGTH   9
+#define PMT_MIN_SECTION_LENGTH   13
+#define SECTION_SPANS_PACKETS    -2
+
+typedef enum {
+	EPOLL_CONTROL = 0,
+	EPOLL_UPSTREAM,
+	EPOLL_DEMUX,
+} EpollKind;
+
+#define EPOLL_TAG(kind, index)   (((guint64) (index) << 2) | (kind))
+#define EPOLL_TAG_KIND(tag)      ((EpollKind) ((tag) & 3))
+#define EPOLL_TAG_INDEX(tag)     ((guint) ((tag) >> 2))
+#define MAX_PCR_GAP              GST_SECOND
+#define PCR_SMOOTHING            16
 
 #if DVB_API_VERSION < 5
 #define DMX_ADD_PID              _IO('o', 51)
@@ -56,23 +120,128 @@ G_BEGIN_DECLS
 
 typedef struct _GstDreamTsSource        GstDreamTsSource;
 typedef struct _GstDreamTsSourceClass   GstDreamTsSourceClass;
+typedef struct _TsService               TsService;
+typedef struct _TsStats                 TsStats;
+typedef struct _TsPidStats              TsPidStats;
 
-struct _GstDreamTsSource
+typedef enum {
+	LINK_DISCONNECTED = 0,
+	LINK_CONNECTING,   /* non-blocking connect in flight, watching EPOLLOUT */
+	LINK_CONNECTED,    /* request sent, parsing the response */
+} LinkState;
+
+struct _TsStats
+{
+	guint64 packets;
+	guint64 sync_errors;
+	guint64 cc_errors;
+	guint64 tei_errors;
+	guint64 overflows;
+	guint64 wakeups;
+	guint64 reads;
+	guint64 read_bytes;
+	guint demux_buffer_size;  /* largest demux buffer of all services */
+};
+
+struct _TsPidStats
+{
+	guint64 packets;
+	guint64 window_packets;   /* packets at the start of the current rate window */
+	guint packet_rate;        /* packets per second over the last window */
+};
+
+/* one streamed service: its enigma2 control connection and demux */
+struct _TsService
 {
-	GstPushSrc element;
-	
 	gchar *service_ref;
-	GstClockTime base_pts;
-	
-	int active_pids[MAX_PIDS];
+	guint index;
+
 	int upstream;
+	LinkState link;
+	gint64 reconnect_at;      /* monotonic time of the next connect attempt */
+	GTimeSpan reconnect_delay;
+	gboolean established;     /* got a 200 response once, later drops reconnect */
+	gboolean discont;
 	int upstream_state, upstream_response_code;
 	char *reason;
 	char response_line[MAX_LINE_LENGTH];
 	int response_p;
+
+	int demux;
 	int demux_fd;
+	guint demux_buffer_size;
+	guint32 wanted_pids[PID_SET_WORDS];  /* as announced by the upstream */
+	guint32 active_pids[PID_SET_WORDS];  /* filtered on this service's demux */
+
+	guint16 sid;                         /* program number from the service reference */
+	gint pmt_pid;
+	guint8 pmt[TS_PACKET_SIZE];
+	gboolean pmt_valid;
+	gboolean pmt_spans_warned;
+	gint video_pid;
+	guint8 video_type;
+
+	guint8 partial[TS_PACKET_SIZE];      /* head of a packet split across reads */
+	gsize partial_len;
+};
+
+struct _GstDreamTsSource
+{
+	GstPushSrc element;
+	
+	gchar *service_ref;
+	GstClockTime base_pts;
+	
+	TsService *services;
+	guint n_services;
+	guint next_service;
+	int epoll_fd;
+
+	gchar *host;
+	guint port;
+	gchar *path;
+	gchar *demux_device;
+	gboolean reconnect;
+	struct sockaddr_storage upstream_addr;
+	socklen_t upstream_addrlen;
+	GThread *connectthread;
+
+	gboolean rewrite_psi;
+	guint8 pat[TS_PACKET_SIZE];
+	gboolean pat_valid;
+	gboolean psi_pending;
+
+	guint64 gop_cache_time;
+	GQueue gop_cache;
+	gsize gop_cache_bytes;
+	GList *gop_replay;
+	GstClockTime gop_replay_pts;
+	volatile gint gop_replay_pending;
+
+	guint8 cc[TS_MAX_PID + 1];
+	TsStats stats;
+	TsPidStats *pid_stats;               /* TS_MAX_PID + 1 entries while started */
+	guint demux_buffer_size;
+	guint max_demux_buffer_size;
+	guint64 stats_interval;
+	gint64 rate_window_start;
+
+	guint chunk_size;
+	guint batch_bytes;
+	guint64 batch_latency;
+	GstBufferPool *pool;
+
+	gint pcr_pid;
+	gint detected_pcr_pid;
+	TimestampUnwrapper pcr_unwrapper;
+	GstClockTime last_pcr;
+	guint64 bytes_since_pcr;
+	gdouble ns_per_byte;
+	gint64 pcr_offset;
+	gboolean pcr_offset_valid;
+	GstClockTime last_pts;
 
-	int control_sock[2];
+	ControlChannel control;
 	GMutex mutex;
 };
 
@@ -80,6 +249,7 @@ struct _GstDreamTsSourceClass
 {
 	GstPushSrcClass parent_class;
 	gint64 (*get_base_pts) (GstDreamTsSource *self);
+	void (*replay_gop_cache) (GstDreamTsSource *self);
 };
 
 GType gst_dreamtssource_get_type (void);
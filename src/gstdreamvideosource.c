@@ -62,6 +62,11 @@ enum
 	ARG_PFRAMES,
 	ARG_SLICES,
 	ARG_LEVEL,
+	ARG_BUFFER_LIST,
+	ARG_MAX_SIZE_BUFFERS,
+	ARG_MAX_SIZE_BYTES,
+	ARG_MAX_SIZE_TIME,
+	ARG_LOW_LATENCY,
 };
 
 static guint gst_dreamvideosource_signals[LAST_SIGNAL] = { 0 };
@@ -78,6 +83,11 @@ static guint gst_dreamvideosource_signals[LAST_SIGNAL] = { 0 };
 #define DEFAULT_HEIGHT      720
 #define DEFAULT_INPUT_MODE  GST_DREAMVIDEOSOURCE_INPUT_MODE_LIVE
 #define DEFAULT_BUFFER_SIZE 50
+#define MAX_BUFFER_SIZE     4096    /* the ring holds twice as many for keyframes */
+#define DEFAULT_BUFFER_LIST FALSE
+#define DEFAULT_MAX_SIZE_BYTES 0
+#define DEFAULT_MAX_SIZE_TIME  0
+#define DEFAULT_LOW_LATENCY FALSE
 
 static GstStaticPadTemplate srctemplate =
     GST_STATIC_PAD_TEMPLATE ("src",
@@ -89,6 +99,7 @@ static GstStaticPadTemplate srctemplate =
 	"framerate = { 25/1, 30/1, 50/1, 60/1 }, "
 	"display-aspect-ratio = { 5/4, 16/9 }, "
 	"stream-format = (string) byte-stream, "
+	"alignment = (string) { au, nal }, "
 	"profile = (string) { main, high }")
     );
 
@@ -114,7 +125,9 @@ static gint64 gst_dreamvideosource_get_dts_offset (GstDreamVideoSource *self);
 static gboolean gst_dreamvideosource_encoder_init (GstDreamVideoSource * self);
 static void gst_dreamvideosource_encoder_release (GstDreamVideoSource * self);
 
-static void gst_dreamvideosource_read_thread_func (GstDreamVideoSource * self);
+static void gst_dreamvideosource_encoder_cb (GstDreamVideoSource * self, guint32 events);
+static void gst_dreamvideosource_control_cb (GstDreamVideoSource * self, guint32 events);
+static void gst_dreamvideosource_memory_released (GstDreamVideoSource * self);
 
 #ifdef PROVIDE_CLOCK
 static GstClock *gst_dreamvideosource_provide_clock (GstElement * elem);
@@ -213,6 +226,31 @@ gst_dreamvideosource_class_init (GstDreamVideoSourceClass * klass)
 	    GST_TYPE_DREAMVIDEOSOURCE_INPUT_MODE, DEFAULT_INPUT_MODE,
 	    G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+	g_object_class_install_property (gobject_class, ARG_BUFFER_LIST,
+	  g_param_spec_boolean ("buffer-list", "Buffer List",
+	    "Push all queued frames downstream at once as a buffer list", DEFAULT_BUFFER_LIST,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_MAX_SIZE_BUFFERS,
+	  g_param_spec_uint ("max-size-buffers", "Max. size (buffers)",
+	    "Max. number of frames queued before newly read frames are dropped up to the next keyframe (can't be raised beyond the value it had at the start while running)", 1, MAX_BUFFER_SIZE, DEFAULT_BUFFER_SIZE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_MAX_SIZE_BYTES,
+	  g_param_spec_uint ("max-size-bytes", "Max. size (bytes)",
+	    "Max. amount of data queued before newly read frames are dropped up to the next keyframe (0=disable)", 0, G_MAXUINT, DEFAULT_MAX_SIZE_BYTES,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_MAX_SIZE_TIME,
+	  g_param_spec_uint64 ("max-size-time", "Max. size (ns)",
+	    "Max. timespan queued before newly read frames are dropped up to the next keyframe (0=disable)", 0, G_MAXUINT64, DEFAULT_MAX_SIZE_TIME,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, ARG_LOW_LATENCY,
+	  g_param_spec_boolean ("low-latency", "Low Latency",
+	    "Prefer alignment=nal and push every slice as soon as it's read (use with slices > 1, the last slice of a picture is marked once all slices were read)", DEFAULT_LOW_LATENCY,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 	gst_dreamvideosource_signals[SIGNAL_GET_DTS_OFFSET] =
 		g_signal_new ("get-dts-offset",
 		G_TYPE_FROM_CLASS (klass),
@@ -226,8 +264,12 @@ gst_dreamvideosource_class_init (GstDreamVideoSourceClass * klass)
 static gint64
 gst_dreamvideosource_get_dts_offset (GstDreamVideoSource *self)
 {
-	GST_DEBUG_OBJECT (self, "gst_dreamvideosource_get_dts_offset %" GST_TIME_FORMAT"", GST_TIME_ARGS (self->dts_offset) );
-	return self->dts_offset;
+	gint64 dts_offset;
+	GST_OBJECT_LOCK (self);
+	dts_offset = self->dts_offset;
+	GST_OBJECT_UNLOCK (self);
+	GST_DEBUG_OBJECT (self, "gst_dreamvideosource_get_dts_offset %" GST_TIME_FORMAT"", GST_TIME_ARGS (dts_offset) );
+	return dts_offset;
 }
 
 static void gst_dreamvideosource_set_bitrate (GstDreamVideoSource * self, uint32_t bitrate)
@@ -561,18 +603,28 @@ gst_dreamvideosource_init (GstDreamVideoSource * self)
 	self->new_caps = NULL;
 
 	self->dts_valid = FALSE;
+	gst_dreamsource_unwrapper_init (&self->dts_unwrapper, MPEGTIME_BITS);
 	self->encoder = NULL;
 	self->descriptors_available = 0;
 	self->input_mode = DEFAULT_INPUT_MODE;
 
 	self->buffer_size = DEFAULT_BUFFER_SIZE;
-	g_queue_init (&self->current_frames);
-	self->readthread = NULL;
+	self->max_size_bytes = DEFAULT_MAX_SIZE_BYTES;
+	self->max_size_time = DEFAULT_MAX_SIZE_TIME;
+	self->low_latency = DEFAULT_LOW_LATENCY;
+	self->nal_alignment = FALSE;
+	self->buffer_list = DEFAULT_BUFFER_LIST;
+	self->current_frames = NULL;
+	self->encoder_watch = NULL;
+	self->control_watch = NULL;
+	self->au = NULL;
+	self->run_length = 0;
 
 	g_mutex_init (&self->mutex);
-	g_cond_init (&self->cond);
-	READ_SOCKET (self) = -1;
-	WRITE_SOCKET (self) = -1;
+	g_cond_init (&self->release_cond);
+	self->release_pending = FALSE;
+	self->control.word = READTHREADSTATE_NONE;
+	self->control.fd = -1;
 
 	gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
 	gst_base_src_set_live (GST_BASE_SRC (self), TRUE);
@@ -596,6 +648,8 @@ static gboolean gst_dreamvideosource_encoder_init (GstDreamVideoSource * self)
 		return FALSE;
 	}
 
+	self->encoder->memtracker = NULL;
+
 	char fn_buf[32];
 	sprintf(fn_buf, "/dev/venc%d", 0);
 	self->encoder->fd = open(fn_buf, O_RDWR | O_SYNC);
@@ -620,16 +674,14 @@ static gboolean gst_dreamvideosource_encoder_init (GstDreamVideoSource * self)
 		return FALSE;
 	}
 
-	int control_sock[2];
-	if (socketpair (PF_UNIX, SOCK_STREAM, 0, control_sock) < 0)
+	/* the memory tracker is sized from the queue depth when going to PAUSED */
+	self->descriptors_stalled = FALSE;
+
+	if (!gst_dreamsource_control_init (&self->control))
 	{
-		GST_ERROR_OBJECT(self, "cannot create control sockets: %s (%i)", strerror(errno), errno);
+		GST_ERROR_OBJECT(self, "cannot create control channel");
 		return FALSE;
 	}
-	READ_SOCKET (self) = control_sock[0];
-	WRITE_SOCKET (self) = control_sock[1];
-	fcntl (READ_SOCKET (self), F_SETFL, O_NONBLOCK);
-	fcntl (WRITE_SOCKET (self), F_SETFL, O_NONBLOCK);
 
 	gst_dreamvideosource_set_bitrate (self, self->video_info.bitrate);
 	gst_dreamvideosource_set_goplen(self, self->video_info.gop_length);
@@ -656,13 +708,15 @@ static void gst_dreamvideosource_encoder_release (GstDreamVideoSource * self)
 			munmap(self->encoder->cdb, VMMAPSIZE);
 		if (self->encoder->fd)
 			close(self->encoder->fd);
+		if (self->encoder->memtracker)
+		{
+			gst_dreamsource_memtracker_set_notify (self->encoder->memtracker, NULL, NULL);
+			gst_dreamsource_memtracker_unref (self->encoder->memtracker);
+		}
 		free(self->encoder);
 	}
 	self->encoder = NULL;
-	close (READ_SOCKET (self));
-	close (WRITE_SOCKET (self));
-	READ_SOCKET (self) = -1;
-	WRITE_SOCKET (self) = -1;
+	gst_dreamsource_control_clear (&self->control);
 	if (self->encoder_clock) {
 		gst_object_unref (self->encoder_clock);
 		self->encoder_clock = NULL;
@@ -710,6 +764,38 @@ gst_dreamvideosource_set_property (GObject * object, guint prop_id, const GValue
 		case ARG_LEVEL:
 			gst_dreamvideosource_set_level(self, g_value_get_int (value));
 			break;
+		case ARG_BUFFER_LIST:
+			g_mutex_lock (&self->mutex);
+			self->buffer_list = g_value_get_boolean (value);
+			g_mutex_unlock (&self->mutex);
+			break;
+		case ARG_MAX_SIZE_BUFFERS:
+		{
+			guint buffer_size = g_value_get_uint (value);
+			g_mutex_lock (&self->mutex);
+			/* the ring and the tracker are sized when going to PAUSED */
+			if (self->queue_capacity && buffer_size > self->queue_capacity)
+				GST_WARNING_OBJECT (self, "can't raise max-size-buffers to %u while running, only %u frames were allocated", buffer_size, self->queue_capacity);
+			else
+				self->buffer_size = buffer_size;
+			g_mutex_unlock (&self->mutex);
+			break;
+		}
+		case ARG_MAX_SIZE_BYTES:
+			g_mutex_lock (&self->mutex);
+			self->max_size_bytes = g_value_get_uint (value);
+			g_mutex_unlock (&self->mutex);
+			break;
+		case ARG_MAX_SIZE_TIME:
+			g_mutex_lock (&self->mutex);
+			self->max_size_time = g_value_get_uint64 (value);
+			g_mutex_unlock (&self->mutex);
+			break;
+		case ARG_LOW_LATENCY:
+			g_mutex_lock (&self->mutex);
+			self->low_latency = g_value_get_boolean (value);
+			g_mutex_unlock (&self->mutex);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -752,6 +838,21 @@ gst_dreamvideosource_get_property (GObject * object, guint prop_id, GValue * val
 		case ARG_LEVEL:
 			g_value_set_int(value, self->video_info.level);
 			break;
+		case ARG_BUFFER_LIST:
+			g_value_set_boolean(value, self->buffer_list);
+			break;
+		case ARG_MAX_SIZE_BUFFERS:
+			g_value_set_uint(value, self->buffer_size);
+			break;
+		case ARG_MAX_SIZE_BYTES:
+			g_value_set_uint(value, self->max_size_bytes);
+			break;
+		case ARG_MAX_SIZE_TIME:
+			g_value_set_uint64(value, self->max_size_time);
+			break;
+		case ARG_LOW_LATENCY:
+			g_value_set_boolean(value, self->low_latency);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -857,6 +958,9 @@ gst_dreamvideosource_setcaps (GstBaseSrc * bsrc, GstCaps * caps)
 			else
 				GST_WARNING_OBJECT (self, "unknown profile '%s' in caps... set main profile");
 
+			self->nal_alignment = !g_strcmp0 (gst_structure_get_string (structure, "alignment"), "nal");
+			GST_DEBUG_OBJECT (self, "output %s aligned buffers", self->nal_alignment ? "nal" : "au");
+
 			gst_caps_replace (&self->current_caps, caps);
 
 			g_mutex_unlock (&self->mutex);
@@ -893,6 +997,8 @@ gst_dreamvideosource_fixate (GstBaseSrc * bsrc, GstCaps * caps)
 		gst_structure_fixate_field_nearest_fraction (structure, "framerate", DEFAULT_FRAMERATE, 1);
 	if (gst_structure_has_field (structure, "display-aspect-ratio"))
 		gst_structure_fixate_field_nearest_fraction (structure, "display-aspect-ratio", DEFAULT_WIDTH, DEFAULT_HEIGHT);
+	if (gst_structure_has_field (structure, "alignment"))
+		gst_structure_fixate_field_string (structure, "alignment", self->low_latency ? "nal" : "au");
 
 	caps = GST_BASE_SRC_CLASS (parent_class)->fixate (bsrc, caps);
 	GST_DEBUG_OBJECT (self, "fixated caps: %" GST_PTR_FORMAT, caps);
@@ -934,13 +1040,11 @@ static gboolean gst_dreamvideosource_unlock (GstBaseSrc * bsrc)
 {
 	GstDreamVideoSource *self = GST_DREAMVIDEOSOURCE (bsrc);
 	GST_DEBUG_OBJECT (self, "stop creating buffers");
-	g_mutex_lock (&self->mutex);
-	self->flushing = TRUE;
+	gst_dreamsource_control_set_flags (&self->control, CONTROL_FLUSHING);
 	GST_DEBUG_OBJECT (self, "set flushing TRUE");
-	g_cond_signal (&self->cond);
-	GST_DEBUG_OBJECT (self, "post cond");
-	g_mutex_unlock (&self->mutex);
-	GST_DEBUG_OBJECT (self, "post unlock");
+	if (self->current_frames)
+		gst_dreamsource_frame_ring_wakeup (self->current_frames);
+	GST_DEBUG_OBJECT (self, "post wakeup");
 	return TRUE;
 }
 
@@ -948,344 +1052,583 @@ static gboolean gst_dreamvideosource_unlock_stop (GstBaseSrc * bsrc)
 {
 	GstDreamVideoSource *self = GST_DREAMVIDEOSOURCE (bsrc);
 	GST_DEBUG_OBJECT (self, "stop flushing...");
-	g_mutex_lock (&self->mutex);
-	self->flushing = FALSE;
-	g_queue_foreach (&self->current_frames, (GFunc) gst_buffer_unref, NULL);
-	g_queue_clear (&self->current_frames);
-	g_mutex_unlock (&self->mutex);
+	gst_dreamsource_control_clear_flags (&self->control, CONTROL_FLUSHING);
+	if (self->current_frames)
+		gst_dreamsource_frame_ring_clear (self->current_frames, (GDestroyNotify) gst_buffer_unref);
 	return TRUE;
 }
 
-static void gst_dreamvideosource_read_thread_func (GstDreamVideoSource * self)
+static void gst_dreamvideosource_memory_released (GstDreamVideoSource * self)
+{
+	/* called with the tracker lock held from whichever thread frees the buffer */
+	if (g_atomic_int_get (&self->descriptors_stalled))
+		gst_dreamsource_control_set_flags (&self->control, CONTROL_WAKEUP);
+}
+
+/* descriptors which follow each other in the cdb share one memory, more than
+ * GST_BUFFER_MEM_MAX memories would get merged into a copy by the core */
+static void gst_dreamvideosource_append_run (GstDreamVideoSource * self, GstBuffer * au)
 {
 	EncoderInfo *enc = self->encoder;
-	GstDreamSourceReadthreadState state = READTHREADSTATE_NONE;
-	GstBuffer *readbuf;
 
-	if (!enc) {
-		GST_WARNING_OBJECT (self, "encoder device not opened!");
+	if (!self->run_length)
 		return;
+	if (G_UNLIKELY (gst_buffer_n_memory (au) == GST_BUFFER_MEM_MAX))
+		GST_WARNING_OBJECT (self, "access unit spans more than %i memories, it will be copied", GST_BUFFER_MEM_MAX);
+	gst_buffer_append_memory (au, gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY, enc->cdb, VMMAPSIZE, self->run_offset, self->run_length, self->run_entry, (GDestroyNotify) gst_dreamsource_memtracker_release));
+	self->run_length = 0;
+}
+
+static void gst_dreamvideosource_drop_au (GstDreamVideoSource * self)
+{
+	if (self->run_length)
+		gst_dreamsource_memtracker_release (self->run_entry);
+	self->run_length = 0;
+	if (self->au)
+		gst_buffer_unref (self->au);
+	self->au = NULL;
+	self->au_skipped = FALSE;
+}
+
+/* H.264 access units begin with an AUD, or with parameter sets, SEI or the first
+ * slice of a picture once the previous one has slice data */
+static gboolean gst_dreamvideosource_starts_au (GstDreamVideoSource * self, VideoBufferDescriptor * desc, gboolean au_vcl, gboolean * vcl)
+{
+	const guint8 *data = self->encoder->cdb + desc->stCommon.uiOffset;
+	guint len = desc->stCommon.uiLength, pos;
+	guint8 nal_type;
+
+	*vcl = FALSE;
+	if (!(desc->uiVideoFlags & VBD_FLAG_DATA_UNIT_START))
+		return FALSE;
+	for (pos = 0; pos + 3 < len && data[pos] == 0; pos++)
+		if (data[pos + 1] == 0 && data[pos + 2] == 1)
+			break;
+	if (pos + 4 >= len || data[pos] != 0 || data[pos + 1] != 0 || data[pos + 2] != 1)
+		return FALSE;
+
+	nal_type = data[pos + 3] & 0x1f;
+	switch (nal_type) {
+		case H264_NAL_AUD:
+			return TRUE;
+		case H264_NAL_SEI:
+		case H264_NAL_SPS:
+		case H264_NAL_PPS:
+			return au_vcl;
+		case H264_NAL_SLICE:
+		case H264_NAL_SLICE_DPA:
+		case H264_NAL_SLICE_IDR:
+			*vcl = TRUE;
+			/* first_mb_in_slice is 0, ue(v) codes that as a single 1 bit */
+			return au_vcl && (data[pos + 4] & 0x80);
+		case H264_NAL_SLICE_DPB:
+		case H264_NAL_SLICE_DPC:
+			*vcl = TRUE;
+			return FALSE;
+		default:
+			return FALSE;
 	}
+}
 
-	GST_DEBUG_OBJECT (self, "enter read thread");
+/* hands a completed access unit over to the batch, unless none of its descriptors were usable */
+static void gst_dreamvideosource_finish_au (GstDreamVideoSource * self, GQueue * batch, GstBuffer * au)
+{
+	gst_dreamvideosource_append_run (self, au);
+	if (G_UNLIKELY (gst_buffer_n_memory (au) == 0))
+	{
+		gst_buffer_unref (au);
+		return;
+	}
+	GST_LOG_OBJECT (self, "access unit %" GST_PTR_FORMAT " complete with %u memories", au, gst_buffer_n_memory (au));
+	g_queue_push_tail (batch, au);
+}
 
-	GstMessage *message;
-	GValue val = { 0 };
+/* checked by the read thread only, before queueing a frame */
+static gboolean gst_dreamvideosource_queue_is_full (GstDreamVideoSource * self, guint buffer_size, guint max_size_bytes, guint64 max_size_time)
+{
+	FrameRing *ring = self->current_frames;
+	if (gst_dreamsource_frame_ring_length (ring) >= buffer_size)
+		return TRUE;
+	if (max_size_bytes && gst_dreamsource_frame_ring_bytes (ring) >= max_size_bytes)
+		return TRUE;
+	if (max_size_time && gst_dreamsource_frame_ring_duration (ring) >= max_size_time)
+		return TRUE;
+	return FALSE;
+}
 
-	message = gst_message_new_stream_status (GST_OBJECT_CAST (self), GST_STREAM_STATUS_TYPE_ENTER, GST_ELEMENT_CAST (GST_OBJECT_PARENT(self)));
-	g_value_init (&val, GST_TYPE_G_THREAD);
-	g_value_set_boxed (&val, self->readthread);
-	gst_message_set_stream_status_object (message, &val);
-	g_value_unset (&val);
-	GST_DEBUG_OBJECT (self, "posting ENTER stream status");
-	gst_element_post_message (GST_ELEMENT_CAST (self), message);
-	GstClockTime clock_time, base_time;
-	gboolean discont = TRUE;
+/* called on the reactor thread, arms the encoder watch for whatever the read side waits for next */
+static void gst_dreamvideosource_rearm (GstDreamVideoSource * self)
+{
+	if (CONTROL_STATE (gst_dreamsource_control_get (&self->control)) != READTRREADSTATE_RUNNING)
+	{
+		gst_dreamsource_reactor_modify (self->encoder_watch, 0);
+		gst_dreamsource_reactor_set_timeout (self->encoder_watch, -1);
+	}
+	else if (g_atomic_int_get (&self->descriptors_stalled))
+	{
+		/* wait for downstream to free buffers */
+		gst_dreamsource_reactor_modify (self->encoder_watch, 0);
+		gst_dreamsource_reactor_set_timeout (self->encoder_watch, STALLED_TIMEOUT);
+	}
+	else if (self->descriptors_available == 0)
+	{
+		self->descriptors_count = 0;
+		gst_dreamsource_reactor_modify (self->encoder_watch, EPOLLIN);
+		gst_dreamsource_reactor_set_timeout (self->encoder_watch, ENCODER_TIMEOUT);
+	}
+	else
+	{
+		/* descriptors left over while flushing, retry them later */
+		gst_dreamsource_reactor_modify (self->encoder_watch, 0);
+		gst_dreamsource_reactor_set_timeout (self->encoder_watch, ENCODER_TIMEOUT);
+	}
+}
 
-	while (TRUE) {
-		readbuf = NULL;
-		{
-			if (state == READTHREADSTATE_STOP)
-				goto stop_running;
-
-			struct pollfd rfd[2];
-			int timeout, nfds;
-
-			rfd[0].fd = READ_SOCKET (self);
-			rfd[0].events = POLLIN | POLLERR | POLLHUP | POLLPRI;
-			rfd[1].revents = 0;
-			rfd[1].events = POLLIN;
-			nfds = 1;
-			timeout = 0;
-
-			if (state <= READTRREADSTATE_PAUSED)
-				timeout = 200;
-			else if (state == READTRREADSTATE_RUNNING && self->descriptors_available == 0)
-			{
-				rfd[1].fd = enc->fd;
-				self->descriptors_count = 0;
-				timeout = 200;
-				nfds = 2;
-			}
+static void gst_dreamvideosource_read_error (GstDreamVideoSource * self)
+{
+	GST_DEBUG_OBJECT (self, "stop reading");
+	gst_dreamsource_control_set_state (&self->control, READTHREADSTATE_STOP);
+	gst_dreamvideosource_rearm (self);
+	gst_dreamsource_frame_ring_wakeup (self->current_frames);
+}
 
-			int ret = poll(rfd, nfds, timeout);
+/* returns freed descriptors to the driver and turns the pending ones into queued frames */
+static void gst_dreamvideosource_consume (GstDreamVideoSource * self)
+{
+	EncoderInfo *enc = self->encoder;
+	GstClockTime clock_time = self->clock_time, base_time = self->base_time;
+	gboolean discont = self->discont;
+	gboolean drop_to_keyframe = self->drop_to_keyframe;
+	GstBuffer *au = self->au;
+	gboolean au_skipped = self->au_skipped;
+	gboolean au_vcl = self->au_vcl;
+	guint au_slices = self->au_slices;
+	GstClockTime queued_ts = self->queued_ts;
+	GQueue batch = G_QUEUE_INIT;
+	GstBuffer *readbuf;
 
-			if (G_UNLIKELY (ret == -1))
-			{
-				GST_ERROR_OBJECT (self, "SELECT ERROR!");
-				goto stop_running;
-			}
-			else if ( ret == 0 && self->descriptors_available == 0 )
-			{
-				g_mutex_lock (&self->mutex);
-				gst_clock_get_internal_time(self->encoder_clock);
-				g_mutex_unlock (&self->mutex);
-				GST_DEBUG_OBJECT (self, "SELECT TIMEOUT");
-				discont = TRUE;
-// 				readbuf = gst_buffer_new();
-			}
-			else if ( rfd[0].revents )
-			{
-				char command;
-				READ_COMMAND (self, command, ret);
-				switch (command) {
-					case CONTROL_STOP:
-						GST_DEBUG_OBJECT (self, "CONTROL_STOP!");
-						state = READTHREADSTATE_STOP;
-						break;
-					case CONTROL_PAUSE:
-						GST_DEBUG_OBJECT (self, "CONTROL_PAUSE!");
-						state = READTRREADSTATE_PAUSED;
-						break;
-					case CONTROL_RUN:
-						GST_DEBUG_OBJECT (self, "CONTROL_RUN");
-						state = READTRREADSTATE_RUNNING;
-						break;
-					default:
-						GST_ERROR_OBJECT (self, "illegal control socket command %c received!", command);
-				}
-				continue;
-			}
-			else if ( G_LIKELY(rfd[1].revents & POLLIN) )
-			{
-				int rlen = read(enc->fd, enc->buffer, VBUFSIZE);
-				if (G_UNLIKELY (!self->encoder_clock))
-				{
-					GST_DEBUG_OBJECT(self, "no encoder clock yet... continue");
-					continue;
-				}
-				clock_time = gst_clock_get_internal_time (self->encoder_clock);
-				base_time = gst_element_get_base_time(GST_ELEMENT(self));
-				if (rlen <= 0 || rlen % VBDSIZE ) {
-					if ( errno == 512 )
-						goto stop_running;
-					GST_WARNING_OBJECT (self, "read error %s (%i)", strerror(errno), errno);
-					goto stop_running;
-				}
-				self->descriptors_available = rlen / VBDSIZE;
-				GST_LOG_OBJECT (self, "encoder buffer was empty, %d descriptors available", self->descriptors_available);
-			}
-			if (self->flushing)
-			{
-				g_mutex_lock (&self->mutex);
-				GST_DEBUG_OBJECT (self, "FLUSHING!");
-				g_cond_signal (&self->cond);
-				g_mutex_unlock (&self->mutex);
-				continue;
-			}
+	/* return descriptors to the driver once downstream freed their buffers */
+	unsigned int released = gst_dreamsource_memtracker_pop_released (enc->memtracker);
+	if (released)
+	{
+		GST_LOG_OBJECT (self, "release %i descriptors freed downstream", released);
+		if (write(enc->fd, &released, sizeof(released)) != sizeof(released)) {
+			GST_WARNING_OBJECT (self, "release consumed descs write error!");
+			gst_dreamvideosource_read_error (self);
+			return;
 		}
+	}
 
-		while (self->descriptors_count < self->descriptors_available)
-		{
-			GstClockTime encoder_dts = GST_CLOCK_TIME_NONE;
-			GstClockTime encoder_pts = GST_CLOCK_TIME_NONE;
-			GstClockTime result_dts = GST_CLOCK_TIME_NONE;
-			GstClockTime result_pts = GST_CLOCK_TIME_NONE;
-			gint64 dts_pts_offset;
-			gboolean skip_frame = FALSE;
+	if ((gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING))
+	{
+		GST_DEBUG_OBJECT (self, "FLUSHING!");
+		gst_dreamsource_frame_ring_wakeup (self->current_frames);
+		gst_dreamvideosource_rearm (self);
+		return;
+	}
 
-			off_t offset = self->descriptors_count * VBDSIZE;
-			VideoBufferDescriptor *desc = (VideoBufferDescriptor*)(&enc->buffer[offset]);
+	while (self->descriptors_count < self->descriptors_available)
+	{
+		GstClockTime encoder_dts = GST_CLOCK_TIME_NONE;
+		GstClockTime encoder_pts = GST_CLOCK_TIME_NONE;
+		GstClockTime result_dts = GST_CLOCK_TIME_NONE;
+		GstClockTime result_pts = GST_CLOCK_TIME_NONE;
+		gint64 dts_pts_offset;
+		gboolean skip_frame = FALSE;
 
-			uint32_t f = desc->stCommon.uiFlags;
+		off_t offset = self->descriptors_count * VBDSIZE;
+		VideoBufferDescriptor *desc = (VideoBufferDescriptor*)(&enc->buffer[offset]);
 
-			GST_LOG_OBJECT (self, "descriptors_count=%d, descriptors_available=%d\tuiOffset=%d, uiLength=%d", self->descriptors_count, self->descriptors_available, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+		uint32_t f = desc->stCommon.uiFlags;
 
-			if (G_UNLIKELY (f & CDB_FLAG_METADATA))
+		GST_LOG_OBJECT (self, "descriptors_count=%d, descriptors_available=%d\tuiOffset=%d, uiLength=%d", self->descriptors_count, self->descriptors_available, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+
+		if (G_UNLIKELY (gst_dreamsource_memtracker_is_full (enc->memtracker)))
+		{
+			GST_DEBUG_OBJECT (self, "all %i tracked buffers are still in use downstream, waiting...", enc->memtracker->capacity);
+			g_atomic_int_set (&self->descriptors_stalled, TRUE);
+			break;
+		}
+
+		if (G_UNLIKELY (f & CDB_FLAG_METADATA))
+		{
+			GST_LOG_OBJECT (self, "CDB_FLAG_METADATA... skip outdated packet");
+			while (self->descriptors_count < self->descriptors_available)
 			{
-				GST_LOG_OBJECT (self, "CDB_FLAG_METADATA... skip outdated packet");
-				self->descriptors_count = self->descriptors_available;
-				continue;
+				desc = (VideoBufferDescriptor*)(&enc->buffer[self->descriptors_count * VBDSIZE]);
+				gst_dreamsource_memtracker_skip (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+				self->descriptors_count++;
 			}
+			continue;
+		}
 
-			// uiDTS since kernel driver booted
-			if (f & VBD_FLAG_DTS_VALID && desc->uiDTS)
-			{
-				encoder_dts = MPEGTIME_TO_GSTTIME(desc->uiDTS);
-				GST_LOG_OBJECT (self, "f & VBD_FLAG_DTS_VALID && encoder's uiDTS=%" GST_TIME_FORMAT"", GST_TIME_ARGS(encoder_dts));
+		// uiDTS since kernel driver booted
+		guint64 dts_ticks = 0;
+		if (f & VBD_FLAG_DTS_VALID && desc->uiDTS)
+		{
+			dts_ticks = gst_dreamsource_unwrapper_unwrap (&self->dts_unwrapper, desc->uiDTS);
+			encoder_dts = MPEGTIME_TO_GSTTIME(dts_ticks);
+			GST_LOG_OBJECT (self, "f & VBD_FLAG_DTS_VALID && encoder's uiDTS=%" GST_TIME_FORMAT"", GST_TIME_ARGS(encoder_dts));
 
-				g_mutex_lock (&self->mutex);
-				if (G_UNLIKELY (self->dts_offset == GST_CLOCK_TIME_NONE && self->flushing == FALSE))
+			/* dts_offset is only written here, the lock just guards readers in other threads */
+			if (G_UNLIKELY (self->dts_offset == GST_CLOCK_TIME_NONE && !(gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING)))
+			{
+				gint64 dts_offset = GST_CLOCK_TIME_NONE;
+				if (self->dreamaudiosrc)
 				{
-					if (self->dreamaudiosrc)
-					{
-						guint64 audiosource_dts_offset;
-						g_signal_emit_by_name(self->dreamaudiosrc, "get-dts-offset", &audiosource_dts_offset);
-						if (audiosource_dts_offset != GST_CLOCK_TIME_NONE)
-						{
-							GST_DEBUG_OBJECT (self, "use DREAMAUDIOSOURCE's dts_offset=%" GST_TIME_FORMAT "", GST_TIME_ARGS (audiosource_dts_offset) );
-							self->dts_offset = audiosource_dts_offset;
-						}
-					}
-					else if (self->dts_offset == GST_CLOCK_TIME_NONE)
+					guint64 audiosource_dts_offset;
+					g_signal_emit_by_name(self->dreamaudiosrc, "get-dts-offset", &audiosource_dts_offset);
+					if (audiosource_dts_offset != GST_CLOCK_TIME_NONE)
 					{
-						self->dts_offset = encoder_dts - clock_time;
-						GST_DEBUG_OBJECT (self, "use encoder_dts-clock_time as dts_offset (%" GST_TIME_FORMAT" = %" GST_TIME_FORMAT" - %" GST_TIME_FORMAT")", GST_TIME_ARGS (self->dts_offset), GST_TIME_ARGS (encoder_dts), GST_TIME_ARGS (clock_time));
+						GST_DEBUG_OBJECT (self, "use DREAMAUDIOSOURCE's dts_offset=%" GST_TIME_FORMAT "", GST_TIME_ARGS (audiosource_dts_offset) );
+						dts_offset = audiosource_dts_offset;
 					}
 				}
-				if (G_UNLIKELY (self->dts_valid == FALSE && self->dts_offset != GST_CLOCK_TIME_NONE))
-					self->dts_valid = TRUE;
-				g_mutex_unlock (&self->mutex);
+				else
+				{
+					dts_offset = encoder_dts - clock_time;
+					GST_DEBUG_OBJECT (self, "use encoder_dts-clock_time as dts_offset (%" GST_TIME_FORMAT" = %" GST_TIME_FORMAT" - %" GST_TIME_FORMAT")", GST_TIME_ARGS (dts_offset), GST_TIME_ARGS (encoder_dts), GST_TIME_ARGS (clock_time));
+				}
+				GST_OBJECT_LOCK (self);
+				self->dts_offset = dts_offset;
+				GST_OBJECT_UNLOCK (self);
 			}
+			if (G_UNLIKELY (!g_atomic_int_get (&self->dts_valid) && self->dts_offset != GST_CLOCK_TIME_NONE))
+				g_atomic_int_set (&self->dts_valid, TRUE);
+		}
 
-			g_mutex_lock (&self->mutex);
-			if (G_UNLIKELY (self->dts_valid == FALSE))
-			{
-				GST_DEBUG_OBJECT (self, "dts_valid not set, skipping frame...");
-				self->descriptors_count++;
-				g_mutex_unlock (&self->mutex);
-				break;
-			}
-			else
-				g_mutex_unlock (&self->mutex);
+		if (G_UNLIKELY (!g_atomic_int_get (&self->dts_valid)))
+		{
+			GST_DEBUG_OBJECT (self, "dts_valid not set, skipping frame...");
+			gst_dreamsource_memtracker_skip (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+			self->descriptors_count++;
+			continue;
+		}
 
-			if (G_UNLIKELY (encoder_dts < self->dts_offset))
-			{
-				GST_DEBUG_OBJECT (self, "encoder_dts < dts_offset, skipping frame...");
-				skip_frame = TRUE;
-			}
+		if (G_UNLIKELY (encoder_dts < self->dts_offset))
+		{
+			GST_DEBUG_OBJECT (self, "encoder_dts < dts_offset, skipping frame...");
+			skip_frame = TRUE;
+		}
 // 			if (self->video_info.fps_d)
 // 				GST_BUFFER_DURATION(readbuf) = gst_util_uint64_scale (GST_SECOND, self->video_info.fps_d, self->video_info.fps_n);
 
-			if (!skip_frame && encoder_dts != GST_CLOCK_TIME_NONE)
-			{
-				if (f & CDB_FLAG_PTS_VALID)
-					encoder_pts = MPEGTIME_TO_GSTTIME(desc->stCommon.uiPTS);
-				else
-					encoder_pts = encoder_dts;
-				dts_pts_offset = encoder_pts - encoder_dts;
-
-				GstClockTime orig_dts_clock_time = encoder_dts - self->dts_offset;
-				GstClockTime orig_pts_clock_time = orig_dts_clock_time + dts_pts_offset;
-				GstClockTime calib_dts_clock_time = orig_dts_clock_time;
-
-				GstClockTime internal, external;
-				GstClockTime rate_n, rate_d;
-				GstClockTimeDiff diff;
-
-				gst_clock_get_calibration (self->encoder_clock, &internal, &external, &rate_n, &rate_d);
-
-				if (internal > orig_dts_clock_time) {
-					diff = internal - orig_dts_clock_time;
-					diff = gst_util_uint64_scale (diff, rate_n, rate_d);
-					calib_dts_clock_time = external - diff;
-				} else {
-					diff = orig_dts_clock_time - internal;
-					diff = gst_util_uint64_scale (diff, rate_n, rate_d);
-					calib_dts_clock_time = external + diff;
-				}
+		if (!skip_frame && encoder_dts != GST_CLOCK_TIME_NONE)
+		{
+			/* the pts is unwrapped next to the dts, they may wrap at different frames */
+			if (f & CDB_FLAG_PTS_VALID)
+				encoder_pts = MPEGTIME_TO_GSTTIME(gst_dreamsource_unwrap_near (COUNTER_MASK (MPEGTIME_BITS), desc->stCommon.uiPTS, dts_ticks));
+			else
+				encoder_pts = encoder_dts;
+			dts_pts_offset = encoder_pts - encoder_dts;
+
+			GstClockTime orig_dts_clock_time = encoder_dts - self->dts_offset;
+			GstClockTime orig_pts_clock_time = orig_dts_clock_time + dts_pts_offset;
+			GstClockTime calib_dts_clock_time = orig_dts_clock_time;
+
+			GstClockTime internal, external;
+			GstClockTime rate_n, rate_d;
+			GstClockTimeDiff diff;
+
+			gst_dreamsource_calibration_update (&self->calibration, self->encoder_clock);
+			internal = self->calibration.internal;
+			external = self->calibration.external;
+			rate_n = self->calibration.rate_num;
+			rate_d = self->calibration.rate_denom;
+
+			if (internal > orig_dts_clock_time) {
+				diff = internal - orig_dts_clock_time;
+				diff = gst_dreamsource_calibration_scale (&self->calibration, diff);
+				calib_dts_clock_time = external - diff;
+			} else {
+				diff = orig_dts_clock_time - internal;
+				diff = gst_dreamsource_calibration_scale (&self->calibration, diff);
+				calib_dts_clock_time = external + diff;
+			}
 
-				if ( calib_dts_clock_time < base_time )
-				{
-					GST_DEBUG_OBJECT (self, "calib_dts_clock_time < base_time, skipping frame...");
-					skip_frame = TRUE;
-				}
-				result_dts = calib_dts_clock_time - base_time;
-				result_pts = result_dts + dts_pts_offset;
+			if ( calib_dts_clock_time < base_time )
+			{
+				GST_DEBUG_OBJECT (self, "calib_dts_clock_time < base_time, skipping frame...");
+				skip_frame = TRUE;
+			}
+			result_dts = calib_dts_clock_time - base_time;
+			result_pts = result_dts + dts_pts_offset;
 
 #define extra_timestamp_debug
 #ifdef extra_timestamp_debug
-				GstClockTime my_int_time = gst_clock_get_internal_time(self->encoder_clock);
-				GstClockTime pipeline_int_time = GST_CLOCK_TIME_NONE;
-				GstClock *elemclk = gst_element_get_clock (GST_ELEMENT (self));
-				if (elemclk)
-				{
-					pipeline_int_time = gst_clock_get_internal_time(elemclk);
-					gst_object_unref (elemclk);
-				}
+			GstClockTime my_int_time = gst_clock_get_internal_time(self->encoder_clock);
+			GstClockTime pipeline_int_time = GST_CLOCK_TIME_NONE;
+			GstClock *elemclk = gst_element_get_clock (GST_ELEMENT (self));
+			if (elemclk)
+			{
+				pipeline_int_time = gst_clock_get_internal_time(elemclk);
+				gst_object_unref (elemclk);
+			}
 
-				GST_LOG_OBJECT (self, "post-calibration\n"
-				"  %" GST_TIME_FORMAT " =base_time       %" GST_TIME_FORMAT " =clock_time            %" PRId64 " =dts_pts_offset\n"
-				"  %" GST_TIME_FORMAT " =encoder_dts     %" GST_TIME_FORMAT " =orig_dts_clock_time   %" GST_TIME_FORMAT " =calib_dts_clock_time   %" GST_TIME_FORMAT " =result_dts\n"
-				"  %" GST_TIME_FORMAT " =encoder_pts     %" GST_TIME_FORMAT " =orig_pts_clock_time                                            %" GST_TIME_FORMAT " =result_pts\n"
-				"  %" GST_TIME_FORMAT " =internal        %" GST_TIME_FORMAT " =external              %" GST_TIME_FORMAT " =diff                   %" PRId64 "/%" PRId64 " =rate\n"
-				"  %" GST_TIME_FORMAT " =my_int_time     %" GST_TIME_FORMAT " =pipeline_int_time"
-				,
-				GST_TIME_ARGS (base_time), GST_TIME_ARGS (clock_time), dts_pts_offset,
-				GST_TIME_ARGS (encoder_dts), GST_TIME_ARGS (orig_dts_clock_time), GST_TIME_ARGS (calib_dts_clock_time), GST_TIME_ARGS (result_dts),
-				GST_TIME_ARGS (encoder_pts), GST_TIME_ARGS (orig_pts_clock_time), GST_TIME_ARGS (result_pts),
-				GST_TIME_ARGS (internal), GST_TIME_ARGS (external), GST_TIME_ARGS (diff), rate_n, rate_d,
-				GST_TIME_ARGS (my_int_time), GST_TIME_ARGS (pipeline_int_time)
-				);
+			GST_LOG_OBJECT (self, "post-calibration\n"
+			"  %" GST_TIME_FORMAT " =base_time       %" GST_TIME_FORMAT " =clock_time            %" PRId64 " =dts_pts_offset\n"
+			"  %" GST_TIME_FORMAT " =encoder_dts     %" GST_TIME_FORMAT " =orig_dts_clock_time   %" GST_TIME_FORMAT " =calib_dts_clock_time   %" GST_TIME_FORMAT " =result_dts\n"
+			"  %" GST_TIME_FORMAT " =encoder_pts     %" GST_TIME_FORMAT " =orig_pts_clock_time                                            %" GST_TIME_FORMAT " =result_pts\n"
+			"  %" GST_TIME_FORMAT " =internal        %" GST_TIME_FORMAT " =external              %" GST_TIME_FORMAT " =diff                   %" PRId64 "/%" PRId64 " =rate\n"
+			"  %" GST_TIME_FORMAT " =my_int_time     %" GST_TIME_FORMAT " =pipeline_int_time"
+			,
+			GST_TIME_ARGS (base_time), GST_TIME_ARGS (clock_time), dts_pts_offset,
+			GST_TIME_ARGS (encoder_dts), GST_TIME_ARGS (orig_dts_clock_time), GST_TIME_ARGS (calib_dts_clock_time), GST_TIME_ARGS (result_dts),
+			GST_TIME_ARGS (encoder_pts), GST_TIME_ARGS (orig_pts_clock_time), GST_TIME_ARGS (result_pts),
+			GST_TIME_ARGS (internal), GST_TIME_ARGS (external), GST_TIME_ARGS (diff), rate_n, rate_d,
+			GST_TIME_ARGS (my_int_time), GST_TIME_ARGS (pipeline_int_time)
+			);
 #endif
-			}
+		}
 
+		/* gather the descriptors of one frame into an access unit, drivers which don't
+		 * flag frame boundaries are split where the NAL units start a new one */
+		gboolean vcl;
+		gboolean frame_start = gst_dreamvideosource_starts_au (self, desc, au_vcl, &vcl);
+		if ((f & CDB_FLAG_FRAME_START) || (!au && !au_skipped))
+			frame_start = TRUE;
+
+		if (frame_start)
+		{
+			if (au)
+				gst_dreamvideosource_finish_au (self, &batch, au);
+			au = NULL;
+			au_skipped = skip_frame;
+			au_vcl = FALSE;
+			au_slices = 0;
 			if (!skip_frame)
 			{
-				readbuf = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, enc->cdb, VMMAPSIZE, desc->stCommon.uiOffset, desc->stCommon.uiLength, self, NULL);
+				au = gst_buffer_new ();
 				if (result_dts != GST_CLOCK_TIME_NONE)
 				{
-					GST_BUFFER_DTS(readbuf) = result_dts;
-					GST_BUFFER_PTS(readbuf) = result_pts;
+					GST_BUFFER_DTS(au) = result_dts;
+					GST_BUFFER_PTS(au) = result_pts;
 				}
+				if (!(desc->uiVideoFlags & VBD_FLAG_RAP))
+					GST_BUFFER_FLAG_SET (au, GST_BUFFER_FLAG_DELTA_UNIT);
 			}
+		}
 
-#ifdef dump
-			int wret = write(self->dumpfd, (unsigned char*)(enc->cdb + desc->stCommon.uiOffset), desc->stCommon.uiLength);
-			GST_LOG_OBJECT (self, "read %i dumped %i total %" G_GSIZE_FORMAT " ", desc->stCommon.uiLength, wret, gst_buffer_get_size (*outbuf) );
-#endif
-			self->descriptors_count++;
-			break;
+		au_vcl |= vcl;
+		if (vcl)
+			au_slices++;
+		/* a random access point may be flagged on any descriptor of the frame */
+		if (au && (desc->uiVideoFlags & VBD_FLAG_RAP))
+			GST_BUFFER_FLAG_UNSET (au, GST_BUFFER_FLAG_DELTA_UNIT);
+
+		if (au && desc->stCommon.uiLength && self->run_length && self->run_offset + self->run_length == desc->stCommon.uiOffset)
+		{
+			/* released together with the run's first descriptor */
+			gst_dreamsource_memtracker_skip (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+			self->run_length += desc->stCommon.uiLength;
+		}
+		else if (au && desc->stCommon.uiLength)
+		{
+			gst_dreamvideosource_append_run (self, au);
+			self->run_entry = gst_dreamsource_memtracker_push (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+			self->run_offset = desc->stCommon.uiOffset;
+			self->run_length = desc->stCommon.uiLength;
 		}
+		else
+			gst_dreamsource_memtracker_skip (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
 
-		if (self->descriptors_count == self->descriptors_available)
+		if (f & CDB_FLAG_FRAME_END)
 		{
-			GST_LOG_OBJECT (self, "self->descriptors_count == self->descriptors_available -> release %i consumed descriptors", self->descriptors_count);
-			if (state == READTHREADSTATE_STOP)
-				GST_DEBUG_OBJECT (self, "readthread stopping, don't write to fd anymore!");
-			/* release consumed descs */
-			else if (write(enc->fd, &self->descriptors_count, sizeof(self->descriptors_count)) != sizeof(self->descriptors_count)) {
-				GST_WARNING_OBJECT (self, "release consumed descs write error!");
-				goto stop_running;
+			if (au)
+			{
+				if (self->nal_alignment)
+					GST_BUFFER_FLAG_SET (au, GST_BUFFER_FLAG_MARKER);
+				gst_dreamvideosource_finish_au (self, &batch, au);
 			}
-			self->descriptors_available = 0;
+			au = NULL;
+			au_skipped = FALSE;
+		}
+		else if (self->nal_alignment && au && (self->run_length || gst_buffer_n_memory (au)))
+		{
+			/* low-latency: hand every slice over right away, only the first one carries timestamps.
+			 * Without FRAME_END the picture is complete with its configured number of slices */
+			GstBuffer *slice = au;
+			au = gst_buffer_new ();
+			if (GST_BUFFER_FLAG_IS_SET (slice, GST_BUFFER_FLAG_DELTA_UNIT))
+				GST_BUFFER_FLAG_SET (au, GST_BUFFER_FLAG_DELTA_UNIT);
+			if (vcl && self->video_info.slices > 0 && au_slices == self->video_info.slices)
+				GST_BUFFER_FLAG_SET (slice, GST_BUFFER_FLAG_MARKER);
+			gst_dreamvideosource_finish_au (self, &batch, slice);
 		}
 
-		if (readbuf)
+#ifdef dump
+		int wret = write(self->dumpfd, (unsigned char*)(enc->cdb + desc->stCommon.uiOffset), desc->stCommon.uiLength);
+		GST_LOG_OBJECT (self, "read %i dumped %i", desc->stCommon.uiLength, wret);
+#endif
+		self->descriptors_count++;
+	}
+
+	/* consumed descs are released once their buffers are freed downstream */
+	if (self->descriptors_count == self->descriptors_available)
+	{
+		GST_LOG_OBJECT (self, "self->descriptors_count == self->descriptors_available -> all %i descriptors consumed", self->descriptors_count);
+		self->descriptors_available = 0;
+	}
+
+	/* hand all frames of this read over, create() only takes them from the head */
+	if (!g_queue_is_empty (&batch))
+	{
+		if (!(gst_dreamsource_control_get (&self->control) & CONTROL_FLUSHING))
 		{
+			guint buffer_size, max_size_bytes;
+			guint64 max_size_time;
+
+			/* set_property writes the limits under the mutex, the 64 bit one could tear */
 			g_mutex_lock (&self->mutex);
-			if (!self->flushing)
+			buffer_size = self->buffer_size;
+			max_size_bytes = self->max_size_bytes;
+			max_size_time = self->max_size_time;
+			g_mutex_unlock (&self->mutex);
+
+			while ((readbuf = g_queue_pop_head (&batch)))
 			{
-				while (g_queue_get_length (&self->current_frames) >= self->buffer_size)
+				/* on overflow, drop the whole dependent run up to the next keyframe
+				 * rather than single frames which would break decoding until the next IDR.
+				 * create() owns the head of the ring, so it's the newest frames that go and
+				 * the queued ones keep their latency until they are pushed.
+				 * keyframes may exceed the configured depth as long as the ring has space */
+				gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (readbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+				/* slices without timestamps continue the frame before, don't cut it short */
+				gboolean frame_start = GST_BUFFER_DTS_IS_VALID (readbuf) || !self->nal_alignment;
+				if (GST_BUFFER_DTS_OR_PTS (readbuf) != GST_CLOCK_TIME_NONE)
+					queued_ts = GST_BUFFER_DTS_OR_PTS (readbuf);
+				if (keyframe)
+					drop_to_keyframe = FALSE;
+				else if (!drop_to_keyframe && frame_start && gst_dreamvideosource_queue_is_full (self, buffer_size, max_size_bytes, max_size_time))
 				{
-					GstBuffer * oldbuf = g_queue_pop_head (&self->current_frames);
-					GST_WARNING_OBJECT (self, "dropping %" GST_PTR_FORMAT " because of queue overflow! buffers count=%i", oldbuf, g_queue_get_length (&self->current_frames));
-					gst_buffer_unref(oldbuf);
-					GST_BUFFER_FLAG_SET ((GstBuffer *) g_queue_peek_head (&self->current_frames), GST_BUFFER_FLAG_DISCONT);
+					GST_WARNING_OBJECT (self, "queue overflow! buffers count=%i bytes=%i, dropping frames up to the next keyframe", gst_dreamsource_frame_ring_length (self->current_frames), gst_dreamsource_frame_ring_bytes (self->current_frames));
+					drop_to_keyframe = TRUE;
 				}
 				if (discont)
-				{
 					GST_BUFFER_FLAG_SET (readbuf, GST_BUFFER_FLAG_DISCONT);
-					discont = FALSE;
+				if (drop_to_keyframe || !gst_dreamsource_frame_ring_push (self->current_frames, readbuf, gst_buffer_get_size (readbuf), queued_ts))
+				{
+					GST_INFO_OBJECT (self, "dropping %" GST_PTR_FORMAT " because of queue overflow! buffers count=%i", readbuf, gst_dreamsource_frame_ring_length (self->current_frames));
+					gst_buffer_unref (readbuf);
+					/* frames depending on a dropped keyframe are useless as well */
+					drop_to_keyframe = TRUE;
+					discont = TRUE;
+					continue;
 				}
-				g_queue_push_tail (&self->current_frames, readbuf);
-				GST_INFO_OBJECT (self, "read %" GST_PTR_FORMAT " to queue... buffers count=%i", readbuf, g_queue_get_length (&self->current_frames));
-				g_cond_signal (&self->cond);
+				discont = FALSE;
+				GST_INFO_OBJECT (self, "read %" GST_PTR_FORMAT " to queue... buffers count=%i", readbuf, gst_dreamsource_frame_ring_length (self->current_frames));
 			}
-			else
-				gst_buffer_unref(readbuf);
-// 			g_cond_signal (&self->cond);
-			g_mutex_unlock (&self->mutex);
+		}
+		else
+		{
+			g_queue_foreach (&batch, (GFunc) gst_buffer_unref, NULL);
+			g_queue_clear (&batch);
 		}
 	}
 
-	g_assert_not_reached ();
-	return;
+	self->discont = discont;
+	self->drop_to_keyframe = drop_to_keyframe;
+	self->au = au;
+	self->au_skipped = au_skipped;
+	self->au_vcl = au_vcl;
+	self->au_slices = au_slices;
+	self->queued_ts = queued_ts;
+	gst_dreamvideosource_rearm (self);
+}
 
-	stop_running:
-	{
-//		g_mutex_unlock (&self->mutex);
-		g_cond_signal (&self->cond);
-		GST_DEBUG ("stop running, exit thread");
-		message = gst_message_new_stream_status (GST_OBJECT_CAST (self), GST_STREAM_STATUS_TYPE_LEAVE, GST_ELEMENT_CAST (GST_OBJECT_PARENT(self)));
-		g_value_init (&val, GST_TYPE_G_THREAD);
-		g_value_set_boxed (&val, self->readthread);
-		gst_message_set_stream_status_object (message, &val);
-		g_value_unset (&val);
-		GST_DEBUG_OBJECT (self, "posting LEAVE stream status");
-		gst_element_post_message (GST_ELEMENT_CAST (self), message);
+static void gst_dreamvideosource_encoder_cb (GstDreamVideoSource * self, guint32 events)
+{
+	EncoderInfo *enc = self->encoder;
+
+	if (CONTROL_STATE (gst_dreamsource_control_get (&self->control)) != READTRREADSTATE_RUNNING)
 		return;
+
+	if (events == 0 && g_atomic_int_get (&self->descriptors_stalled))
+	{
+		GST_LOG_OBJECT (self, "no buffers freed downstream meanwhile, retrying");
+		g_atomic_int_set (&self->descriptors_stalled, FALSE);
 	}
+	else if (events == 0 && self->descriptors_available == 0)
+	{
+		gst_clock_get_internal_time(self->encoder_clock);
+		GST_DEBUG_OBJECT (self, "ENCODER TIMEOUT");
+		self->discont = TRUE;
+	}
+	else if (events)
+	{
+		int rlen = read(enc->fd, enc->buffer, VBUFSIZE);
+		if (G_UNLIKELY (!self->encoder_clock))
+		{
+			GST_DEBUG_OBJECT(self, "no encoder clock yet... continue");
+			gst_dreamvideosource_rearm (self);
+			return;
+		}
+		self->clock_time = gst_clock_get_internal_time (self->encoder_clock);
+		self->base_time = gst_element_get_base_time(GST_ELEMENT(self));
+		if (rlen <= 0 || rlen % VBDSIZE ) {
+			GST_WARNING_OBJECT (self, "read error %s (%i)", strerror(errno), errno);
+			gst_dreamvideosource_read_error (self);
+			return;
+		}
+		self->descriptors_available = rlen / VBDSIZE;
+		self->descriptors_count = gst_dreamsource_memtracker_find_unseen (enc->memtracker, enc->buffer, self->descriptors_available, VBDSIZE);
+		GST_LOG_OBJECT (self, "encoder buffer was empty, %d descriptors available, %d of them still in use", self->descriptors_available, self->descriptors_count);
+		if (self->descriptors_count == self->descriptors_available)
+			g_atomic_int_set (&self->descriptors_stalled, TRUE);
+	}
+	gst_dreamvideosource_consume (self);
+}
+
+/* called on the reactor thread, which owns the descriptors, before a pause stops the encoder.
+ * Descriptors of buffers still held downstream stay outstanding, the encoder would reuse their
+ * memory after the restart, consume() returns them once they're freed */
+static void gst_dreamvideosource_release_descriptors (GstDreamVideoSource * self)
+{
+	EncoderInfo *enc = self->encoder;
+	unsigned int released;
+
+	/* the unconsumed rest of the read is returned in order behind the held ones */
+	while (self->descriptors_count < self->descriptors_available)
+	{
+		VideoBufferDescriptor *desc = (VideoBufferDescriptor*)(&enc->buffer[self->descriptors_count * VBDSIZE]);
+		gst_dreamsource_memtracker_skip (enc->memtracker, desc->stCommon.uiOffset, desc->stCommon.uiLength);
+		self->descriptors_count++;
+	}
+	self->descriptors_available = 0;
+	released = gst_dreamsource_memtracker_pop_released (enc->memtracker);
+	if (released)
+		write(enc->fd, &released, sizeof(released));
+	GST_DEBUG_OBJECT (self, "returned %u descriptors to the encoder", released);
+
+	g_mutex_lock (&self->mutex);
+	self->release_pending = FALSE;
+	g_cond_signal (&self->release_cond);
+	g_mutex_unlock (&self->mutex);
+}
+
+static void gst_dreamvideosource_control_cb (GstDreamVideoSource * self, guint32 events)
+{
+	gint word = gst_dreamsource_control_take (&self->control);
+
+	GST_LOG_OBJECT (self, "control word 0x%02x", word);
+	if (CONTROL_STATE (word) != READTRREADSTATE_RUNNING && (self->au || self->au_skipped))
+	{
+		GST_DEBUG_OBJECT (self, "paused, dropping the pending access unit");
+		gst_dreamvideosource_drop_au (self);
+	}
+	if (word & CONTROL_RELEASE)
+		gst_dreamvideosource_release_descriptors (self);
+	if (word & CONTROL_WAKEUP)
+	{
+		GST_LOG_OBJECT (self, "buffers were freed downstream");
+		g_atomic_int_set (&self->descriptors_stalled, FALSE);
+		if (CONTROL_STATE (word) == READTRREADSTATE_RUNNING)
+		{
+			gst_dreamvideosource_consume (self);
+			return;
+		}
+	}
+	gst_dreamvideosource_rearm (self);
 }
 
 static GstFlowReturn
@@ -1293,25 +1636,33 @@ gst_dreamvideosource_create (GstPushSrc * psrc, GstBuffer ** outbuf)
 {
 	GstDreamVideoSource *self = GST_DREAMVIDEOSOURCE (psrc);
 
-	GST_LOG_OBJECT (self, "new buffer requested. queue has %i buffers", g_queue_get_length (&self->current_frames));
+	if (G_UNLIKELY (!self->current_frames))
+		return GST_FLOW_FLUSHING;
 
-	g_mutex_lock (&self->mutex);
-	while (g_queue_is_empty (&self->current_frames) && !self->flushing)
+	GST_LOG_OBJECT (self, "new buffer requested. queue has %i buffers", gst_dreamsource_frame_ring_length (self->current_frames));
+
+	*outbuf = gst_dreamsource_frame_ring_wait (self->current_frames, &self->control);
+	if (!*outbuf)
 	{
-		GST_INFO_OBJECT (self, "waiting for buffer from encoder");
-		g_cond_wait (&self->cond, &self->mutex);
+		GST_INFO_OBJECT (self, "FLUSHING");
+		return GST_FLOW_FLUSHING;
 	}
 
-	*outbuf = g_queue_pop_head (&self->current_frames);
-	g_mutex_unlock (&self->mutex);
-
-	if (*outbuf)
+#if GST_CHECK_VERSION(1,14,0)
+	if (self->buffer_list && gst_dreamsource_frame_ring_length (self->current_frames) > 0)
 	{
-		GST_INFO_OBJECT (self, "pushing %" GST_PTR_FORMAT ". queue has %i buffers", *outbuf, g_queue_get_length (&self->current_frames));
+		GstBufferList *list = gst_buffer_list_new_sized (gst_dreamsource_frame_ring_length (self->current_frames) + 1);
+		do
+			gst_buffer_list_add (list, *outbuf);
+		while ((*outbuf = gst_dreamsource_frame_ring_pop (self->current_frames)));
+		GST_INFO_OBJECT (self, "pushing list of %i buffers", gst_buffer_list_length (list));
+		gst_base_src_submit_buffer_list (GST_BASE_SRC (psrc), list);
 		return GST_FLOW_OK;
 	}
-	GST_INFO_OBJECT (self, "FLUSHING");
-	return GST_FLOW_FLUSHING;
+#endif
+
+	GST_INFO_OBJECT (self, "pushing %" GST_PTR_FORMAT ". queue has %i buffers", *outbuf, gst_dreamsource_frame_ring_length (self->current_frames));
+	return GST_FLOW_OK;
 }
 
 
@@ -1319,6 +1670,7 @@ static GstStateChangeReturn gst_dreamvideosource_change_state (GstElement * elem
 {
 	GstDreamVideoSource *self = GST_DREAMVIDEOSOURCE (element);
 	GstStateChangeReturn sret = GST_STATE_CHANGE_SUCCESS;
+	guint queue_capacity;
 	int ret;
 
 	switch (transition) {
@@ -1353,14 +1705,58 @@ static GstStateChangeReturn gst_dreamvideosource_change_state (GstElement * elem
 			}
 		#endif
 			self->dts_offset = GST_CLOCK_TIME_NONE;
-			self->flushing = TRUE;
-			self->readthread = g_thread_try_new ("dreamvideosrc-read", (GThreadFunc) gst_dreamvideosource_read_thread_func, self, NULL);
-			GST_DEBUG_OBJECT (self, "started readthread @%p", self->readthread );
+			gst_dreamsource_unwrapper_reset (&self->dts_unwrapper);
+			g_mutex_lock (&self->mutex);
+			queue_capacity = self->buffer_size;
+			g_mutex_unlock (&self->mutex);
+			/* leave headroom for keyframes beyond the configured depth */
+			self->current_frames = gst_dreamsource_frame_ring_new (queue_capacity * 2);
+			if (!self->current_frames)
+				return GST_STATE_CHANGE_FAILURE;
+			/* every queued frame may hold a slot per descriptor, the tracker needs a power of two */
+			{
+				guint capacity = 1;
+				while (capacity < VDESCSPERFRAME * queue_capacity * 2)
+					capacity <<= 1;
+				if (self->encoder->memtracker)
+				{
+					gst_dreamsource_memtracker_set_notify (self->encoder->memtracker, NULL, NULL);
+					gst_dreamsource_memtracker_unref (self->encoder->memtracker);
+				}
+				self->encoder->memtracker = gst_dreamsource_memtracker_new (capacity);
+				gst_dreamsource_memtracker_set_notify (self->encoder->memtracker, (MemoryTrackerNotify) gst_dreamvideosource_memory_released, self);
+				GST_DEBUG_OBJECT (self, "tracking up to %u descriptors held downstream", capacity);
+			}
+			gst_dreamsource_control_reset (&self->control, READTRREADSTATE_PAUSED | CONTROL_FLUSHING);
+			self->discont = TRUE;
+			self->drop_to_keyframe = FALSE;
+			self->au = NULL;
+			self->au_skipped = FALSE;
+			self->au_vcl = FALSE;
+			self->au_slices = 0;
+			self->run_length = 0;
+			self->queued_ts = GST_CLOCK_TIME_NONE;
+			/* the encoder fd is only watched while running, commands arm it */
+			self->encoder_watch = gst_dreamsource_reactor_add (self->encoder->fd, 0, (ReactorFunc) gst_dreamvideosource_encoder_cb, self);
+			if (self->encoder_watch)
+				self->control_watch = gst_dreamsource_reactor_add (self->control.fd, EPOLLIN, (ReactorFunc) gst_dreamvideosource_control_cb, self);
+			if (!self->control_watch)
+			{
+				gst_dreamsource_reactor_remove (self->encoder_watch);
+				self->encoder_watch = NULL;
+				gst_dreamsource_frame_ring_free (self->current_frames, (GDestroyNotify) gst_buffer_unref);
+				self->current_frames = NULL;
+				return GST_STATE_CHANGE_FAILURE;
+			}
+			GST_DEBUG_OBJECT (self, "watching encoder fd=%i", self->encoder->fd);
+			g_mutex_lock (&self->mutex);
+			self->queue_capacity = queue_capacity;
+			g_mutex_unlock (&self->mutex);
 			break;
 		case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 			g_mutex_lock (&self->mutex);
 			GST_LOG_OBJECT (self, "GST_STATE_CHANGE_PAUSED_TO_PLAYING");
-			self->dts_valid = FALSE;
+			g_atomic_int_set (&self->dts_valid, FALSE);
 			GstClock *pipeline_clock = gst_element_get_clock (GST_ELEMENT (self));
 			if (pipeline_clock)
 			{
@@ -1380,7 +1776,6 @@ static GstStateChangeReturn gst_dreamvideosource_change_state (GstElement * elem
 			if ( ret != 0 )
 				goto fail;
 			self->descriptors_available = 0;
-			CLEAR_COMMAND (self);
 			g_mutex_unlock (&self->mutex);
 			break;
 		default:
@@ -1393,18 +1788,19 @@ static GstStateChangeReturn gst_dreamvideosource_change_state (GstElement * elem
 	switch (transition) {
 		case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 			g_mutex_lock (&self->mutex);
-			SEND_COMMAND (self, CONTROL_RUN);
+			gst_dreamsource_control_set_state (&self->control, READTRREADSTATE_RUNNING);
 			GST_INFO_OBJECT (self, "started encoder!");
 			g_mutex_unlock (&self->mutex);
 			break;
 		case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 			g_mutex_lock (&self->mutex);
 			GST_DEBUG_OBJECT (self, "GST_STATE_CHANGE_PLAYING_TO_PAUSED self->descriptors_count=%i self->descriptors_available=%i", self->descriptors_count, self->descriptors_available);
-			SEND_COMMAND (self, CONTROL_PAUSE);
-			if (self->descriptors_count < self->descriptors_available)
-				self->descriptors_count = self->descriptors_available;
-			if (self->descriptors_count)
-				write(self->encoder->fd, &self->descriptors_count, sizeof(self->descriptors_count));
+			gst_dreamsource_control_set_state (&self->control, READTRREADSTATE_PAUSED);
+			/* the reactor thread returns the descriptors, wait for it before stopping the encoder */
+			self->release_pending = TRUE;
+			gst_dreamsource_control_set_flags (&self->control, CONTROL_RELEASE);
+			while (self->release_pending)
+				g_cond_wait (&self->release_cond, &self->mutex);
 			ret = ioctl(self->encoder->fd, VENC_STOP);
 			if ( ret != 0 )
 				goto fail;
@@ -1421,9 +1817,17 @@ static GstStateChangeReturn gst_dreamvideosource_change_state (GstElement * elem
 			if (!self->dreamaudiosrc)
 				gst_clock_set_calibration (self->encoder_clock, 0, 0, 1, 1);
 #endif
-			GST_DEBUG_OBJECT (self, "stopping readthread @%p...", self->readthread);
-			SEND_COMMAND (self, CONTROL_STOP);
-			g_thread_join (self->readthread);
+			GST_DEBUG_OBJECT (self, "stop watching encoder fd=%i", self->encoder->fd);
+			gst_dreamsource_reactor_remove (self->control_watch);
+			gst_dreamsource_reactor_remove (self->encoder_watch);
+			self->control_watch = NULL;
+			self->encoder_watch = NULL;
+			gst_dreamvideosource_drop_au (self);
+			gst_dreamsource_frame_ring_free (self->current_frames, (GDestroyNotify) gst_buffer_unref);
+			self->current_frames = NULL;
+			g_mutex_lock (&self->mutex);
+			self->queue_capacity = 0;
+			g_mutex_unlock (&self->mutex);
 			if (self->dreamaudiosrc)
 				gst_object_unref(self->dreamaudiosrc);
 			self->dreamaudiosrc = NULL;
@@ -1460,8 +1864,8 @@ gst_dreamvideosource_dispose (GObject * gobject)
 		gst_caps_unref(self->current_caps);
 	if (self->new_caps)
 		gst_caps_unref(self->new_caps);
+	g_cond_clear (&self->release_cond);
 	g_mutex_clear (&self->mutex);
-	g_cond_clear (&self->cond);
 	GST_DEBUG_OBJECT (self, "disposed");
 	G_OBJECT_CLASS (parent_class)->dispose (gobject);
 }
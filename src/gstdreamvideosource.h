@@ -156,6 +156,17 @@ struct _VideoFormatInfo {
 #define VBDSIZE 	sizeof(VideoBufferDescriptor)
 #define VBUFSIZE	(1024*16)
 #define VMMAPSIZE	(1024*1024*6)
+#define VDESCSPERFRAME	(slices_max + 4)	/* slices plus AUD, SPS, PPS and SEI */
+
+#define H264_NAL_SLICE	1
+#define H264_NAL_SLICE_DPA	2
+#define H264_NAL_SLICE_DPB	3
+#define H264_NAL_SLICE_DPC	4
+#define H264_NAL_SLICE_IDR	5
+#define H264_NAL_SEI	6
+#define H264_NAL_SPS	7
+#define H264_NAL_PPS	8
+#define H264_NAL_AUD	9
 
 #define GST_TYPE_DREAMVIDEOSOURCE \
   (gst_dreamvideosource_get_type())
@@ -190,6 +201,9 @@ struct _GstDreamVideoSource
 
 	unsigned int descriptors_available;
 	unsigned int descriptors_count;
+	gint descriptors_stalled;
+	TimestampUnwrapper dts_unwrapper;
+	ClockCalibration calibration;
 
 	int dumpfd;
 
@@ -197,15 +211,34 @@ struct _GstDreamVideoSource
 	gint64 dts_offset;
 
 	GMutex mutex;
-	GCond cond;
-	int control_sock[2];
-
-	gboolean flushing;
-	gboolean dts_valid;
-
-	GThread *readthread;
-	GQueue current_frames;
+	GCond release_cond;
+	gboolean release_pending;       /* a pause waits for the reactor thread to return the descriptors */
+	ControlChannel control;
+
+	volatile gint dts_valid;
+
+	/* read side, driven by the reactor callbacks */
+	ReactorWatch *encoder_watch;
+	ReactorWatch *control_watch;
+	GstClockTime clock_time, base_time;
+	gboolean discont;
+	gboolean drop_to_keyframe;
+	GstBuffer *au;
+	gboolean au_skipped;
+	gboolean au_vcl;                /* the pending access unit has slice data */
+	guint au_slices;                /* slices of the pending access unit read so far */
+	MemoryTrackerEntry *run_entry;  /* contiguous descriptors not yet wrapped into the access unit */
+	guint run_offset, run_length;
+	GstClockTime queued_ts;
+
+	FrameRing *current_frames;
 	guint buffer_size;
+	guint queue_capacity;           /* buffer_size the ring and tracker were sized for, 0 when stopped */
+	guint max_size_bytes;
+	guint64 max_size_time;
+	gboolean buffer_list;
+	gboolean low_latency;
+	gboolean nal_alignment;
 
 	GstClock *encoder_clock;
 };
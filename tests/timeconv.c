@@ -0,0 +1,200 @@
+/*
+ * GStreamer dreamsource unit tests
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Property GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/check/gstcheck.h>
+#include "gstdreamsource.h"
+
+#define RANDOM_SAMPLES                     (1 << 20)
+#define BENCH_ITERATIONS                   (1 << 24)
+
+/*
+ * The expected values of the exhaustive runs are kept as quotient and
+ * remainder and advanced by num per tick, so the reference needs no division
+ * and the whole counter range can be walked in reasonable time. The hot loops
+ * compare with a plain if, every fail_unless would also write a check point.
+ */
+GST_START_TEST (test_mpegtime_exhaustive)
+{
+	guint64 ticks, quot = 0, rem = 0;
+
+	for (ticks = 0; ticks <= COUNTER_MASK (MPEGTIME_BITS); ticks++)
+	{
+		if (G_UNLIKELY (MPEGTIME_TO_GSTTIME (ticks) != quot))
+			fail ("mpegtime %" G_GUINT64_FORMAT " converted to %" G_GUINT64_FORMAT ", expected %" G_GUINT64_FORMAT, ticks, MPEGTIME_TO_GSTTIME (ticks), quot);
+		quot += 100000 / 9;
+		rem += 100000 % 9;
+		if (rem >= 9)
+		{
+			quot++;
+			rem -= 9;
+		}
+	}
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_enctime_exhaustive)
+{
+	guint64 ticks, quot = 0, rem = 0;
+
+	for (ticks = 0; ticks <= COUNTER_MASK (STC_BITS); ticks++)
+	{
+		if (G_UNLIKELY (ENCTIME_TO_GSTTIME (ticks) != quot))
+			fail ("enctime %" G_GUINT64_FORMAT " converted to %" G_GUINT64_FORMAT ", expected %" G_GUINT64_FORMAT, ticks, ENCTIME_TO_GSTTIME (ticks), quot);
+		quot += 1000 / 27;
+		rem += 1000 % 27;
+		if (rem >= 27)
+		{
+			quot++;
+			rem -= 27;
+		}
+	}
+}
+
+GST_END_TEST;
+
+/* beyond the counter widths, up to where the result still fits 64 bits */
+GST_START_TEST (test_timeconv_random)
+{
+	GRand *rng = g_rand_new_with_seed (0xd7ea);
+	guint64 mpeg_max = gst_util_uint64_scale (G_MAXUINT64, 9, 100000);
+	guint64 enc_max = gst_util_uint64_scale (G_MAXUINT64, 27, 1000);
+	guint i;
+
+	fail_unless_equals_uint64 (MPEGTIME_TO_GSTTIME (mpeg_max), gst_util_uint64_scale (mpeg_max, 100000, 9));
+	fail_unless_equals_uint64 (ENCTIME_TO_GSTTIME (enc_max), gst_util_uint64_scale (enc_max, 1000, 27));
+	for (i = 0; i < RANDOM_SAMPLES; i++)
+	{
+		guint64 value = ((guint64) g_rand_int (rng) << 32) | g_rand_int (rng);
+		guint64 mpeg = value % mpeg_max, enc = value % enc_max;
+
+		if (G_UNLIKELY (MPEGTIME_TO_GSTTIME (mpeg) != gst_util_uint64_scale (mpeg, 100000, 9)))
+			fail ("mpegtime %" G_GUINT64_FORMAT " converted to %" G_GUINT64_FORMAT, mpeg, MPEGTIME_TO_GSTTIME (mpeg));
+		if (G_UNLIKELY (ENCTIME_TO_GSTTIME (enc) != gst_util_uint64_scale (enc, 1000, 27)))
+			fail ("enctime %" G_GUINT64_FORMAT " converted to %" G_GUINT64_FORMAT, enc, ENCTIME_TO_GSTTIME (enc));
+	}
+	g_rand_free (rng);
+}
+
+GST_END_TEST;
+
+static void
+check_calibration (GstClockTime rate_num, GstClockTime rate_denom, GRand *rng)
+{
+	ClockCalibration calibration = { 0, };
+	guint i;
+
+	calibration.rate_num = rate_num;
+	calibration.rate_denom = rate_denom;
+	calibration.rate = gst_util_uint64_scale (rate_num, G_GUINT64_CONSTANT (1) << 32, rate_denom);
+
+	for (i = 0; i < RANDOM_SAMPLES; i++)
+	{
+		/* anything up to a day away from the calibration point */
+		GstClockTime value = (GstClockTime) g_rand_double_range (rng, 0, 24 * 3600 * (gdouble) GST_SECOND);
+		GstClockTime expected = gst_util_uint64_scale (value, rate_num, rate_denom);
+		GstClockTime scaled = gst_dreamsource_calibration_scale (&calibration, value);
+
+		/* the Q32 rate is rounded down, so the result never overshoots */
+		if (G_UNLIKELY (scaled > expected || expected - scaled > (value >> 32) + 1))
+			fail ("%" G_GUINT64_FORMAT " scaled to %" G_GUINT64_FORMAT ", expected %" G_GUINT64_FORMAT, value, scaled, expected);
+	}
+}
+
+GST_START_TEST (test_calibration_scale)
+{
+	GRand *rng = g_rand_new_with_seed (0xd7ea);
+	ClockCalibration identity = { 0, 0, 1, 1, G_GUINT64_CONSTANT (1) << 32 };
+
+	fail_unless_equals_uint64 (gst_dreamsource_calibration_scale (&identity, G_MAXUINT64 - 1), G_MAXUINT64 - 1);
+	/* a few hundred ppm of drift either way, as slaved clocks see it */
+	check_calibration (1000000, 1000000 - 250, rng);
+	check_calibration (1000000 - 250, 1000000, rng);
+	check_calibration (G_GUINT64_CONSTANT (27000000017), G_GUINT64_CONSTANT (27000000000), rng);
+	check_calibration (G_GUINT64_CONSTANT (999999937), G_GUINT64_CONSTANT (1000000007), rng);
+	g_rand_free (rng);
+}
+
+GST_END_TEST;
+
+/*
+ * Not a pass/fail test, only reports ns per conversion of the fixed-point
+ * kernels next to gst_util_uint64_scale. The sum is stored so none of the
+ * loops can be optimized away. Only run with DREAMSOURCE_CHECK_BENCHMARK set.
+ */
+static volatile guint64 bench_sink;
+
+#define BENCH(label, expr) G_STMT_START {                                  \
+	guint64 ticks, sum = 0;                                                \
+	gint64 start = g_get_monotonic_time ();                                \
+	for (ticks = 0; ticks < BENCH_ITERATIONS; ticks++)                     \
+		sum += (expr);                                                     \
+	bench_sink = sum;                                                      \
+	g_print ("%-40s %6.2f ns\n", label,                                    \
+	    (g_get_monotonic_time () - start) * 1000.0 / BENCH_ITERATIONS);    \
+} G_STMT_END
+
+GST_START_TEST (test_timeconv_benchmark)
+{
+	ClockCalibration calibration = { 0, };
+	guint64 base = G_GUINT64_CONSTANT (1) << 32;
+
+	calibration.rate_num = 1000000;
+	calibration.rate_denom = 1000000 - 250;
+	calibration.rate = gst_util_uint64_scale (calibration.rate_num, G_GUINT64_CONSTANT (1) << 32, calibration.rate_denom);
+
+	BENCH ("MPEGTIME_TO_GSTTIME", MPEGTIME_TO_GSTTIME (base + ticks));
+	BENCH ("gst_util_uint64_scale (100000, 9)", gst_util_uint64_scale (base + ticks, 100000, 9));
+	BENCH ("ENCTIME_TO_GSTTIME", ENCTIME_TO_GSTTIME (base + ticks));
+	BENCH ("gst_util_uint64_scale (1000, 27)", gst_util_uint64_scale (base + ticks, 1000, 27));
+	BENCH ("gst_dreamsource_calibration_scale", gst_dreamsource_calibration_scale (&calibration, base + ticks));
+	BENCH ("gst_util_uint64_scale (rate)", gst_util_uint64_scale (base + ticks, calibration.rate_num, calibration.rate_denom));
+}
+
+GST_END_TEST;
+
+static Suite *
+timeconv_suite (void)
+{
+	Suite *s = suite_create ("timeconv");
+	TCase *tc_chain = tcase_create ("general");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_test (tc_chain, test_timeconv_random);
+	tcase_add_test (tc_chain, test_calibration_scale);
+
+	/* 2^33 + 2^32 conversions take minutes, so they're opt-in */
+	if (g_getenv ("DREAMSOURCE_CHECK_EXHAUSTIVE"))
+	{
+		TCase *tc_exhaustive = tcase_create ("exhaustive");
+		suite_add_tcase (s, tc_exhaustive);
+		tcase_set_timeout (tc_exhaustive, 3600);
+		tcase_add_test (tc_exhaustive, test_mpegtime_exhaustive);
+		tcase_add_test (tc_exhaustive, test_enctime_exhaustive);
+	}
+
+	if (g_getenv ("DREAMSOURCE_CHECK_BENCHMARK"))
+	{
+		TCase *tc_bench = tcase_create ("benchmark");
+		suite_add_tcase (s, tc_bench);
+		tcase_add_test (tc_bench, test_timeconv_benchmark);
+	}
+	return s;
+}
+
+GST_CHECK_MAIN (timeconv);
@@ -0,0 +1,403 @@
+/*
+ * GStreamer dreamsource unit tests
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Property GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/dvb/dmx.h>
+#include <linux/dvb/version.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+
+#define SERVICE_REF                        "1:0:19:2B66:3F3:1:C00000:0:0:0:"
+#define REQUEST_LINE                       "GET /web/stream?StreamService=" SERVICE_REF " HTTP/1.0"
+#define WAIT_TIMEOUT                       (10 * G_TIME_SPAN_SECOND)
+
+/*
+ * Loopback stand-in for the enigma2 streaming server: answers every request with
+ * a canned response and hangs up on the first drops connections right after it,
+ * the remaining ones stay open until the server is stopped.
+ */
+typedef struct
+{
+	int fd;
+	guint16 port;
+	const gchar *response;
+	guint drops;
+
+	GThread *thread;
+	GMutex lock;
+	GPtrArray *requests;
+	GArray *open_fds;
+	gboolean stopping;
+} FakeUpstream;
+
+static gchar *
+fake_upstream_read_request (int fd)
+{
+	GString *request = g_string_new (NULL);
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	gchar buffer[512], *eol;
+
+	while (!strstr (request->str, "\r\n\r\n") && poll (&pfd, 1, 5000) > 0)
+	{
+		ssize_t n = read (fd, buffer, sizeof (buffer));
+		if (n <= 0)
+			break;
+		g_string_append_len (request, buffer, n);
+	}
+	if ((eol = strstr (request->str, "\r\n")))
+		g_string_truncate (request, eol - request->str);
+	return g_string_free (request, FALSE);
+}
+
+static gpointer
+fake_upstream_thread_func (FakeUpstream * upstream)
+{
+	struct pollfd pfd = { .fd = upstream->fd, .events = POLLIN };
+	guint i;
+
+	while (1)
+	{
+		g_mutex_lock (&upstream->lock);
+		if (upstream->stopping)
+		{
+			g_mutex_unlock (&upstream->lock);
+			break;
+		}
+		g_mutex_unlock (&upstream->lock);
+
+		if (poll (&pfd, 1, 50) <= 0)
+			continue;
+		int fd = accept (upstream->fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		gchar *request = fake_upstream_read_request (fd);
+		fail_unless (write (fd, upstream->response, strlen (upstream->response)) == (ssize_t) strlen (upstream->response));
+
+		g_mutex_lock (&upstream->lock);
+		g_ptr_array_add (upstream->requests, request);
+		if (upstream->requests->len <= upstream->drops)
+			close (fd);
+		else
+			g_array_append_val (upstream->open_fds, fd);
+		g_mutex_unlock (&upstream->lock);
+	}
+
+	for (i = 0; i < upstream->open_fds->len; i++)
+		close (g_array_index (upstream->open_fds, int, i));
+	return NULL;
+}
+
+static FakeUpstream *
+fake_upstream_new (const gchar * response, guint drops)
+{
+	FakeUpstream *upstream = g_new0 (FakeUpstream, 1);
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	upstream->fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	fail_unless (upstream->fd >= 0);
+	fail_unless (bind (upstream->fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+	fail_unless (listen (upstream->fd, 4) == 0);
+	fail_unless (getsockname (upstream->fd, (struct sockaddr *) &addr, &len) == 0);
+	upstream->port = ntohs (addr.sin_port);
+	upstream->response = response;
+	upstream->drops = drops;
+	g_mutex_init (&upstream->lock);
+	upstream->requests = g_ptr_array_new_with_free_func (g_free);
+	upstream->open_fds = g_array_new (FALSE, FALSE, sizeof (int));
+	upstream->thread = g_thread_new ("fake-upstream", (GThreadFunc) fake_upstream_thread_func, upstream);
+	return upstream;
+}
+
+static guint
+fake_upstream_get_requests (FakeUpstream * upstream)
+{
+	guint requests;
+
+	g_mutex_lock (&upstream->lock);
+	requests = upstream->requests->len;
+	g_mutex_unlock (&upstream->lock);
+	return requests;
+}
+
+static void
+fake_upstream_free (FakeUpstream * upstream)
+{
+	g_mutex_lock (&upstream->lock);
+	upstream->stopping = TRUE;
+	g_mutex_unlock (&upstream->lock);
+	g_thread_join (upstream->thread);
+	close (upstream->fd);
+	g_ptr_array_unref (upstream->requests);
+	g_array_unref (upstream->open_fds);
+	g_mutex_clear (&upstream->lock);
+	g_free (upstream);
+}
+
+/*
+ * Stand-in for the demux: a fifo takes the place of the device node and the
+ * demux ioctls on it are recorded instead of reaching the kernel. The test
+ * binary is linked with -export-dynamic, so this ioctl also serves the plugin.
+ */
+static GMutex demux_lock;
+static struct stat demux_stat;
+static GArray *demux_pids;
+
+int
+ioctl (int fd, unsigned long request, ...)
+{
+	struct stat st;
+	va_list args;
+	void *arg;
+
+	va_start (args, request);
+	arg = va_arg (args, void *);
+	va_end (args);
+
+	if (!demux_pids || fstat (fd, &st) < 0 || st.st_dev != demux_stat.st_dev || st.st_ino != demux_stat.st_ino)
+		return syscall (SYS_ioctl, fd, request, arg);
+
+	g_mutex_lock (&demux_lock);
+	if (request == DMX_SET_PES_FILTER)
+	{
+		guint pid = ((struct dmx_pes_filter_params *) arg)->pid;
+		g_array_append_val (demux_pids, pid);
+	}
+	else if (request == DMX_ADD_PID)
+	{
+#if DVB_API_VERSION > 3
+		guint pid = *(uint16_t *) arg;
+#else
+		guint pid = (uintptr_t) arg;
+#endif
+		g_array_append_val (demux_pids, pid);
+	}
+	g_mutex_unlock (&demux_lock);
+	return 0;
+}
+
+static guint
+fake_demux_get_pids (void)
+{
+	guint pids;
+
+	g_mutex_lock (&demux_lock);
+	pids = demux_pids->len;
+	g_mutex_unlock (&demux_lock);
+	return pids;
+}
+
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
+	GST_PAD_SINK,
+	GST_PAD_ALWAYS,
+	GST_STATIC_CAPS_ANY);
+
+static GstPad *mysinkpad;
+static GstBus *bus;
+
+static GstElement *
+setup_tssource (FakeUpstream * upstream, gboolean reconnect, const gchar * demux_device)
+{
+	GstElement *src = gst_check_setup_element ("dreamtssource");
+
+	g_object_set (src, "sref", SERVICE_REF, "host", "127.0.0.1", "port", (guint) upstream->port, "reconnect", reconnect, NULL);
+	if (demux_device)
+		g_object_set (src, "demux-device", demux_device, NULL);
+	mysinkpad = gst_check_setup_sink_pad (src, &sinktemplate);
+	gst_pad_set_active (mysinkpad, TRUE);
+	bus = gst_bus_new ();
+	gst_element_set_bus (src, bus);
+	fail_if (gst_element_set_state (src, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE);
+	return src;
+}
+
+static void
+teardown_tssource (GstElement * src)
+{
+	fail_unless_equals_int (gst_element_set_state (src, GST_STATE_NULL), GST_STATE_CHANGE_SUCCESS);
+	gst_element_set_bus (src, NULL);
+	gst_object_unref (bus);
+	bus = NULL;
+	gst_pad_set_active (mysinkpad, FALSE);
+	gst_check_teardown_sink_pad (src);
+	gst_check_teardown_element (src);
+	gst_check_drop_buffers ();
+}
+
+/* waits until the upstream saw count requests, an error on the bus fails the test */
+static void
+wait_for_requests (FakeUpstream * upstream, guint count)
+{
+	gint64 deadline = g_get_monotonic_time () + WAIT_TIMEOUT;
+
+	while (fake_upstream_get_requests (upstream) < count)
+	{
+		GstMessage *msg = gst_bus_timed_pop_filtered (bus, 50 * GST_MSECOND, GST_MESSAGE_ERROR);
+		if (msg)
+		{
+			GError *err = NULL;
+			gst_message_parse_error (msg, &err, NULL);
+			fail_if (TRUE, "unexpected error: %s", err->message);
+		}
+		fail_unless (g_get_monotonic_time () < deadline, "only %u of %u requests", fake_upstream_get_requests (upstream), count);
+	}
+}
+
+/* returns the error message posted within the timeout */
+static gchar *
+wait_for_error (void)
+{
+	GstMessage *msg = gst_bus_timed_pop_filtered (bus, WAIT_TIMEOUT * GST_USECOND, GST_MESSAGE_ERROR);
+	gchar *debug = NULL;
+
+	fail_unless (msg != NULL, "no error posted");
+	gst_message_parse_error (msg, NULL, &debug);
+	gst_message_unref (msg);
+	return debug;
+}
+
+GST_START_TEST (test_tssource_reconnect)
+{
+	FakeUpstream *upstream = fake_upstream_new ("HTTP/1.0 200 OK\r\nContent-Type: video/mpeg\r\n\r\n+0\n", 2);
+	GstElement *src = setup_tssource (upstream, TRUE, NULL);
+	guint i;
+
+	/* two hang ups, each answered with a new request after the backoff */
+	wait_for_requests (upstream, 3);
+	for (i = 0; i < 3; i++)
+		fail_unless_equals_string (g_ptr_array_index (upstream->requests, i), REQUEST_LINE);
+
+	teardown_tssource (src);
+	fake_upstream_free (upstream);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_tssource_no_reconnect)
+{
+	FakeUpstream *upstream = fake_upstream_new ("HTTP/1.0 200 OK\r\nContent-Type: video/mpeg\r\n\r\n+0\n", 1);
+	GstElement *src = setup_tssource (upstream, FALSE, NULL);
+	gchar *debug = wait_for_error ();
+
+	fail_unless_equals_int (fake_upstream_get_requests (upstream), 1);
+	g_free (debug);
+
+	teardown_tssource (src);
+	fake_upstream_free (upstream);
+}
+
+GST_END_TEST;
+
+/* a failed request is never retried, the service was never established */
+GST_START_TEST (test_tssource_refused)
+{
+	FakeUpstream *upstream = fake_upstream_new ("HTTP/1.0 403 Forbidden\r\n\r\n", 1);
+	GstElement *src = setup_tssource (upstream, TRUE, NULL);
+	gchar *debug = wait_for_error ();
+
+	fail_unless (strstr (debug, "403 Forbidden") != NULL, "unexpected error %s", debug);
+	/* well past the first reconnect delay */
+	g_usleep (G_USEC_PER_SEC);
+	fail_unless_equals_int (fake_upstream_get_requests (upstream), 1);
+	g_free (debug);
+
+	teardown_tssource (src);
+	fake_upstream_free (upstream);
+}
+
+GST_END_TEST;
+
+/* the pids of a +demux:pids line are filtered on the announced demux */
+GST_START_TEST (test_tssource_demux_pids)
+{
+	static const guint expected[] = { 0x00, 0x1f, 0x44, 0x45 };
+	gchar *dir = g_dir_make_tmp ("dreamtssource-XXXXXX", NULL);
+	gchar *prefix = g_build_filename (dir, "demux", NULL);
+	gchar *device = g_strconcat (prefix, "1", NULL);
+	gint64 deadline = g_get_monotonic_time () + WAIT_TIMEOUT;
+	FakeUpstream *upstream;
+	GstElement *src;
+	guint i;
+
+	fail_unless (dir != NULL);
+	fail_unless (mkfifo (device, 0600) == 0);
+	fail_unless (stat (device, &demux_stat) == 0);
+	demux_pids = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	upstream = fake_upstream_new ("HTTP/1.0 200 OK\r\nContent-Type: video/mpeg\r\n\r\n+1:0,1f,44,45\n", 0);
+	src = setup_tssource (upstream, TRUE, prefix);
+	while (fake_demux_get_pids () < G_N_ELEMENTS (expected))
+	{
+		GstMessage *msg = gst_bus_timed_pop_filtered (bus, 50 * GST_MSECOND, GST_MESSAGE_ERROR);
+		if (msg)
+		{
+			gchar *debug = NULL;
+			gst_message_parse_error (msg, NULL, &debug);
+			fail_if (TRUE, "unexpected error: %s", debug);
+		}
+		fail_unless (g_get_monotonic_time () < deadline, "only %u of %u pids filtered", fake_demux_get_pids (), G_N_ELEMENTS (expected));
+	}
+
+	g_mutex_lock (&demux_lock);
+	fail_unless_equals_int (demux_pids->len, G_N_ELEMENTS (expected));
+	for (i = 0; i < G_N_ELEMENTS (expected); i++)
+		fail_unless_equals_int (g_array_index (demux_pids, guint, i), expected[i]);
+	g_mutex_unlock (&demux_lock);
+
+	teardown_tssource (src);
+	fake_upstream_free (upstream);
+	g_array_unref (demux_pids);
+	demux_pids = NULL;
+	unlink (device);
+	rmdir (dir);
+	g_free (device);
+	g_free (prefix);
+	g_free (dir);
+}
+
+GST_END_TEST;
+
+static Suite *
+tssource_suite (void)
+{
+	Suite *s = suite_create ("tssource");
+	TCase *tc_chain = tcase_create ("general");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_set_timeout (tc_chain, 30);
+	tcase_add_test (tc_chain, test_tssource_reconnect);
+	tcase_add_test (tc_chain, test_tssource_no_reconnect);
+	tcase_add_test (tc_chain, test_tssource_refused);
+	tcase_add_test (tc_chain, test_tssource_demux_pids);
+	return s;
+}
+
+GST_CHECK_MAIN (tssource);
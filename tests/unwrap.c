@@ -0,0 +1,136 @@
+/*
+ * GStreamer dreamsource unit tests
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Property GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/check/gstcheck.h>
+#include "gstdreamsource.h"
+
+/* feeds a counter running over several wraps in steps and checks it's extended without a jump */
+static void
+check_monotonic (guint bits, guint64 start, guint64 step, guint count)
+{
+	TimestampUnwrapper unwrapper;
+	guint64 mask = COUNTER_MASK (bits);
+	guint64 expected = start;
+	guint i;
+
+	gst_dreamsource_unwrapper_init (&unwrapper, bits);
+	for (i = 0; i < count; i++, expected += step)
+	{
+		guint64 unwrapped = gst_dreamsource_unwrapper_unwrap (&unwrapper, expected & mask);
+		/* millions of steps, a fail_unless for each would write as many check points */
+		if (G_UNLIKELY (unwrapped != expected))
+			fail ("step %u unwrapped to %" G_GUINT64_FORMAT ", expected %" G_GUINT64_FORMAT, i, unwrapped, expected);
+	}
+	fail_unless (expected > mask * 2, "the counter should have wrapped twice");
+}
+
+GST_START_TEST (test_unwrap_wraps)
+{
+	/* 90 kHz PTS at 25 fps, 27 MHz STC sampled every 10s, 27 MHz STC snapshots */
+	check_monotonic (MPEGTIME_BITS, COUNTER_MASK (MPEGTIME_BITS) - 10 * 3600, 3600, 2 * (COUNTER_MASK (MPEGTIME_BITS) / 3600) + 20);
+	check_monotonic (STC_BITS, COUNTER_MASK (STC_BITS) - 27000000, 270000000, 40);
+	check_monotonic (STCSNAPSHOT_BITS, 0, G_GUINT64_CONSTANT (1) << 39, 20);
+	/* steps of almost half the range still count as forward */
+	check_monotonic (MPEGTIME_BITS, 12345, COUNTER_MASK (MPEGTIME_BITS) >> 1, 10);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_unwrap_reorder)
+{
+	TimestampUnwrapper unwrapper;
+	guint64 mask = COUNTER_MASK (MPEGTIME_BITS);
+	guint64 base = mask + 1;
+
+	gst_dreamsource_unwrapper_init (&unwrapper, MPEGTIME_BITS);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, mask - 3000), mask - 3000);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 3000), base + 3000);
+	/* a B-frame pts from before the wrap is not another wrap */
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, mask - 600), mask - 600);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 6600), base + 6600);
+	/* high bits beyond the counter width are ignored */
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, base + 10200), base + 10200);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_unwrap_near)
+{
+	guint64 mask = COUNTER_MASK (MPEGTIME_BITS);
+
+	fail_unless_equals_uint64 (gst_dreamsource_unwrap_near (mask, 100, 50), 100);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrap_near (mask, 50, 100), 50);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrap_near (mask, 10, mask - 10), mask + 11);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrap_near (mask, mask - 10, 3 * (mask + 1) + 10), 3 * (mask + 1) - 11);
+	/* a pts next to a dts which already wrapped */
+	fail_unless_equals_uint64 (gst_dreamsource_unwrap_near (mask, mask - 3000, 2 * (mask + 1) + 600), 2 * (mask + 1) - 3001);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_unwrap_before_zero)
+{
+	TimestampUnwrapper unwrapper;
+	guint64 mask = COUNTER_MASK (MPEGTIME_BITS);
+
+	/* stepping back past 0 before the first wrap must not jump a whole cycle ahead */
+	fail_unless_equals_uint64 (gst_dreamsource_unwrap_near (mask, mask - 100, 50), 0);
+
+	gst_dreamsource_unwrapper_init (&unwrapper, MPEGTIME_BITS);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 50), 50);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, mask - 100), 0);
+	/* and the following samples continue from there */
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 3650), 3650);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 7250), 7250);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_unwrap_reset)
+{
+	TimestampUnwrapper unwrapper;
+	guint64 mask = COUNTER_MASK (STC_BITS);
+
+	gst_dreamsource_unwrapper_init (&unwrapper, STC_BITS);
+	gst_dreamsource_unwrapper_unwrap (&unwrapper, mask - 5);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 5), mask + 6);
+
+	/* after a reset the first value is taken as it is */
+	gst_dreamsource_unwrapper_reset (&unwrapper);
+	fail_unless (!unwrapper.valid);
+	fail_unless_equals_uint64 (gst_dreamsource_unwrapper_unwrap (&unwrapper, 5), 5);
+}
+
+GST_END_TEST;
+
+static Suite *
+unwrap_suite (void)
+{
+	Suite *s = suite_create ("unwrap");
+	TCase *tc_chain = tcase_create ("general");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_test (tc_chain, test_unwrap_wraps);
+	tcase_add_test (tc_chain, test_unwrap_reorder);
+	tcase_add_test (tc_chain, test_unwrap_near);
+	tcase_add_test (tc_chain, test_unwrap_before_zero);
+	tcase_add_test (tc_chain, test_unwrap_reset);
+	return s;
+}
+
+GST_CHECK_MAIN (unwrap);